@@ -63,6 +63,11 @@
 // Configuration
 #include "config.h"
 
+// hand MAVLink frames to the serial driver a whole header, payload or
+// checksum at a time rather than byte by byte. See comm_send_buffer()
+#define MAVLINK_SEND_UART_BYTES(chan, buf, len) comm_send_buffer(chan, (const uint8_t *)(buf), len)
+void comm_send_buffer(uint8_t chan, const uint8_t *buf, uint16_t len);
+
 #include <GCS_MAVLink.h>    // MAVLink GCS definitions
 
 #include <AP_Mount.h>           // Camera/Antenna mount
@@ -71,6 +76,15 @@
 #include "defines.h"
 #include "Parameters.h"
 #include "GCS.h"
+#include "ISR_Ring.h"
+
+#if SITL_FAST == ENABLED
+// the sketch runs on the simulator's clock, see vclock.ino
+static uint32_t vclock_millis(void);
+static uint32_t vclock_micros(void);
+ # define millis() vclock_millis()
+ # define micros() vclock_micros()
+#endif
 
 #include <AP_Declination.h> // ArduPilot Mega Declination Helper Library
 
@@ -150,6 +164,31 @@ static Parameters g;
 // prototypes
 static void update_events(void);
 
+// scheduler tasks
+#if MOUNT == ENABLED || MOUNT2 == ENABLED || CAMERA == ENABLED
+static void update_mount(void);
+#endif
+static void update_GPS(void);
+static void update_compass(void);
+static void read_control_switch(void);
+static void navigate(void);
+static void update_airspeed(void);
+void read_receiver_rssi(void);
+static void update_alt(void);
+static void update_commands(void);
+static void update_logging(void);
+static void update_battery(void);
+#if OBC_FAILSAFE == ENABLED
+static void obc_fs_check(void);
+#endif
+static void check_long_failsafe(void);
+static void update_aux(void);
+#if USB_MUX_PIN > 0
+static void check_usb_mux(void);
+#endif
+static void one_second_loop(void);
+static void compass_save(void);
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Sensors
@@ -610,6 +649,57 @@ static int32_t offset_altitude_cm;
 //This is the time between calls to the DCM algorithm and is the Integration time for the gyros.
 static float G_Dt                                               = 0.02;
 
+////////////////////////////////////////////////////////////////////////////////
+// Task scheduler
+////////////////////////////////////////////////////////////////////////////////
+// All the regular work apart from fast_loop() is listed here with how
+// often it should run (in 20ms ticks) and the longest time it is
+// expected to take (in microseconds). Tasks are listed in priority
+// order and run in the time left after fast_loop(). Tasks of the same
+// rate fall due on successive ticks in the order they are listed, so
+// for the 5 tick tasks NAV runs the tick after GPS and CMDS the tick
+// after ALT, as they did in the old medium loop. See scheduler.ino
+static const struct sched_task scheduler_tasks[] PROGMEM = {
+#if MOUNT == ENABLED || MOUNT2 == ENABLED || CAMERA == ENABLED
+    { update_mount,            1,   500, "MOUNT"   },
+#endif
+    { update_GPS,              5,  2500, "GPS"     },
+    { read_control_switch,     5,   300, "SWITCH"  },
+    { update_airspeed,         5,  1200, "ASPD"    },
+    { update_alt,              5,  1000, "ALT"     },
+    { update_commands,         5,  1500, "CMDS"    },
+    { update_compass,          5,  1500, "COMPASS" },
+    { navigate,                5,  1500, "NAV"     },
+    { read_receiver_rssi,      5,   100, "RSSI"    },
+    { update_logging,          5,  2500, "LOG"     },
+    { update_battery,          5,   500, "BATT"    },
+#if OBC_FAILSAFE == ENABLED
+    { obc_fs_check,            5,   500, "OBC"     },
+#endif
+    { check_long_failsafe,    15,   500, "LONGFS"  },
+    { update_aux,             15,   500, "AUX"     },
+    { update_events,          15,  1000, "EVENTS"  },
+#if USB_MUX_PIN > 0
+    { check_usb_mux,          15,   300, "USBMUX"  },
+#endif
+    { one_second_loop,        50,  2000, "1HZ"     },
+    { compass_save,         3000,  3000, "CMPSAVE" },
+};
+#define NUM_SCHED_TASKS (sizeof(scheduler_tasks) / sizeof(scheduler_tasks[0]))
+
+// The tick each task last ran in
+static uint16_t sched_last_run[NUM_SCHED_TASKS];
+// Number of main loop ticks since startup, wraps
+static uint16_t sched_tick_counter;
+// A bit for each task that ran in this tick, for replay logging
+static uint32_t sched_ran;
+// The number of tasks that ran longer than their expected time, and
+// the number pushed back to a later tick for lack of time, in the
+// current performance monitoring interval
+static uint8_t sched_overrun_count;
+static uint8_t sched_skip_count;
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Performance monitoring
 ////////////////////////////////////////////////////////////////////////////////
@@ -622,6 +712,39 @@ static int16_t gps_fix_count = 0;
 // A variable used by developers to track performanc metrics.
 // Currently used to record the number of GCS heartbeat messages received
 static int16_t pmTest1 = 0;
+// Log records thrown away because the log ring buffer was full
+static uint16_t log_dropped_count;
+// Set while a log is being downloaded over MAVLink, which pauses logging
+static bool log_download_active;
+
+#if LOOP_PROFILER == ENABLED
+#define PERF_NUM_TASKS (PERF_TASK_SCHED_0 + NUM_SCHED_TASKS)
+
+// Execution time statistics for each loop stage, accrued over the
+// current performance monitoring interval. See perf.ino
+static struct perf_stats {
+    uint16_t min_us;
+    uint16_t max_us;
+    uint32_t total_us;
+    uint16_t count;
+    uint8_t hist[PERF_HIST_BINS];
+} perf_stats[PERF_NUM_TASKS];
+// The next task to report on each MAVLink channel
+static uint8_t perf_report_task[2];
+#endif
+// Short names for the fast_loop() stages, used in the logs and over
+// MAVLink. The scheduler tasks are named in scheduler_tasks[]
+static const char perf_task_names[PERF_TASK_SCHED_0][8] PROGMEM = {
+    "RADIO",
+    "AHRS",
+    "LOG",
+    "MODE",
+    "STAB",
+    "SERVOS",
+    "VSCLLOG",
+    "GCSUPD",
+    "GCSSTRM"
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -639,21 +762,53 @@ static uint8_t delta_ms_fast_loop;
 // Counter of main loop executions.  Used for performance monitoring and failsafe processing
 static uint16_t mainLoop_count;
 
-// Time in miliseconds of start of medium control loop.  Milliseconds
+// What the main loop is doing, an enum loop_stage. See failsafe.ino
+static volatile uint8_t loop_stage = STAGE_STARTUP;
+// The last main loop stall. This is not cleared by a reset, so a stall
+// that ends in a watchdog or brownout reset can be reported afterwards
+static volatile struct loop_stall_record {
+    uint16_t magic;             // LOOP_STALL_MAGIC once set up
+    uint8_t count;              // stalls since power on
+    uint8_t stage;              // where the last one happened
+    uint32_t start_ms;
+    uint16_t duration_ms;       // so far, while it lasts
+    bool active;
+    bool reported;
+    bool reset;                 // the board reset before it was reported
+} loop_stall __attribute__((section(".noinit")));
+// Short names for the stages that aren't profiler tasks
+static const char loop_stage_names[][8] PROGMEM = {
+    "IDLE",
+    "EEPROM",
+    "MAVDLY",
+    "BAROCAL",
+    "ASPDCAL",
+    "INSCAL",
+    "LOGERAS",
+    "IMUWAIT",
+    "LOOP",
+    "STARTUP"
+};
+
+// Events timestamped by the timer interrupt, on their way to the main loop
+static ISR_Ring<struct isr_event, ISR_EVENT_RING_SIZE> isr_events;
+// Worst case timings seen through them in the current performance
+// monitoring interval
+static uint16_t isr_loop_gap_max_us;
+static uint16_t isr_rc_gap_max_us;
+
+// Time in microseconds of start of main control loop. Used by the
+// scheduler to work out how much of the tick is left
+static uint32_t fast_loopTimer_us;
+
+// Time in miliseconds of the last battery reading.  Milliseconds
 static uint32_t medium_loopTimer_ms;
 
-// Counters for branching from main control loop to slower loops
+// Counter used by the CLI tests to run 10Hz processes
 static byte medium_loopCounter;
-// Number of milliseconds used in last medium loop cycle
+// Number of milliseconds between the last two battery readings
 static uint8_t delta_ms_medium_loop;
 
-// Counters for branching from medium control loop to slower loops
-static byte slow_loopCounter;
-// Counter to trigger execution of very low rate processes
-static byte superslow_loopCounter;
-// Counter to trigger execution of 1 Hz processes
-static byte counter_one_herz;
-
 // % MCU cycles used
 static float load;
 
@@ -693,51 +848,70 @@ void setup() {
 void loop()
 {
     // We want this to execute at 50Hz, but synchronised with the gyro/accel
+    loop_stage = STAGE_IMU_WAIT;
+#if SITL_FAST == ENABLED
+    uint16_t num_samples = vclock_tick_due();
+#else
     uint16_t num_samples = ins.num_samples_available();
+#endif
     if (num_samples >= 1) {
         delta_ms_fast_loop      = millis() - fast_loopTimer_ms;
         load                = (float)(fast_loopTimeStamp_ms - fast_loopTimer_ms)/delta_ms_fast_loop;
         G_Dt                = (float)delta_ms_fast_loop / 1000.f;
         fast_loopTimer_ms   = millis();
+        fast_loopTimer_us   = micros();
 
         mainLoop_count++;
 
+        loop_stage = STAGE_LOOP;
+        isr_events_update();
+
+        if (g.log_bitmask & MASK_LOG_REPLAY) {
+            Log_Replay_Tick_Start();
+        }
+
         // Execute the fast loop
         // ---------------------
         fast_loop();
 
-        // Execute the medium loop
-        // -----------------------
-        medium_loop();
+        // Run the scheduled tasks in the time left in this tick
+        // -----------------------------------------------------
+        sched_run();
 
-        counter_one_herz++;
-        if(counter_one_herz == 50) {
-            one_second_loop();
-            counter_one_herz = 0;
+        loop_stage = STAGE_LOOP;
+        if (g.log_bitmask & MASK_LOG_REPLAY) {
+            Log_Write_Replay_Tick(sched_ran);
         }
 
         if (millis() - perf_mon_timer > 20000) {
             if (mainLoop_count != 0) {
-                if (g.log_bitmask & MASK_LOG_PM)
+                if (g.log_bitmask & MASK_LOG_PM) {
                     Log_Write_Performance();
-                    resetPerfData();
+                    Log_Write_Perf_Tasks();
+                    Log_Write_Isr();
+                }
+                resetPerfData();
             }
         }
 
         fast_loopTimeStamp_ms = millis();
-    } else if (millis() - fast_loopTimeStamp_ms < 19) {
-        // less than 19ms has passed. We have at least one millisecond
-        // of free time. The most useful thing to do with that time is
-        // to accumulate some sensor readings, specifically the
-        // compass, which is often very noisy but is not interrupt
-        // driven, so it can't accumulate readings by itself
-        if (g.compass_enabled) {
-            compass.accumulate();
+#if SITL_FAST == ENABLED
+        vclock_tick_done();
+#endif
+    } else {
+        // use the time until the next IMU sample is due for deferred
+        // work, such as accumulating compass readings and sending
+        // queued MAVLink messages
+        uint32_t used = micros() - fast_loopTimer_us;
+        if (used < SCHED_LOOP_MICROS - IDLE_GUARD_MICROS) {
+            idle_run(SCHED_LOOP_MICROS - IDLE_GUARD_MICROS - used);
         }
+#if SITL_FAST == ENABLED
+        vclock_wait();
+#endif
     }
 }
 
-// Main loop 50Hz
 static void fast_loop()
 {
     // This is the fast loop - we want it to execute at 50Hz if possible
@@ -747,31 +921,39 @@ static void fast_loop()
 
     // Read radio
     // ----------
+    uint32_t perf_t = micros();
+    loop_stage = PERF_TASK_READ_RADIO;
     read_radio();
-
-    // try to send any deferred messages if the serial port now has
-    // some space available
-    gcs_send_message(MSG_RETRY_DEFERRED);
+    perf_record(PERF_TASK_READ_RADIO, perf_t);
 
     // check for loss of control signal failsafe condition
     // ------------------------------------
     check_short_failsafe();
 
-#if HIL_MODE == HIL_MODE_SENSORS
-    // update hil before AHRS update
+#if SIM_FDM == ENABLED
+    // step the built in flight model to now, and read its sensors
+    sim_fdm_update();
+#elif HIL_MODE == HIL_MODE_SENSORS && REPLAY != ENABLED
+    // update hil before AHRS update. A replay takes its sensors from the
+    // log, and must handle MAVLink at the same stage as the flight did
     gcs_update();
 #endif
 
+    perf_t = micros();
+    loop_stage = PERF_TASK_AHRS;
     ahrs.update();
 
     // uses the yaw from the DCM to give more accurate turns
     calc_bearing_error();
+    perf_t = perf_record(PERF_TASK_AHRS, perf_t);
 
+    loop_stage = PERF_TASK_LOGGING;
     if (g.log_bitmask & MASK_LOG_ATTITUDE_FAST)
         Log_Write_Attitude(ahrs.roll_sensor, ahrs.pitch_sensor, ahrs.yaw_sensor);
 
     if (g.log_bitmask & MASK_LOG_RAW)
         Log_Write_Raw();
+    perf_t = perf_record(PERF_TASK_LOGGING, perf_t);
 
     // inertial navigation
     // ------------------
@@ -782,22 +964,40 @@ static void fast_loop()
 
     // custom code/exceptions for flight modes
     // ---------------------------------------
+    loop_stage = PERF_TASK_FLIGHT_MODE;
     update_current_flight_mode();
+    perf_t = perf_record(PERF_TASK_FLIGHT_MODE, perf_t);
 
     // apply desired roll, pitch and yaw to the plane
     // ----------------------------------------------
+    loop_stage = PERF_TASK_STABILIZE;
     if (control_mode > MANUAL)
         stabilize();
+    perf_t = perf_record(PERF_TASK_STABILIZE, perf_t);
 
     // write out the servo PWM values
     // ------------------------------
+    loop_stage = PERF_TASK_SET_SERVOS;
     set_servos();
+    perf_t = perf_record(PERF_TASK_SET_SERVOS, perf_t);
+
+    // after set_servos(), so the sample holds this tick's targets and outputs
+    loop_stage = PERF_TASK_VSCL_LOG;
+    if (g.log_bitmask & MASK_LOG_VSCL)
+        Log_Write_Vscl();
+    perf_t = perf_record(PERF_TASK_VSCL_LOG, perf_t);
 
+    loop_stage = PERF_TASK_GCS_UPDATE;
     gcs_update();
+    perf_t = perf_record(PERF_TASK_GCS_UPDATE, perf_t);
+
+    loop_stage = PERF_TASK_GCS_STREAM;
     gcs_data_stream_send();
+    perf_record(PERF_TASK_GCS_STREAM, perf_t);
 }
 
-static void medium_loop()
+#if MOUNT == ENABLED || MOUNT2 == ENABLED || CAMERA == ENABLED
+static void update_mount(void)
 {
 #if MOUNT == ENABLED
     camera_mount.update_mount_position();
@@ -810,165 +1010,96 @@ static void medium_loop()
 #if CAMERA == ENABLED
     g.camera.trigger_pic_cleanup();
 #endif
+}
+#endif
 
-    // This is the start of the medium (10 Hz) loop pieces
-    // -----------------------------------------
-    switch(medium_loopCounter) {
-
-    // This case deals with the GPS
-    //-------------------------------
-    case 0:
-        medium_loopCounter++;
-        update_GPS();
-        calc_gndspeed_undershoot();
-
+static void update_compass(void)
+{
 #if HIL_MODE != HIL_MODE_ATTITUDE
-        if (g.compass_enabled && compass.read()) {
-            ahrs.set_compass(&compass);
-            compass.null_offsets();
-        } else {
-            ahrs.set_compass(NULL);
+    if (g.compass_enabled && compass.read()) {
+ #if REPLAY == ENABLED
+        replay_compass();
+ #endif
+        if (g.log_bitmask & MASK_LOG_REPLAY) {
+            Log_Write_Replay_Mag();
         }
+        ahrs.set_compass(&compass);
+        compass.null_offsets();
+    } else {
+        ahrs.set_compass(NULL);
+    }
 #endif
+}
 
-        break;
-
-    // This case performs some navigation computations
-    //------------------------------------------------
-    case 1:
-        medium_loopCounter++;
-
-        // Read 6-position switch on radio
-        // -------------------------------
-        read_control_switch();
-
-        // calculate the plane's desired bearing
-        // -------------------------------------
-        navigate();
-
-        break;
-
-    // command processing
-    //------------------------------
-    case 2:
-        medium_loopCounter++;
-
-        // Read Airspeed
-        // -------------
+// save compass offsets, called once a minute
+static void compass_save(void)
+{
 #if HIL_MODE != HIL_MODE_ATTITUDE
-        if (airspeed.enabled()) {
-            read_airspeed();
-        }
+    if (g.compass_enabled) {
+        compass.save_offsets();
+    }
 #endif
+}
 
-        read_receiver_rssi();
-
-        // Read altitude from sensors
-        // ------------------
-        update_alt();
-
-        // altitude smoothing
-        // ------------------
-        if (control_mode != FLY_BY_WIRE_B)
-            calc_altitude_error();
-
-        // perform next command
-        // --------------------
-        update_commands();
-        break;
-
-    // This case deals with sending high rate telemetry
-    //-------------------------------------------------
-    case 3:
-        medium_loopCounter++;
-
-        if ((g.log_bitmask & MASK_LOG_ATTITUDE_MED) && !(g.log_bitmask & MASK_LOG_ATTITUDE_FAST))
-            Log_Write_Attitude(ahrs.roll_sensor, ahrs.pitch_sensor, ahrs.yaw_sensor);
-
-        if (g.log_bitmask & MASK_LOG_CTUN)
-            Log_Write_Control_Tuning();
-
-        if (g.log_bitmask & MASK_LOG_NTUN)
-            Log_Write_Nav_Tuning();
+static void update_airspeed(void)
+{
+#if HIL_MODE != HIL_MODE_ATTITUDE
+    if (airspeed.enabled()) {
+        read_airspeed();
+    }
+#endif
+}
 
-        if (g.log_bitmask & MASK_LOG_GPS)
-            Log_Write_GPS(g_gps->time, current_loc.lat, current_loc.lng, g_gps->altitude, current_loc.alt, (long) g_gps->ground_speed, g_gps->ground_course, g_gps->fix, g_gps->num_sats);
-        break;
+static void update_battery(void)
+{
+    delta_ms_medium_loop    = millis() - medium_loopTimer_ms;
+    medium_loopTimer_ms     = millis();
 
-    // This case controls the slow loop
-    //---------------------------------
-    case 4:
-        medium_loopCounter = 0;
-        delta_ms_medium_loop    = millis() - medium_loopTimer_ms;
-        medium_loopTimer_ms     = millis();
+    if (g.battery_monitoring != 0) {
+        read_battery();
+    }
+}
 
-        if (g.battery_monitoring != 0) {
-            read_battery();
-        }
+static void update_logging(void)
+{
+    if ((g.log_bitmask & MASK_LOG_ATTITUDE_MED) && !(g.log_bitmask & MASK_LOG_ATTITUDE_FAST))
+        Log_Write_Attitude(ahrs.roll_sensor, ahrs.pitch_sensor, ahrs.yaw_sensor);
 
-        slow_loop();
+    if (g.log_bitmask & MASK_LOG_CTUN)
+        Log_Write_Control_Tuning();
 
-#if OBC_FAILSAFE == ENABLED
-        // perform OBC failsafe checks
-        obc.check(OBC_MODE(control_mode),
-                  last_heartbeat_ms,
-                  g_gps ? g_gps->last_fix_time : 0);
-#endif
+    if (g.log_bitmask & MASK_LOG_NTUN)
+        Log_Write_Nav_Tuning();
 
-        break;
-    }
+    if (g.log_bitmask & MASK_LOG_GPS)
+        Log_Write_GPS(g_gps->time, current_loc.lat, current_loc.lng, g_gps->altitude, current_loc.alt, (long) g_gps->ground_speed, g_gps->ground_course, g_gps->fix, g_gps->num_sats);
 }
 
-static void slow_loop()
+#if OBC_FAILSAFE == ENABLED
+static void obc_fs_check(void)
 {
-    // This is the slow (3 1/3 Hz) loop pieces
-    //----------------------------------------
-    switch (slow_loopCounter) {
-    case 0:
-        slow_loopCounter++;
-        check_long_failsafe();
-        superslow_loopCounter++;
-        if(superslow_loopCounter >=200) {                                               //	200 = Execute every minute
-#if HIL_MODE != HIL_MODE_ATTITUDE
-            if(g.compass_enabled) {
-                compass.save_offsets();
-            }
+    // perform OBC failsafe checks
+    obc.check(OBC_MODE(control_mode),
+              last_heartbeat_ms,
+              g_gps ? g_gps->last_fix_time : 0);
+}
 #endif
 
-            superslow_loopCounter = 0;
-        }
-        break;
-
-    case 1:
-        slow_loopCounter++;
-
+static void update_aux(void)
+{
 #if CONFIG_APM_HARDWARE == APM_HARDWARE_APM1
-        update_aux_servo_function(&g.rc_5, &g.rc_6, &g.rc_7, &g.rc_8);
+    update_aux_servo_function(&g.rc_5, &g.rc_6, &g.rc_7, &g.rc_8);
 #else
-        update_aux_servo_function(&g.rc_5, &g.rc_6, &g.rc_7, &g.rc_8, &g.rc_9, &g.rc_10, &g.rc_11);
+    update_aux_servo_function(&g.rc_5, &g.rc_6, &g.rc_7, &g.rc_8, &g.rc_9, &g.rc_10, &g.rc_11);
 #endif
-        enable_aux_servos();
+    enable_aux_servos();
 
 #if MOUNT == ENABLED
-        camera_mount.update_mount_type();
+    camera_mount.update_mount_type();
 #endif
 #if MOUNT2 == ENABLED
-        camera_mount2.update_mount_type();
-#endif
-        break;
-
-    case 2:
-        slow_loopCounter = 0;
-        update_events();
-
-        mavlink_system.sysid = g.sysid_this_mav;                // This is just an ugly hack to keep mavlink_system.sysid sync'd with our parameter
-
-#if USB_MUX_PIN > 0
-        check_usb_mux();
+    camera_mount2.update_mount_type();
 #endif
-
-        break;
-    }
 }
 
 static void one_second_loop()
@@ -978,12 +1109,23 @@ static void one_second_loop()
 
     // send a heartbeat
     gcs_send_message(MSG_HEARTBEAT);
+
+    // tell the GCS about any stall we have recovered from
+    loop_stall_report();
+
+    mavlink_system.sysid = g.sysid_this_mav;                // This is just an ugly hack to keep mavlink_system.sysid sync'd with our parameter
 }
 
 static void update_GPS(void)
 {
+#if REPLAY == ENABLED
+    replay_gps();
+#endif
     g_gps->update();
     update_GPS_light();
+    if (g_gps->new_data && (g.log_bitmask & MASK_LOG_REPLAY)) {
+        Log_Write_Replay_GPS();
+    }
 
     // get position from AHRS
     have_position = ahrs.get_position(&current_loc);
@@ -1029,6 +1171,8 @@ static void update_GPS(void)
         // see if we've breached the geo-fence
         geofence_check(false);
     }
+
+    calc_gndspeed_undershoot();
 }
 
 static void update_current_flight_mode(void)
@@ -1061,6 +1205,9 @@ static void update_current_flight_mode(void)
                 if (aspeed < g.flybywire_airspeed_min) {
                     g.pidServoPitch.reset_I();
                     g.pidServoRoll.reset_I();
+ #if CONTROL_FIXED == ENABLED
+                    control_fixed_reset_servo_I();
+ #endif
                 }
             }
 #endif
@@ -1238,6 +1385,11 @@ static void update_alt()
 
     geofence_check(true);
 
+    // altitude smoothing
+    // ------------------
+    if (control_mode != FLY_BY_WIRE_B)
+        calc_altitude_error();
+
     // Calculate new climb rate
     //if(medium_loopCounter == 0 && slow_loopCounter == 0)
     //	add_altitude_data(millis() / 100, g_gps->altitude / 10);
@@ -55,6 +55,8 @@ static bool stick_mixing_enabled(void)
 }
 
 
+#if CONTROL_FIXED == DISABLED
+// with CONTROL_FIXED, stabilize() and calc_nav_yaw() are in control_fixed.ino
 static void stabilize()
 {
     float ch1_inf = 1.0;
@@ -144,6 +146,7 @@ static void stabilize()
 	//	g.channel_roll.servo_out = roll_slew_limit(g.channel_roll.servo_out);
 	//#endif
 }
+#endif // CONTROL_FIXED
 
 static void crash_checker()
 {
@@ -177,6 +180,9 @@ static void calc_throttle()
     } else {
         // throttle control with airspeed compensation
         // -------------------------------------------
+#if CONTROL_FIXED == ENABLED
+        calc_throttle_fixed();
+#else
         energy_error = airspeed_energy_error + altitude_error_cm * 0.098f;
 
         // positive energy errors make the throttle go higher
@@ -185,6 +191,7 @@ static void calc_throttle()
 
         g.channel_throttle.servo_out = constrain(g.channel_throttle.servo_out,
                                                  g.throttle_min.get(), g.throttle_max.get());
+#endif
     }
 
 }
@@ -195,6 +202,7 @@ static void calc_throttle()
 
 //  Yaw is separated into a function for future implementation of heading hold on rolling take-off
 // ----------------------------------------------------------------------------------------
+#if CONTROL_FIXED == DISABLED
 static void calc_nav_yaw(float speed_scaler, float ch4_inf)
 {
     if (hold_course != -1) {
@@ -218,17 +226,22 @@ static void calc_nav_yaw(float speed_scaler, float ch4_inf)
 	g.channel_rudder.servo_out = g.yawController.get_servo_out(speed_scaler, ch4_inf < 0.25) + g.channel_roll.servo_out * g.kff_rudder_mix;
 #endif
 }
+#endif // CONTROL_FIXED
 
 
 static void calc_nav_pitch()
 {
     // Calculate the Pitch of the plane
     // --------------------------------
+#if CONTROL_FIXED == ENABLED
+    nav_pitch_cd = calc_nav_pitch_fixed();
+#else
     if (alt_control_airspeed()) {
         nav_pitch_cd = -g.pidNavPitchAirspeed.get_pid(airspeed_error_cm);
     } else {
         nav_pitch_cd = g.pidNavPitchAltitude.get_pid(altitude_error_cm);
     }
+#endif
     nav_pitch_cd = constrain(nav_pitch_cd, g.pitch_limit_min_cd.get(), g.pitch_limit_max_cd.get());
 }
 
@@ -254,7 +267,7 @@ static void calc_nav_roll()
     }
 
     // Bank angle = V*R/g, where V is airspeed, R is turn rate, and g is gravity.
-    nav_roll = ToDeg(atan(speed*turn_rate/9.81)*100);
+    nav_roll_cd = fast_atan2_cd(speed*turn_rate*100, 981);
 
 #else
     // this is the old nav_roll calculation. We will use this for 2.50
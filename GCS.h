@@ -113,6 +113,9 @@ public:
     void        data_stream_send(void);
     void        queued_param_send();
     void        queued_waypoint_send();
+#if LOG_DOWNLOAD == ENABLED
+    void        queued_log_send();
+#endif
 
     static const struct AP_Param::GroupInfo        var_info[];
 
@@ -133,12 +136,18 @@ public:
     // see if we should send a stream now. Called at 50Hz
     bool        stream_trigger(enum streams stream_num);
 
+    // scale the stream rates for the state of the link
+    void        stream_rate_update(int8_t congestion);
+
 	// this costs us 51 bytes per instance, but means that low priority
 	// messages don't block the CPU
     mavlink_statustext_t pending_status;
 
 private:
     void        handleMessage(mavlink_message_t * msg);
+#if LOG_DOWNLOAD == ENABLED
+    void        handle_log_message(mavlink_message_t * msg);
+#endif
 
     /// Perform queued sending operations
     ///
@@ -192,6 +201,16 @@ private:
     uint16_t        waypoint_send_timeout; // milliseconds
     uint16_t        waypoint_receive_timeout; // milliseconds
 
+#if LOG_DOWNLOAD == ENABLED
+    // log download
+    bool            log_listing;        // sending LOG_ENTRY messages
+    uint16_t        log_list_next;      // next log id to list
+    uint16_t        log_list_last;      // last log id to list
+    uint16_t        log_data_id;        // log being sent, 0 for none
+    uint32_t        log_data_ofs;       // next byte to send
+    uint32_t        log_data_end;       // end of the requested window
+#endif
+
     // data stream rates. The code assumes that
     // streamRateRawSensors is the first
     AP_Int16        streamRateRawSensors;
@@ -207,8 +226,12 @@ private:
     // number of 50Hz ticks until we next send this stream
     uint8_t         stream_ticks[NUM_STREAMS];
 
-    // number of extra ticks to add to slow things down for the radio
-    uint8_t         stream_slowdown;
+    // fraction of the configured stream rates that the link can
+    // carry, and what it was last worked out from
+    float           stream_rate_scale;
+    uint16_t        stream_drops_last;
+    uint32_t        stream_check_ms;
+    uint32_t        radio_status_ms; // last RADIO packet
 };
 
 #endif // __GCS_H
@@ -12,6 +12,35 @@ static bool mavlink_active;
 // prototype this for use inside the GCS class
 void gcs_send_text_fmt(const prog_char_t *fmt, ...);
 
+// bytes still to come of the frame being sent on each channel, and
+// whether that frame is being thrown away
+static uint16_t comm_frame_remaining[2];
+static bool comm_frame_dropped[2];
+
+/*
+ *  write part of a MAVLink frame straight to the serial port. The
+ *  mavlink library calls this for the header, then the payload, then
+ *  the checksum of each frame. When the header arrives we check there
+ *  is room in the tx buffer for the whole frame, and if not the whole
+ *  frame is dropped, so a full buffer can never leave half a frame on
+ *  the link
+ */
+void comm_send_buffer(uint8_t chan, const uint8_t *buf, uint16_t len)
+{
+    BetterStream *port = (chan == MAVLINK_COMM_0 ? mavlink_comm_0_port : mavlink_comm_1_port);
+
+    if (comm_frame_remaining[chan] == 0 && len >= 2) {
+        // a new frame, buf[1] is its payload length
+        comm_frame_remaining[chan] = buf[1] + MAVLINK_NUM_NON_PAYLOAD_BYTES;
+        comm_frame_dropped[chan] = (comm_get_txspace((mavlink_channel_t)chan) < (int)comm_frame_remaining[chan]);
+    }
+    comm_frame_remaining[chan] -= min(len, comm_frame_remaining[chan]);
+
+    if (!comm_frame_dropped[chan]) {
+        port->write(buf, len);
+    }
+}
+
 /*
  *  !!NOTE!!
  *
@@ -483,6 +512,28 @@ static void NOINLINE send_current_waypoint(mavlink_channel_t chan)
         g.command_index);
 }
 
+#if LOOP_PROFILER == ENABLED
+// report the loop profiler statistics of one task per call, cycling
+// through all of them. x is the mean, y the 99th percentile and z the
+// maximum execution time in microseconds
+static void NOINLINE send_perf_info(mavlink_channel_t chan)
+{
+    char name[10];
+    uint8_t task = perf_report_task[chan];
+    strncpy_P(name, perf_task_name(task), sizeof(name));
+    mavlink_msg_debug_vect_send(
+        chan,
+        name,
+        micros(),
+        perf_mean_us(task),
+        perf_p99_us(task),
+        perf_stats[task].max_us);
+    if (++perf_report_task[chan] == PERF_NUM_TASKS) {
+        perf_report_task[chan] = 0;
+    }
+}
+#endif
+
 static void NOINLINE send_statustext(mavlink_channel_t chan)
 {
     mavlink_statustext_t *s = (chan == MAVLINK_COMM_0?&gcs0.pending_status:&gcs3.pending_status);
@@ -630,7 +681,11 @@ static bool mavlink_try_send_message(mavlink_channel_t chan, enum ap_message id,
 
 #if GEOFENCE_ENABLED == ENABLED
     case MSG_FENCE_STATUS:
-        CHECK_PAYLOAD_SIZE(FENCE_STATUS);
+        // sent along with the distance to the boundary
+        if (payload_space < MAVLINK_MSG_ID_FENCE_STATUS_LEN +
+            MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_NAMED_VALUE_FLOAT_LEN) {
+            return false;
+        }
         send_fence_status(chan);
         break;
 #endif
@@ -674,6 +729,24 @@ static bool mavlink_try_send_message(mavlink_channel_t chan, enum ap_message id,
 	mavlink_msg_vscl_bump_send(chan,VSCL_ALT,0);
 	break;
 
+#if LOOP_PROFILER == ENABLED
+    case MSG_PERF_INFO:
+        CHECK_PAYLOAD_SIZE(DEBUG_VECT);
+        send_perf_info(chan);
+        break;
+#endif
+
+    case MSG_LOG_DATA:
+#if LOG_DOWNLOAD == ENABLED
+        CHECK_PAYLOAD_SIZE(LOG_DATA);
+        if (chan == MAVLINK_COMM_0) {
+            gcs0.queued_log_send();
+        } else if (gcs3.initialised) {
+            gcs3.queued_log_send();
+        }
+#endif
+        break;
+
     case MSG_RETRY_DEFERRED:
         break; // just here to prevent a warning
     }
@@ -681,65 +754,120 @@ static bool mavlink_try_send_message(mavlink_channel_t chan, enum ap_message id,
 }
 
 
-#define MAX_DEFERRED_MESSAGES MSG_RETRY_DEFERRED
+/*
+ *  Messages waiting to be sent are kept as a bitmask per channel, and
+ *  sent in the order of mavlink_priority[] as space in the serial
+ *  buffer allows. Bulk messages also have to fit in a byte budget
+ *  which refills at MAVLINK_BULK_PERCENT of the telemetry baud rate,
+ *  so the streams can't fill the link and the control messages ahead
+ *  of them in the table always get out first.
+ */
+#define MAVLINK_BULK_PERCENT 70
+
+static const struct mavlink_priority {
+    uint8_t id;                 // enum ap_message
+    bool bulk;                  // subject to the byte budget
+} mavlink_priority[MSG_RETRY_DEFERRED] PROGMEM = {
+    { MSG_HEARTBEAT,             false },
+    { MSG_VSCL_TEST,             false },
+    { MSG_VSCL_BUMP,             false },
+    { MSG_STATUSTEXT,            false },
+    { MSG_FENCE_STATUS,          false },
+    { MSG_NEXT_WAYPOINT,         false },
+    { MSG_NEXT_PARAM,            false },
+    { MSG_CURRENT_WAYPOINT,      false },
+    { MSG_ATTITUDE,              true },
+    { MSG_EXTENDED_STATUS1,      true },
+    { MSG_LOCATION,              true },
+    { MSG_NAV_CONTROLLER_OUTPUT, true },
+    { MSG_VFR_HUD,               true },
+    { MSG_GPS_RAW,               true },
+    { MSG_EXTENDED_STATUS2,      true },
+    { MSG_SERVO_OUT,             true },
+    { MSG_RADIO_OUT,             true },
+    { MSG_RADIO_IN,              true },
+    { MSG_AHRS,                  true },
+    { MSG_WIND,                  true },
+    { MSG_HWSTATUS,              true },
+    { MSG_SIMSTATE,              true },
+    { MSG_RAW_IMU1,              true },
+    { MSG_RAW_IMU2,              true },
+    { MSG_RAW_IMU3,              true },
+    { MSG_PERF_INFO,             true },
+    { MSG_LOG_DATA,              true }
+};
+
 static struct mavlink_queue {
-    enum ap_message deferred_messages[MAX_DEFERRED_MESSAGES];
-    uint8_t next_deferred_message;
-    uint8_t num_deferred_messages;
+    uint32_t pending;           // one bit per enum ap_message
+    int16_t bulk_budget;        // bytes
+    uint32_t budget_time_ms;    // when the budget was last topped up
 } mavlink_queue[2];
 
 // send a message using mavlink
 static void mavlink_send_message(mavlink_channel_t chan, enum ap_message id, uint16_t packet_drops)
 {
-    uint8_t i, nextid;
     struct mavlink_queue *q = &mavlink_queue[(uint8_t)chan];
 
-    // see if we can send the deferred messages, if any
-    while (q->num_deferred_messages != 0) {
-        if (!mavlink_try_send_message(chan,
-                                      q->deferred_messages[q->next_deferred_message],
-                                      packet_drops)) {
-            break;
-        }
-        q->next_deferred_message++;
-        if (q->next_deferred_message == MAX_DEFERRED_MESSAGES) {
-            q->next_deferred_message = 0;
-        }
-        q->num_deferred_messages--;
+    if (id != MSG_RETRY_DEFERRED) {
+        q->pending |= (1UL<<id);
     }
-
-    if (id == MSG_RETRY_DEFERRED) {
+    if (q->pending == 0) {
         return;
     }
 
-    // this message id might already be deferred
-    for (i=0, nextid = q->next_deferred_message; i < q->num_deferred_messages; i++) {
-        if (q->deferred_messages[nextid] == id) {
-            // its already deferred, discard
-            return;
-        }
-        nextid++;
-        if (nextid == MAX_DEFERRED_MESSAGES) {
-            nextid = 0;
+    // top up the byte budget for bulk messages every 10ms or
+    // more. serial3_baud is in kbaud, which is about 100 bytes/s per
+    // unit
+    uint32_t tnow = millis();
+    uint16_t txspace = comm_get_txspace(chan);
+    uint32_t dt = tnow - q->budget_time_ms;
+    if (dt >= 10) {
+        if (dt > 1000) {
+            dt = 1000;
         }
+        int32_t budget = q->bulk_budget + (int32_t)(g.serial3_baud * dt * MAVLINK_BULK_PERCENT / 1000);
+        q->bulk_budget = budget > txspace ? txspace : budget;
+        q->budget_time_ms = tnow;
     }
 
-    if (q->num_deferred_messages != 0 ||
-        !mavlink_try_send_message(chan, id, packet_drops)) {
-        // can't send it now, so defer it
-        if (q->num_deferred_messages == MAX_DEFERRED_MESSAGES) {
-            // the defer buffer is full, discard
-            return;
+    for (uint8_t i=0; i<MSG_RETRY_DEFERRED && q->pending != 0; i++) {
+        uint8_t msg_id = pgm_read_byte(&mavlink_priority[i].id);
+        uint32_t mask = (1UL<<msg_id);
+        if (!(q->pending & mask)) {
+            continue;
         }
-        nextid = q->next_deferred_message + q->num_deferred_messages;
-        if (nextid >= MAX_DEFERRED_MESSAGES) {
-            nextid -= MAX_DEFERRED_MESSAGES;
+        bool bulk = pgm_read_byte(&mavlink_priority[i].bulk);
+        if (bulk && q->bulk_budget <= 0) {
+            // only control messages from here on
+            continue;
         }
-        q->deferred_messages[nextid] = id;
-        q->num_deferred_messages++;
+        if (!mavlink_try_send_message(chan, (enum ap_message)msg_id, packet_drops)) {
+            // no room, and nothing after this is more important
+            break;
+        }
+        q->pending &= ~mask;
+        if (bulk) {
+            uint16_t after = comm_get_txspace(chan);
+            if (after < txspace) {
+                q->bulk_budget -= txspace - after;
+            }
+        }
+        txspace = comm_get_txspace(chan);
+    }
+
+    if (q->pending != 0) {
+        // retry when the serial port has drained a bit
+        idle_work_request(IDLE_WORK_MAVLINK_RETRY);
     }
 }
 
+// return true if any messages are waiting to be sent on either link
+static bool mavlink_have_deferred(void)
+{
+    return mavlink_queue[0].pending != 0 ||
+           mavlink_queue[1].pending != 0;
+}
+
 void mavlink_send_text(mavlink_channel_t chan, gcs_severity severity, const char *str)
 {
     if (telemetry_delayed(chan)) {
@@ -774,6 +902,7 @@ const AP_Param::GroupInfo GCS_MAVLINK::var_info[] PROGMEM = {
 
 GCS_MAVLINK::GCS_MAVLINK() :
     packet_drops(0),
+    stream_rate_scale(1),
     waypoint_send_timeout(1000), // 1 second
     waypoint_receive_timeout(1000) // 1 second
 {
@@ -801,6 +930,12 @@ GCS_MAVLINK::update(void)
     mavlink_status_t status;
     status.packet_rx_drop_count = 0;
 
+#if REPLAY == ENABLED
+    // in a replay only the recorded messages are handled
+    while (replay_mavlink(chan, &msg)) {
+        handleMessage(&msg);
+    }
+#else
     // process received bytes
     while (comm_get_available(chan))
     {
@@ -828,9 +963,13 @@ GCS_MAVLINK::update(void)
             if (msg.msgid != MAVLINK_MSG_ID_RADIO) {
                 mavlink_active = true;
             }
+            if (g.log_bitmask & MASK_LOG_REPLAY) {
+                Log_Write_Replay_Mavlink(chan, &msg);
+            }
             handleMessage(&msg);
         }
     }
+#endif
 
     // Update packet drops counter
     packet_drops += status.packet_rx_drop_count;
@@ -843,9 +982,13 @@ GCS_MAVLINK::update(void)
 
     if (waypoint_receiving &&
         waypoint_request_i <= waypoint_request_last &&
-        tnow > waypoint_timelast_request + 500 + (stream_slowdown*20)) {
+        tnow > waypoint_timelast_request + 500 + (uint16_t)(2000*(1-stream_rate_scale))) {
         waypoint_timelast_request = tnow;
-        send_message(MSG_NEXT_WAYPOINT);
+        if (in_mavlink_delay) {
+            send_message(MSG_NEXT_WAYPOINT);
+        } else {
+            idle_work_request(IDLE_WORK_WAYPOINT_SEND);
+        }
     }
 
     // stop waypoint receiving if timeout
@@ -854,6 +997,20 @@ GCS_MAVLINK::update(void)
     }
 }
 
+// lowest rate in Hz that each stream is slowed to when the link is
+// poor, or the configured rate if that is lower
+static const uint8_t stream_rate_floor[GCS_MAVLINK::NUM_STREAMS] PROGMEM = {
+    0,  // STREAM_RAW_SENSORS
+    1,  // STREAM_EXTENDED_STATUS
+    0,  // STREAM_RC_CHANNELS
+    0,  // STREAM_RAW_CONTROLLER
+    1,  // STREAM_POSITION
+    2,  // STREAM_EXTRA1
+    1,  // STREAM_EXTRA2
+    0,  // STREAM_EXTRA3
+    10  // STREAM_PARAMS
+};
+
 // see if we should send a stream now. Called at 50Hz
 bool GCS_MAVLINK::stream_trigger(enum streams stream_num)
 {
@@ -865,6 +1022,12 @@ bool GCS_MAVLINK::stream_trigger(enum streams stream_num)
     if (waypoint_receiving || _queued_parameter != NULL) {
         rate *= 0.25;
     }
+#if LOG_DOWNLOAD == ENABLED
+    // and leave most of the link for log downloads
+    if (log_listing || log_data_id != 0) {
+        rate *= 0.25;
+    }
+#endif
 
     if (rate <= 0) {
         return false;
@@ -872,10 +1035,22 @@ bool GCS_MAVLINK::stream_trigger(enum streams stream_num)
 
     if (stream_ticks[stream_num] == 0) {
         // we're triggering now, setup the next trigger point
+        float rate_floor = pgm_read_byte(&stream_rate_floor[stream_num]);
+        if (rate_floor > rate) {
+            rate_floor = rate;
+        }
+        rate *= stream_rate_scale;
+        if (rate < rate_floor) {
+            rate = rate_floor;
+        }
         if (rate > 50) {
             rate = 50;
         }
-        stream_ticks[stream_num] = (50 / rate) + stream_slowdown;
+        if (rate < 50.0/255) {
+            stream_ticks[stream_num] = 255;
+        } else {
+            stream_ticks[stream_num] = 50 / rate;
+        }
         return true;
     }
 
@@ -884,15 +1059,73 @@ bool GCS_MAVLINK::stream_trigger(enum streams stream_num)
     return false;
 }
 
+/*
+ *  adjust the stream rate scale. congestion is 2 if the link is badly
+ *  congested, 1 if it is a bit congested, 0 to hold and -1 if it has
+ *  spare capacity. We back off quickly and recover slowly, so the
+ *  rates settle just below what the link can carry
+ */
+void GCS_MAVLINK::stream_rate_update(int8_t congestion)
+{
+    if (congestion >= 2) {
+        stream_rate_scale *= 0.5;
+    } else if (congestion == 1) {
+        stream_rate_scale *= 0.85;
+    } else if (congestion < 0) {
+        stream_rate_scale += 0.05;
+    }
+    stream_rate_scale = constrain(stream_rate_scale, 0.05, 1.0);
+}
+
 void
 GCS_MAVLINK::data_stream_send(void)
 {
+    // once a second, check for dropped packets and for a backlog in
+    // our own serial buffer
+    uint32_t tnow = millis();
+    if (tnow - stream_check_ms >= 1000) {
+        stream_check_ms = tnow;
+        if (comm_get_txspace(chan) < SERIAL_BUFSIZE/4) {
+            stream_rate_update(2);
+        } else if (packet_drops != stream_drops_last ||
+                   mavlink_queue[(uint8_t)chan].pending != 0) {
+            stream_rate_update(1);
+        } else if (tnow - radio_status_ms > 5000) {
+            // no radio to tell us how it is doing, so take a clear
+            // serial port to mean a clear link
+            stream_rate_update(-1);
+        }
+        stream_drops_last = packet_drops;
+#if LOG_DOWNLOAD == ENABLED
+        Log_Download_Check();
+        if (!log_download_active) {
+            // logging has carried on, so stop reading the logs
+            log_listing = false;
+            if (log_data_id != PARAM_SNAPSHOT_LOG_ID) {
+                log_data_id = 0;
+            }
+        }
+#endif
+    }
+
+#if LOG_DOWNLOAD == ENABLED
+    if (log_listing || log_data_id != 0) {
+        send_message(MSG_LOG_DATA);
+    }
+#endif
+
     if (_queued_parameter != NULL) {
         if (streamRateParams.get() <= 0) {
             streamRateParams.set(50);
         }
         if (stream_trigger(STREAM_PARAMS)) {
-            send_message(MSG_NEXT_PARAM);
+            // the main loop sends these while waiting for the next
+            // IMU sample, rather than in the control tick
+            if (in_mavlink_delay) {
+                send_message(MSG_NEXT_PARAM);
+            } else {
+                idle_work_request(IDLE_WORK_PARAM_SEND);
+            }
         }
     }
 
@@ -954,6 +1187,7 @@ GCS_MAVLINK::data_stream_send(void)
         send_message(MSG_AHRS);
         send_message(MSG_HWSTATUS);
         send_message(MSG_WIND);
+        send_message(MSG_PERF_INFO);
     }
 }
 
@@ -1325,6 +1559,15 @@ void GCS_MAVLINK::handleMessage(mavlink_message_t* msg)
         break;
     }
 
+#if LOG_DOWNLOAD == ENABLED
+    case MAVLINK_MSG_ID_LOG_REQUEST_LIST:
+    case MAVLINK_MSG_ID_LOG_REQUEST_DATA:
+    case MAVLINK_MSG_ID_LOG_ERASE:
+    case MAVLINK_MSG_ID_LOG_REQUEST_END:
+        handle_log_message(msg);
+        break;
+#endif
+
     case MAVLINK_MSG_ID_PARAM_REQUEST_LIST:
     {
         // decode
@@ -1348,14 +1591,18 @@ void GCS_MAVLINK::handleMessage(mavlink_message_t* msg)
         if (mavlink_check_target(packet.target_system,packet.target_component)) break;
         enum ap_var_type p_type;
         AP_Param *vp;
-        if (packet.param_index != -1) {
-            vp = AP_Param::find_by_index(packet.param_index, &p_type);
+        int16_t param_index = packet.param_index;
+        if (param_index != -1) {
+            vp = param_find_by_index(param_index, &p_type);
             if (vp == NULL) {
                 gcs_send_text_fmt(PSTR("Unknown parameter index %d"), packet.param_index);
                 break;
             }
         } else {
-            vp = AP_Param::find(packet.param_id, &p_type);
+            char key[AP_MAX_NAME_SIZE+1];
+            strncpy(key, (char *)packet.param_id, AP_MAX_NAME_SIZE);
+            key[AP_MAX_NAME_SIZE] = 0;
+            vp = param_find(key, &p_type, &param_index);
             if (vp == NULL) {
                 gcs_send_text_fmt(PSTR("Unknown parameter %.16s"), packet.param_id);
                 break;
@@ -1371,7 +1618,7 @@ void GCS_MAVLINK::handleMessage(mavlink_message_t* msg)
             value,
             mav_var_type(p_type),
             _count_parameters(),
-            packet.param_index);
+            param_index);
         break;
     }
 
@@ -1413,10 +1660,18 @@ void GCS_MAVLINK::handleMessage(mavlink_message_t* msg)
         mavlink_msg_mission_count_decode(msg, &packet);
         if (mavlink_check_target(packet.target_system,packet.target_component)) break;
 
-        // start waypoint receiving
+        // a mission that doesn't fit would run into the fence points
         if (packet.count > MAX_WAYPOINTS) {
-            packet.count = MAX_WAYPOINTS;
+            send_text(SEVERITY_LOW,PSTR("flight plan too long"));
+            mavlink_msg_mission_ack_send(
+                chan,
+                msg->sysid,
+                msg->compid,
+                MAV_MISSION_NO_SPACE);
+            break;
         }
+
+        // start waypoint receiving
         g.command_total.set_and_save(packet.count - 1);
 
         waypoint_timelast_receive = millis();
@@ -1636,6 +1891,12 @@ void GCS_MAVLINK::handleMessage(mavlink_message_t* msg)
             waypoint_request_i++;
 
             if (waypoint_request_i > waypoint_request_last) {
+                // the GCS takes the ack to mean the mission is stored
+                uint8_t saved_stage = loop_stage;
+                loop_stage = STAGE_EEPROM_WRITE;
+                mission_cache_flush_all();
+                loop_stage = saved_stage;
+
                 mavlink_msg_mission_ack_send(
                     chan,
                     msg->sysid,
@@ -1701,6 +1962,7 @@ mission_failed:
     {
         AP_Param                  *vp;
         enum ap_var_type var_type;
+        int16_t param_index;
 
         // decode
         mavlink_param_set_t packet;
@@ -1716,7 +1978,7 @@ mission_failed:
         key[AP_MAX_NAME_SIZE] = 0;
 
         // find the requested parameter
-        vp = AP_Param::find(key, &var_type);
+        vp = param_find(key, &var_type, &param_index);
         if ((NULL != vp) &&                                 // exists
             !isnan(packet.param_value) &&                       // not nan
             !isinf(packet.param_value)) {                       // not inf
@@ -1728,26 +1990,27 @@ mission_failed:
 
             // handle variables with standard type IDs
             if (var_type == AP_PARAM_FLOAT) {
-                ((AP_Float *)vp)->set_and_save(packet.param_value);
+                ((AP_Float *)vp)->set(packet.param_value);
             } else if (var_type == AP_PARAM_INT32) {
                 if (packet.param_value < 0) rounding_addition = -rounding_addition;
                 float v = packet.param_value+rounding_addition;
                 v = constrain(v, -2147483648.0, 2147483647.0);
-                ((AP_Int32 *)vp)->set_and_save(v);
+                ((AP_Int32 *)vp)->set(v);
             } else if (var_type == AP_PARAM_INT16) {
                 if (packet.param_value < 0) rounding_addition = -rounding_addition;
                 float v = packet.param_value+rounding_addition;
                 v = constrain(v, -32768, 32767);
-                ((AP_Int16 *)vp)->set_and_save(v);
+                ((AP_Int16 *)vp)->set(v);
             } else if (var_type == AP_PARAM_INT8) {
                 if (packet.param_value < 0) rounding_addition = -rounding_addition;
                 float v = packet.param_value+rounding_addition;
                 v = constrain(v, -128, 127);
-                ((AP_Int8 *)vp)->set_and_save(v);
+                ((AP_Int8 *)vp)->set(v);
             } else {
                 // we don't support mavlink set on this parameter
                 break;
             }
+            param_save_deferred(vp, var_type);
 
             // Report back the new value if we accepted the change
             // we send the value we actually set, which could be
@@ -1759,7 +2022,7 @@ mission_failed:
                 vp->cast_to_float(var_type),
                 mav_var_type(var_type),
                 _count_parameters(),
-                -1);     // XXX we don't actually know what its index is...
+                param_index);
         }
 
         break;
@@ -1800,14 +2063,18 @@ mission_failed:
         break;
     }
 
-#if HIL_MODE != HIL_MODE_DISABLED
+#if HIL_MODE != HIL_MODE_DISABLED && SIM_FDM == DISABLED && REPLAY == DISABLED
     case MAVLINK_MSG_ID_HIL_STATE:
     {
         mavlink_hil_state_t packet;
         mavlink_msg_hil_state_decode(msg, &packet);
 
-        float vel = sqrt((packet.vx * (float)packet.vx) + (packet.vy * (float)packet.vy));
-        float cog = wrap_360_cd(ToDeg(atan2(packet.vy, packet.vx)) * 100);
+#if SITL_FAST == ENABLED
+        vclock_set(packet.time_usec);
+#endif
+
+        float vel = fast_hypot(packet.vx, packet.vy);
+        float cog = wrap_360_cd(fast_atan2_cd(packet.vy, packet.vx));
 
         // set gps hil sensor
         g_gps->setHIL(packet.time_usec/1000,
@@ -1830,16 +2097,7 @@ mission_failed:
         ins.set_gyro(gyros);
         ins.set_accel(accels);
 
-        // approximate a barometer
-        float y;
-        const float Temp = 312;
-
-        y = (packet.alt - 584000.0) / 29271.267;
-        y /= (Temp / 10.0) + 273.15;
-        y = 1.0/exp(y);
-        y *= 95446.0;
-
-        barometer.setHIL(Temp, y);
+        hil_set_barometer(packet.alt);
 
  #if HIL_MODE == HIL_MODE_ATTITUDE
         // set AHRS hil sensor. We don't do this in sensors mode, as
@@ -1891,21 +2149,21 @@ mission_failed:
     {
         mavlink_radio_t packet;
         mavlink_msg_radio_decode(msg, &packet);
+        radio_status_ms = millis();
         // use the state of the transmit buffer in the radio to
         // control the stream rate, giving us adaptive software
         // flow control
-        if (packet.txbuf < 20 && stream_slowdown < 100) {
+        if (packet.txbuf < 20) {
             // we are very low on space - slow down a lot
-            stream_slowdown += 3;
-        } else if (packet.txbuf < 50 && stream_slowdown < 100) {
+            stream_rate_update(2);
+        } else if (packet.txbuf < 50) {
             // we are a bit low on space, slow down slightly
-            stream_slowdown += 1;
-        } else if (packet.txbuf > 95 && stream_slowdown > 10) {
-            // the buffer has plenty of space, speed up a lot
-            stream_slowdown -= 2;
-        } else if (packet.txbuf > 90 && stream_slowdown != 0) {
-            // the buffer has enough space, speed up a bit
-            stream_slowdown--;
+            stream_rate_update(1);
+        } else if (packet.txbuf > 90 &&
+                   min(packet.rssi - packet.noise, packet.remrssi - packet.remnoise) > 10) {
+            // the buffer has plenty of space and the signal is well
+            // above the noise at both ends, speed up
+            stream_rate_update(-1);
         }
         break;
     }
@@ -2025,6 +2283,159 @@ GCS_MAVLINK::queued_param_send()
     _queued_parameter_send_time_ms = tnow;
 }
 
+#if LOG_DOWNLOAD == ENABLED
+/*
+ *  log download. The GCS lists the logs, then asks for a window of a
+ *  log by byte offset. The window is streamed in LOG_DATA messages
+ *  carrying their offset, so the GCS can find any gaps from drops
+ *  and ask for just those again, or pick up where it left off after
+ *  losing the link. The same messages carry the parameter snapshot,
+ *  as log PARAM_SNAPSHOT_LOG_ID.
+ */
+void
+GCS_MAVLINK::handle_log_message(mavlink_message_t *msg)
+{
+    switch (msg->msgid) {
+    case MAVLINK_MSG_ID_LOG_REQUEST_LIST: {
+        mavlink_log_request_list_t packet;
+        mavlink_msg_log_request_list_decode(msg, &packet);
+        if (mavlink_check_target(packet.target_system,packet.target_component)) break;
+
+        if (!Log_Download_Allowed()) {
+            send_text(SEVERITY_HIGH, PSTR("Log download only on the ground"));
+            break;
+        }
+        Log_Download_Start();
+        uint16_t num_logs = DataFlash.get_num_logs();
+        log_listing = true;
+        log_list_next = packet.start > 1 ? packet.start : 1;
+        log_list_last = packet.end < num_logs ? packet.end : num_logs;
+        break;
+    }
+
+    case MAVLINK_MSG_ID_LOG_REQUEST_DATA: {
+        mavlink_log_request_data_t packet;
+        mavlink_msg_log_request_data_decode(msg, &packet);
+        if (mavlink_check_target(packet.target_system,packet.target_component)) break;
+
+        uint32_t size;
+        if (packet.id == PARAM_SNAPSHOT_LOG_ID) {
+            // the parameters, not a log, so logging carries on
+            size = param_snapshot_size();
+            param_snapshot_start(packet.ofs);
+        } else {
+            if (!Log_Download_Allowed()) {
+                send_text(SEVERITY_HIGH, PSTR("Log download only on the ground"));
+                break;
+            }
+            size = Log_Size(packet.id);
+            if (size == 0) {
+                break;
+            }
+            Log_Download_Start();
+        }
+        log_listing = false;
+        log_data_id = packet.id;
+        log_data_ofs = packet.ofs;
+        if (packet.ofs >= size) {
+            // a single empty LOG_DATA tells the GCS it is past the end
+            log_data_end = packet.ofs;
+        } else if (packet.count > size - packet.ofs) {
+            log_data_end = size;
+        } else {
+            log_data_end = packet.ofs + packet.count;
+        }
+        break;
+    }
+
+    case MAVLINK_MSG_ID_LOG_ERASE: {
+        mavlink_log_erase_t packet;
+        mavlink_msg_log_erase_decode(msg, &packet);
+        if (mavlink_check_target(packet.target_system,packet.target_component)) break;
+
+        // erasing blocks the main loop for many seconds
+        if (!Log_Download_Allowed()) {
+            send_text(SEVERITY_HIGH, PSTR("Log erase only on the ground"));
+            break;
+        }
+        log_listing = false;
+        log_data_id = 0;
+        Log_Download_Start();
+        do_erase_logs();
+        Log_Download_End();
+        break;
+    }
+
+    case MAVLINK_MSG_ID_LOG_REQUEST_END: {
+        mavlink_log_request_end_t packet;
+        mavlink_msg_log_request_end_decode(msg, &packet);
+        if (mavlink_check_target(packet.target_system,packet.target_component)) break;
+
+        log_listing = false;
+        log_data_id = 0;
+        Log_Download_End();
+        break;
+    }
+    }
+}
+
+// at most this many LOG_DATA messages per call, to bound the time
+// spent reading the DataFlash
+#define LOG_DATA_BURST 4
+
+/**
+ * @brief Send the next log list entry, or the next few blocks of the
+ * log being downloaded, called from deferred message handling code
+ */
+void
+GCS_MAVLINK::queued_log_send()
+{
+    if (log_listing) {
+        uint16_t num_logs = DataFlash.get_num_logs();
+        if (num_logs == 0) {
+            // tell the GCS there is nothing to list
+            mavlink_msg_log_entry_send(chan, 0, 0, 0, 0, 0);
+            log_listing = false;
+        } else if (log_list_next <= log_list_last) {
+            mavlink_msg_log_entry_send(chan, log_list_next, num_logs, num_logs,
+                                       0, Log_Size(log_list_next));
+            log_list_next++;
+        }
+        if (log_list_next > log_list_last) {
+            log_listing = false;
+        }
+        return;
+    }
+
+    for (uint8_t n=0; n<LOG_DATA_BURST && log_data_id != 0; n++) {
+        if (n != 0 &&
+            comm_get_txspace(chan) < MAVLINK_MSG_ID_LOG_DATA_LEN + MAVLINK_NUM_NON_PAYLOAD_BYTES) {
+            break;
+        }
+        uint8_t data[MAVLINK_MSG_LOG_DATA_FIELD_DATA_LEN];
+        uint32_t len = log_data_end - log_data_ofs;
+        if (len > sizeof(data)) {
+            len = sizeof(data);
+        }
+        if (log_data_id == PARAM_SNAPSHOT_LOG_ID) {
+            if (!param_snapshot_summed()) {
+                // still working out the CRC for the header
+                break;
+            }
+            len = param_snapshot_read(log_data_ofs, data, len);
+        } else {
+            len = Log_Read_Block(log_data_id, log_data_ofs, data, len);
+        }
+        mavlink_msg_log_data_send(chan, log_data_id, log_data_ofs, len, data);
+        log_data_ofs += len;
+        if (len == 0 || log_data_ofs >= log_data_end) {
+            // window done, the GCS will ask for any more it wants
+            log_data_id = 0;
+        }
+    }
+}
+#endif // LOG_DOWNLOAD
+
 /**
  * @brief Send the next pending waypoint, called from deferred message
  * handling code
@@ -2062,6 +2473,13 @@ static void mavlink_delay(unsigned long t)
 
     in_mavlink_delay = true;
 
+    // keep the stage of a caller that has one of its own, such as a
+    // sensor calibration
+    uint8_t saved_stage = loop_stage;
+    if (loop_stage < STAGE_IDLE || loop_stage == STAGE_STARTUP) {
+        loop_stage = STAGE_MAVLINK_DELAY;
+    }
+
     tstart = millis();
     do {
         uint32_t tnow = millis();
@@ -2085,6 +2503,7 @@ static void mavlink_delay(unsigned long t)
 #endif
     } while (millis() - tstart < t);
 
+    loop_stage = saved_stage;
     in_mavlink_delay = false;
 }
 
@@ -0,0 +1,95 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/// @file	ISR_Ring.h
+/// @brief	Lock free ring buffer for passing data from an interrupt
+///         handler to the main loop.
+
+#ifndef __ISR_RING_H
+#define __ISR_RING_H
+
+#include <stdint.h>
+
+/// stop the compiler moving memory accesses across this point. The AVR
+/// doesn't reorder memory accesses itself, so this is all the ordering
+/// the ring needs
+#define ISR_RING_BARRIER() asm volatile("" ::: "memory")
+
+///
+/// @class	ISR_Ring
+/// @brief	Single producer, single consumer ring of SIZE elements
+///
+/// One side, normally an interrupt handler, calls push() and the other
+/// calls pop(). Neither needs to disable interrupts: each index is a
+/// single byte, so is read and written atomically, and is only ever
+/// written by one side. The producer fills in an element before moving
+/// the tail past it, and the consumer copies an element out before
+/// moving the head past it.
+///
+/// When the ring is full new elements are dropped and counted, so the
+/// producer never has to wait for the consumer.
+///
+/// SIZE must be a power of 2, no more than 128.
+///
+template <class T, uint8_t SIZE>
+class ISR_Ring
+{
+public:
+    ISR_Ring() : _head(0), _tail(0), _overflows(0) {
+    }
+
+    /// Add an element. Only call from the producer.
+    ///
+    /// @return     false if the ring was full and the element was dropped
+    ///
+    bool push(const T &v) {
+        uint8_t tail = _tail;
+        if ((uint8_t)(tail - _head) == SIZE) {
+            if (_overflows != 0xFFFF) {
+                _overflows++;
+            }
+            return false;
+        }
+        _buf[tail & (SIZE-1)] = v;
+        ISR_RING_BARRIER();
+        _tail = tail + 1;
+        return true;
+    }
+
+    /// Remove the oldest element. Only call from the consumer.
+    ///
+    /// @return     false if the ring was empty
+    ///
+    bool pop(T &v) {
+        uint8_t head = _head;
+        if (head == _tail) {
+            return false;
+        }
+        ISR_RING_BARRIER();
+        v = _buf[head & (SIZE-1)];
+        ISR_RING_BARRIER();
+        _head = head + 1;
+        return true;
+    }
+
+    /// number of elements waiting
+    uint8_t available(void) const {
+        return _tail - _head;
+    }
+
+    /// number of elements dropped because the ring was full. This is
+    /// written by the producer, so is read until it is stable
+    uint16_t overflows(void) const {
+        uint16_t n;
+        do {
+            n = _overflows;
+        } while (n != _overflows);
+        return n;
+    }
+
+private:
+    T _buf[SIZE];
+    volatile uint8_t _head;         // next to pop, written by the consumer
+    volatile uint8_t _tail;         // next to push, written by the producer
+    volatile uint16_t _overflows;   // written by the producer
+};
+
+#endif // __ISR_RING_H
@@ -23,7 +23,7 @@ static int8_t   select_logs(uint8_t argc,               const Menu::arg *argv);
 /*{
  *       cliSerial->printf_P(PSTR("\n"
  *                                                "Commands:\n"
- *                                                "  dump <n>"
+ *                                                "  dump <n> [raw]"
  *                                                "  erase (all logs)\n"
  *                                                "  enable <name> | all\n"
  *                                                "  disable <name> | all\n"
@@ -75,6 +75,8 @@ print_log_menu(void)
         PLOG(RAW);
         PLOG(CMD);
         PLOG(CUR);
+        PLOG(VSCL);
+        PLOG(REPLAY);
  #undef PLOG
     }
 
@@ -124,7 +126,7 @@ dump_log(uint8_t argc, const Menu::arg *argv)
         cliSerial->printf_P(PSTR("dumping all\n"));
         Log_Read(1, DataFlash.df_NumPages);
         return(-1);
-    } else if ((argc != 2) || (dump_log <= (last_log_num - DataFlash.get_num_logs())) || (dump_log > last_log_num)) {
+    } else if ((argc < 2) || (dump_log <= (last_log_num - DataFlash.get_num_logs())) || (dump_log > last_log_num)) {
         cliSerial->printf_P(PSTR("bad log number\n"));
         return(-1);
     }
@@ -135,15 +137,24 @@ dump_log(uint8_t argc, const Menu::arg *argv)
                     (int)dump_log_start,
                     (int)dump_log_end);
 
-    Log_Read(dump_log_start, dump_log_end);
+    if (argc > 2 && !strcasecmp_P(argv[2].str, PSTR("raw"))) {
+        Log_Dump_Binary(dump_log_start, dump_log_end);
+    } else {
+        Log_Read(dump_log_start, dump_log_end);
+    }
     cliSerial->printf_P(PSTR("Done\n"));
     return 0;
 }
 
 static void do_erase_logs(void)
 {
+    // throw away anything not yet written
+    log_ring_used = 0;
     gcs_send_text_P(SEVERITY_LOW, PSTR("Erasing logs"));
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_LOG_ERASE;
     DataFlash.EraseAll(mavlink_delay);
+    loop_stage = saved_stage;
     gcs_send_text_P(SEVERITY_LOW, PSTR("Log erase complete"));
 }
 
@@ -188,6 +199,8 @@ select_logs(uint8_t argc, const Menu::arg *argv)
         TARG(RAW);
         TARG(CMD);
         TARG(CUR);
+        TARG(VSCL);
+        TARG(REPLAY);
  #undef TARG
     }
 
@@ -209,70 +222,578 @@ process_logs(uint8_t argc, const Menu::arg *argv)
 
 
 
+/*
+ *  Each record is filled in as a packed structure and copied into a
+ *  RAM ring buffer, which is written out to the DataFlash from the
+ *  idle loop. If the ring is full the record is dropped and counted in
+ *  log_dropped_count, rather than holding up the main loop. Records are
+ *  stored in the byte order of the CPU, little endian.
+ */
+#define LOG_RING_SIZE   256     // must be a power of 2
+#define LOG_FLUSH_BYTES 128     // most bytes written per idle call
+
+static uint8_t log_ring[LOG_RING_SIZE];
+static uint16_t log_ring_head;  // next byte to write to the DataFlash
+static uint16_t log_ring_used;
+
+#define LOG_PACKET_HEADER   uint8_t head1, head2, msgid
+#define LOG_PACKET_HEADER_INIT(id) HEAD_BYTE1, HEAD_BYTE2, id
+
+struct PACKED log_Attitude {
+    LOG_PACKET_HEADER;
+    int16_t roll;
+    int16_t pitch;
+    uint16_t yaw;
+    uint8_t end;
+};
+
+struct PACKED log_Performance {
+    LOG_PACKET_HEADER;
+    uint32_t loop_time;
+    int16_t main_loop_count;
+    int16_t g_dt_max;
+    uint8_t sched_overruns;
+    uint8_t sched_skips;
+    uint8_t renorm_count;
+    uint8_t renorm_blowup;
+    uint8_t gps_fix_count;
+    int16_t log_dropped;
+    int16_t gyro_drift_x;
+    int16_t gyro_drift_y;
+    int16_t gyro_drift_z;
+    int16_t pm_test;
+    uint8_t end;
+};
+struct PACKED log_Stall {
+    LOG_PACKET_HEADER;
+    uint8_t stage;
+    uint8_t count;
+    uint16_t duration_ms;
+    uint32_t start_ms;
+    uint8_t reset;
+    uint8_t end;
+};
+struct PACKED log_Isr {
+    LOG_PACKET_HEADER;
+    uint16_t overflows;
+    uint16_t loop_gap_max;
+    uint16_t rc_gap_max;
+    uint8_t end;
+};
+
+struct PACKED log_Perf_Task {
+    LOG_PACKET_HEADER;
+    uint8_t task;
+    uint16_t count;
+    uint16_t min_us;
+    uint16_t mean_us;
+    uint16_t max_us;
+    uint16_t p99_us;
+    uint8_t end;
+};
+
+struct PACKED log_Cmd {
+    LOG_PACKET_HEADER;
+    uint8_t num;
+    uint8_t id;
+    uint8_t p1;
+    int32_t alt;
+    int32_t lat;
+    int32_t lng;
+    uint8_t end;
+};
+
+struct PACKED log_Startup {
+    LOG_PACKET_HEADER;
+    uint8_t startup_type;
+    uint8_t command_total;
+    uint8_t end;
+};
+
+struct PACKED log_Control_Tuning {
+    LOG_PACKET_HEADER;
+    int16_t roll_out;
+    int16_t nav_roll_cd;
+    int16_t roll;
+    int16_t pitch_out;
+    int16_t nav_pitch_cd;
+    int16_t pitch;
+    int16_t throttle_out;
+    int16_t rudder_out;
+    int16_t accel_y;
+    uint8_t end;
+};
+
+struct PACKED log_Nav_Tuning {
+    LOG_PACKET_HEADER;
+    uint16_t yaw;
+    int16_t wp_distance;
+    uint16_t target_bearing_cd;
+    uint16_t nav_bearing_cd;
+    int16_t altitude_error_cm;
+    int16_t airspeed_cm;
+    int16_t unused;             // was nav_gain_scaler
+    uint8_t end;
+};
+
+struct PACKED log_Mode {
+    LOG_PACKET_HEADER;
+    uint8_t mode;
+    uint8_t end;
+};
+
+struct PACKED log_GPS {
+    LOG_PACKET_HEADER;
+    int32_t gps_time;
+    uint8_t fix;
+    uint8_t num_sats;
+    int32_t latitude;
+    int32_t longitude;
+    int16_t unused;             // was sonar_alt
+    int32_t mix_alt;
+    int32_t gps_alt;
+    int32_t ground_speed;
+    int32_t ground_course;
+    uint8_t end;
+};
+
+struct PACKED log_Raw {
+    LOG_PACKET_HEADER;
+    int32_t gyro_x, gyro_y, gyro_z;
+    int32_t accel_x, accel_y, accel_z;
+    uint8_t end;
+};
+
+struct PACKED log_Current {
+    LOG_PACKET_HEADER;
+    int16_t throttle_in;
+    int16_t battery_voltage;
+    int16_t current_amps;
+    int16_t current_total;
+    uint8_t end;
+};
+
+/*
+ *  VSCL experiment records, commanded against achieved states at 50Hz.
+ *  A key record holds every value, and is followed by delta records
+ *  holding the change in each value since the previous sample. A new
+ *  key is written every VSCL_LOG_KEY_INTERVAL samples, whenever a
+ *  change won't fit in a byte, and after a record is dropped. seq
+ *  counts samples, so a reader can tell if it has missed one.
+ *
+ *  A FMT record can't describe more than 16 fields, so the achieved
+ *  states go in a second key/delta pair with the same seq. Both pairs
+ *  switch between key and delta records together.
+ */
+#define VSCL_LOG_FIELDS 12
+#define VSCL_LOG_STATE_FIELDS 4
+#define VSCL_LOG_KEY_INTERVAL 50
+
+struct PACKED log_Vscl_Key {
+    LOG_PACKET_HEADER;
+    uint32_t time_ms;
+    uint8_t seq;
+    int16_t phi_cmd;            // VSCL_PHI, degrees
+    int16_t spd_cmd;            // VSCL_SPD, cm/s
+    int16_t alt_cmd;            // VSCL_ALT, cm
+    int16_t nav_roll_cd;
+    int16_t nav_pitch_cd;
+    int32_t altitude_error_cm;
+    int16_t airspeed_error_cm;
+    int32_t energy_error;
+    int16_t roll_out;
+    int16_t pitch_out;
+    int16_t throttle_out;
+    int16_t rudder_out;
+    uint8_t end;
+};
+struct PACKED log_Vscl_Delta {
+    LOG_PACKET_HEADER;
+    uint8_t seq;
+    int8_t delta[VSCL_LOG_FIELDS];  // in the order of log_Vscl_Key
+    uint8_t end;
+};
+struct PACKED log_Vscl_State_Key {
+    LOG_PACKET_HEADER;
+    uint8_t seq;
+    int16_t roll_cd;
+    int16_t pitch_cd;
+    int16_t airspeed_cm;
+    int32_t altitude_cm;
+    uint8_t end;
+};
+struct PACKED log_Vscl_State_Delta {
+    LOG_PACKET_HEADER;
+    uint8_t seq;
+    int8_t delta[VSCL_LOG_STATE_FIELDS];  // in the order of log_Vscl_State_Key
+    uint8_t end;
+};
+
+/*
+ *  Replay records, holding every input the control stack takes in, so
+ *  that a desktop build can fly the same ticks again. See replay.ino.
+ *  The tick record is written as each tick finishes, so that a reader
+ *  can gather everything belonging to a tick before running it. Of
+ *  the records since the previous tick record, the first pre came in
+ *  while waiting for the tick to start. A received MAVLink message is
+ *  split over as many chunk records as it needs.
+ */
+#define LOG_REPLAY_MAV_CHUNK 32
+
+struct PACKED log_Replay_Tick {
+    LOG_PACKET_HEADER;
+    uint32_t time_ms;           // millis() at the start of the tick
+    uint32_t time_us;           // micros() at the start of the tick
+    uint32_t sched_ran;         // a bit for each scheduler task that ran
+    uint8_t pre;
+    float gyro_x, gyro_y, gyro_z;
+    float accel_x, accel_y, accel_z;
+    uint16_t seq;               // counts ticks, so a lost tick record shows
+    uint8_t dropped;            // replay records of this tick that were lost
+    uint8_t end;
+};
+struct PACKED log_Replay_RC {
+    LOG_PACKET_HEADER;
+    int16_t pwm[8];
+    uint8_t end;
+};
+struct PACKED log_Replay_GPS {
+    LOG_PACKET_HEADER;
+    uint32_t gps_time;
+    int32_t latitude;
+    int32_t longitude;
+    int32_t altitude;
+    int32_t ground_speed;
+    int32_t ground_course;
+    uint8_t num_sats;
+    uint8_t fix;
+    uint8_t end;
+};
+struct PACKED log_Replay_Baro {
+    LOG_PACKET_HEADER;
+    int32_t pressure;
+    int16_t temperature;
+    uint8_t end;
+};
+struct PACKED log_Replay_Airspeed {
+    LOG_PACKET_HEADER;
+    float airspeed;
+    uint8_t end;
+};
+struct PACKED log_Replay_Mag {
+    LOG_PACKET_HEADER;
+    int16_t mag_x, mag_y, mag_z;
+    uint8_t end;
+};
+struct PACKED log_Replay_Mavlink {
+    LOG_PACKET_HEADER;
+    uint32_t time_ms;
+    uint8_t chan;
+    uint8_t mav_msgid;
+    uint8_t sysid;
+    uint8_t compid;
+    uint8_t len;                // of the whole message
+    uint8_t ofs;                // of this chunk
+    uint8_t data[LOG_REPLAY_MAV_CHUNK];
+    uint8_t end;
+};
+struct PACKED log_Replay_Ground {
+    LOG_PACKET_HEADER;
+    float ground_pressure;
+    float ground_temperature;
+    uint8_t end;
+};
+
+struct PACKED log_Format {
+    LOG_PACKET_HEADER;
+    uint8_t type;
+    uint8_t length;
+    char name[4];
+    char format[16];
+    char labels[64];
+    uint8_t end;
+};
+
+/*
+ *  The layout of every record, written as FMT records at the start of
+ *  each log so that the log describes itself. Lengths include the
+ *  header and end bytes. Format characters are:
+ *    b : int8_t     B : uint8_t
+ *    h : int16_t    H : uint16_t
+ *    i : int32_t    I : uint32_t
+ *    c : int16_t * 100    C : uint16_t * 100
+ *    e : int32_t * 100    L : int32_t * 1e7, such as latitude
+ *    n : char[4]    N : char[16]    Z : char[64]
+ *    f : float      a : uint8_t[32], shown in hex
+ */
+struct LogStructure {
+    uint8_t msg_type;
+    uint8_t msg_len;
+    char name[5];
+    char format[17];
+    char labels[65];
+};
+
+#define LOG_STRUCTURE(type, pkt, name, format, labels) \
+    { type, sizeof(struct pkt), name, format, labels }
+
+static const struct LogStructure log_structure[] PROGMEM = {
+    LOG_STRUCTURE(LOG_FORMAT_MSG, log_Format, "FMT", "BBnNZ",
+                  "Type,Length,Name,Format,Labels"),
+    LOG_STRUCTURE(LOG_ATTITUDE_MSG, log_Attitude, "ATT", "ccC",
+                  "Roll,Pitch,Yaw"),
+    LOG_STRUCTURE(LOG_GPS_MSG, log_GPS, "GPS", "iBBLLheeee",
+                  "Time,Fix,NSats,Lat,Lng,Unused,MixAlt,GPSAlt,Spd,Crs"),
+    LOG_STRUCTURE(LOG_MODE_MSG, log_Mode, "MOD", "B",
+                  "Mode"),
+    LOG_STRUCTURE(LOG_CONTROL_TUNING_MSG, log_Control_Tuning, "CTUN", "ccccccchh",
+                  "RollOut,NavRoll,Roll,PitchOut,NavPitch,Pitch,ThrOut,RdrOut,AccY"),
+    LOG_STRUCTURE(LOG_NAV_TUNING_MSG, log_Nav_Tuning, "NTUN", "ChCCcch",
+                  "Yaw,WpDist,TargBrg,NavBrg,AltErr,Arspd,Unused"),
+    LOG_STRUCTURE(LOG_PERFORMANCE_MSG, log_Performance, "PM", "IhhBBBBBhhhhh",
+                  "LTime,Loops,GDt,SOvr,SSkp,RN,RNBl,GFix,Drop,DrX,DrY,DrZ,PMT"),
+    LOG_STRUCTURE(LOG_RAW_MSG, log_Raw, "RAW", "LLLLLL",
+                  "GyrX,GyrY,GyrZ,AccX,AccY,AccZ"),
+    LOG_STRUCTURE(LOG_CMD_MSG, log_Cmd, "CMD", "BBBeLL",
+                  "Num,Id,P1,Alt,Lat,Lng"),
+    LOG_STRUCTURE(LOG_CURRENT_MSG, log_Current, "CURR", "hcch",
+                  "Thr,Volt,Curr,CurrTot"),
+    LOG_STRUCTURE(LOG_STARTUP_MSG, log_Startup, "STRT", "BB",
+                  "Type,NumCmds"),
+    LOG_STRUCTURE(LOG_PERF_TASK_MSG, log_Perf_Task, "PTSK", "BHHHHH",
+                  "Task,Count,Min,Mean,Max,P99"),
+    LOG_STRUCTURE(LOG_VSCL_KEY_MSG, log_Vscl_Key, "VSCK", "IBhhhhhihihhhh",
+                  "TimeMS,Seq,PhiC,SpdC,AltC,NRol,NPit,AltE,SpdE,EnE,RO,PO,TO,YO"),
+    LOG_STRUCTURE(LOG_ISR_MSG, log_Isr, "ISR", "HHH",
+                  "Ovr,LoopGap,RCGap"),
+    LOG_STRUCTURE(LOG_STALL_MSG, log_Stall, "STAL", "BBHIB",
+                  "Stage,Count,DurMS,StartMS,Reset"),
+    LOG_STRUCTURE(LOG_VSCL_DELTA_MSG, log_Vscl_Delta, "VSCD", "Bbbbbbbbbbbbb",
+                  "Seq,PhiC,SpdC,AltC,NRol,NPit,AltE,SpdE,EnE,RO,PO,TO,YO"),
+    LOG_STRUCTURE(LOG_VSCL_STATE_KEY_MSG, log_Vscl_State_Key, "VSAK", "Bhhhi",
+                  "Seq,Roll,Pitch,Spd,Alt"),
+    LOG_STRUCTURE(LOG_VSCL_STATE_DELTA_MSG, log_Vscl_State_Delta, "VSAD", "Bbbbb",
+                  "Seq,Roll,Pitch,Spd,Alt"),
+    LOG_STRUCTURE(LOG_REPLAY_TICK_MSG, log_Replay_Tick, "RTCK", "IIIBffffffHB",
+                  "TimeMS,TimeUS,Sched,Pre,GyrX,GyrY,GyrZ,AccX,AccY,AccZ,Seq,Drop"),
+    LOG_STRUCTURE(LOG_REPLAY_RC_MSG, log_Replay_RC, "RRC", "hhhhhhhh",
+                  "C1,C2,C3,C4,C5,C6,C7,C8"),
+    LOG_STRUCTURE(LOG_REPLAY_GPS_MSG, log_Replay_GPS, "RGPS", "IiiiiiBB",
+                  "Time,Lat,Lng,Alt,Spd,Crs,NSats,Fix"),
+    LOG_STRUCTURE(LOG_REPLAY_BARO_MSG, log_Replay_Baro, "RBAR", "ih",
+                  "Press,Temp"),
+    LOG_STRUCTURE(LOG_REPLAY_ASPD_MSG, log_Replay_Airspeed, "RASP", "f",
+                  "Airspeed"),
+    LOG_STRUCTURE(LOG_REPLAY_MAG_MSG, log_Replay_Mag, "RMAG", "hhh",
+                  "MagX,MagY,MagZ"),
+    LOG_STRUCTURE(LOG_REPLAY_MAV_MSG, log_Replay_Mavlink, "RMAV", "IBBBBBBa",
+                  "TimeMS,Chan,MsgId,SysId,CompId,Len,Ofs,Data"),
+    LOG_STRUCTURE(LOG_REPLAY_GND_MSG, log_Replay_Ground, "RGND", "ff",
+                  "GndPress,GndTemp")
+};
+#define LOG_NUM_STRUCTURES (sizeof(log_structure) / sizeof(log_structure[0]))
+#define LOG_MAX_RECORD sizeof(struct log_Format)
+
+// queue a complete record for writing, returning false if it was dropped
+static bool Log_Write_Record(const void *pkt, uint8_t size)
+{
+    // records made during a download would land in the old log, and
+    // are thrown away when it ends, so count them as dropped now
+    if (log_download_active || LOG_RING_SIZE - log_ring_used < size) {
+        if (log_dropped_count < 0xFFFF) {
+            log_dropped_count++;
+        }
+        return false;
+    }
+    uint16_t tail = (log_ring_head + log_ring_used) & (LOG_RING_SIZE-1);
+    uint16_t n = min(size, LOG_RING_SIZE - tail);
+    memcpy(&log_ring[tail], pkt, n);
+    if (n < size) {
+        memcpy(&log_ring[0], (const uint8_t *)pkt + n, size - n);
+    }
+    log_ring_used += size;
+    idle_work_request(IDLE_WORK_LOG_FLUSH);
+    return true;
+}
+
+/*
+ *  write some of the ring buffer to the DataFlash. Returns true if
+ *  there is more to write
+ */
+static bool Log_Flush_Step(void)
+{
+    if (log_download_active) {
+        // the DataFlash is being read, hold on to the records
+        return false;
+    }
+    uint8_t n = min(log_ring_used, LOG_FLUSH_BYTES);
+    for (uint8_t i=0; i<n; i++) {
+        DataFlash.WriteByte(log_ring[log_ring_head]);
+        log_ring_head = (log_ring_head + 1) & (LOG_RING_SIZE-1);
+    }
+    log_ring_used -= n;
+    return log_ring_used != 0;
+}
+
+// write out everything in the ring buffer now
+static void Log_Flush(void)
+{
+    while (Log_Flush_Step()) ;
+}
+
+// describe every record type, at the start of a log. During a download
+// this waits for Log_Download_End(), which starts the new log
+static void Log_Write_Formats(void)
+{
+    if (log_download_active) {
+        return;
+    }
+    for (uint8_t i=0; i<LOG_NUM_STRUCTURES; i++) {
+        struct log_Format pkt;
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.head1 = HEAD_BYTE1;
+        pkt.head2 = HEAD_BYTE2;
+        pkt.msgid = LOG_FORMAT_MSG;
+        pkt.type = pgm_read_byte(&log_structure[i].msg_type);
+        pkt.length = pgm_read_byte(&log_structure[i].msg_len);
+        strncpy_P(pkt.name, log_structure[i].name, sizeof(pkt.name));
+        strncpy_P(pkt.format, log_structure[i].format, sizeof(pkt.format));
+        strncpy_P(pkt.labels, log_structure[i].labels, sizeof(pkt.labels));
+        pkt.end = END_BYTE;
+        // these are bigger than the ring buffer can take in one go
+        Log_Flush();
+        Log_Write_Record(&pkt, sizeof(pkt));
+    }
+    Log_Flush();
+}
+
 // Write an attitude packet. Total length : 10 bytes
 static void Log_Write_Attitude(int16_t log_roll, int16_t log_pitch, uint16_t log_yaw)
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_ATTITUDE_MSG);
-    DataFlash.WriteInt(log_roll);
-    DataFlash.WriteInt(log_pitch);
-    DataFlash.WriteInt(log_yaw);
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Attitude pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_ATTITUDE_MSG),
+        log_roll,
+        log_pitch,
+        log_yaw,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
-// Write a performance monitoring packet. Total length : 19 bytes
+// Write a performance monitoring packet. Total length : 27 bytes
 static void Log_Write_Performance()
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_PERFORMANCE_MSG);
-    DataFlash.WriteLong(millis()- perf_mon_timer);
-    DataFlash.WriteInt((int16_t)mainLoop_count);
-    DataFlash.WriteInt(G_Dt_max);
-    DataFlash.WriteByte(0);
-    DataFlash.WriteByte(0);
-    DataFlash.WriteByte(ahrs.renorm_range_count);
-    DataFlash.WriteByte(ahrs.renorm_blowup_count);
-    DataFlash.WriteByte(gps_fix_count);
-    DataFlash.WriteInt(1);     // AHRS health
-    DataFlash.WriteInt((int)(ahrs.get_gyro_drift().x * 1000));
-    DataFlash.WriteInt((int)(ahrs.get_gyro_drift().y * 1000));
-    DataFlash.WriteInt((int)(ahrs.get_gyro_drift().z * 1000));
-    DataFlash.WriteInt(pmTest1);
-    DataFlash.WriteByte(END_BYTE);
+    Vector3f drift = ahrs.get_gyro_drift();
+    struct log_Performance pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_PERFORMANCE_MSG),
+        (uint32_t)(millis() - perf_mon_timer),
+        (int16_t)mainLoop_count,
+        G_Dt_max,
+        sched_overrun_count,
+        sched_skip_count,
+        ahrs.renorm_range_count,
+        ahrs.renorm_blowup_count,
+        (uint8_t)gps_fix_count,
+        (int16_t)log_dropped_count,
+        (int16_t)(drift.x * 1000),
+        (int16_t)(drift.y * 1000),
+        (int16_t)(drift.z * 1000),
+        pmTest1,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
+}
+
+// Write the last main loop stall. Total length : 14 bytes
+static void Log_Write_Stall()
+{
+    struct log_Stall pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_STALL_MSG),
+        loop_stall.stage,
+        loop_stall.count,
+        loop_stall.duration_ms,
+        loop_stall.start_ms,
+        loop_stall.reset,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
+}
+
+// Write the timings seen through the timer interrupt event ring in this
+// performance monitoring interval. Total length : 10 bytes
+static void Log_Write_Isr()
+{
+    struct log_Isr pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_ISR_MSG),
+        isr_events.overflows(),
+        isr_loop_gap_max_us,
+        isr_rc_gap_max_us,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
+}
+
+// Write the loop profiler statistics, one packet per task that ran in
+// this performance monitoring interval. Total length : 15 bytes each
+static void Log_Write_Perf_Tasks()
+{
+#if LOOP_PROFILER == ENABLED
+    for (uint8_t i = 0; i < PERF_NUM_TASKS; i++) {
+        if (perf_stats[i].count == 0) {
+            continue;
+        }
+        // there are more of these than the ring buffer can take in one go
+        if (LOG_RING_SIZE - log_ring_used < sizeof(struct log_Perf_Task)) {
+            Log_Flush();
+        }
+        struct log_Perf_Task pkt = {
+            LOG_PACKET_HEADER_INIT(LOG_PERF_TASK_MSG),
+            i,
+            perf_stats[i].count,
+            perf_stats[i].min_us,
+            perf_mean_us(i),
+            perf_stats[i].max_us,
+            perf_p99_us(i),
+            END_BYTE
+        };
+        Log_Write_Record(&pkt, sizeof(pkt));
+    }
+#endif
 }
 
 // Write a command processing packet. Total length : 19 bytes
-//void Log_Write_Cmd(byte num, byte id, byte p1, int32_t alt, int32_t lat, int32_t lng)
 static void Log_Write_Cmd(byte num, struct Location *wp)
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_CMD_MSG);
-    DataFlash.WriteByte(num);
-    DataFlash.WriteByte(wp->id);
-    DataFlash.WriteByte(wp->p1);
-    DataFlash.WriteLong(wp->alt);
-    DataFlash.WriteLong(wp->lat);
-    DataFlash.WriteLong(wp->lng);
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Cmd pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_CMD_MSG),
+        num,
+        wp->id,
+        wp->p1,
+        wp->alt,
+        wp->lat,
+        wp->lng,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
 static void Log_Write_Startup(byte type)
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_STARTUP_MSG);
-    DataFlash.WriteByte(type);
-    DataFlash.WriteByte(g.command_total);
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Startup pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_STARTUP_MSG),
+        type,
+        (uint8_t)g.command_total,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 
     // create a location struct to hold the temp Waypoints for printing
     struct Location cmd = get_cmd_with_index(0);
     Log_Write_Cmd(0, &cmd);
 
     for (int16_t i = 1; i <= g.command_total; i++) {
+        // the whole mission won't fit in the ring buffer
+        Log_Flush();
         cmd = get_cmd_with_index(i);
         Log_Write_Cmd(i, &cmd);
     }
@@ -284,65 +805,69 @@ static void Log_Write_Control_Tuning()
 {
     Vector3f accel = ins.get_accel();
 
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_CONTROL_TUNING_MSG);
-    DataFlash.WriteInt(g.channel_roll.servo_out);
-    DataFlash.WriteInt(nav_roll_cd);
-    DataFlash.WriteInt((int)ahrs.roll_sensor);
-    DataFlash.WriteInt((int)(g.channel_pitch.servo_out));
-    DataFlash.WriteInt((int)nav_pitch_cd);
-    DataFlash.WriteInt((int)ahrs.pitch_sensor);
-    DataFlash.WriteInt((int)(g.channel_throttle.servo_out));
-    DataFlash.WriteInt((int)(g.channel_rudder.servo_out));
-    DataFlash.WriteInt((int)(accel.y * 10000));
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Control_Tuning pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_CONTROL_TUNING_MSG),
+        (int16_t)g.channel_roll.servo_out,
+        (int16_t)nav_roll_cd,
+        (int16_t)ahrs.roll_sensor,
+        (int16_t)g.channel_pitch.servo_out,
+        (int16_t)nav_pitch_cd,
+        (int16_t)ahrs.pitch_sensor,
+        (int16_t)g.channel_throttle.servo_out,
+        (int16_t)g.channel_rudder.servo_out,
+        (int16_t)(accel.y * 10000),
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
 // Write a navigation tuning packet. Total length : 18 bytes
 static void Log_Write_Nav_Tuning()
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_NAV_TUNING_MSG);
-    DataFlash.WriteInt((uint16_t)ahrs.yaw_sensor);
-    DataFlash.WriteInt((int16_t)wp_distance);
-    DataFlash.WriteInt(target_bearing_cd);
-    DataFlash.WriteInt(nav_bearing_cd);
-    DataFlash.WriteInt(altitude_error_cm);
-    DataFlash.WriteInt((int16_t)airspeed.get_airspeed_cm());
-    DataFlash.WriteInt(0);     // was nav_gain_scaler
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Nav_Tuning pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_NAV_TUNING_MSG),
+        (uint16_t)ahrs.yaw_sensor,
+        (int16_t)wp_distance,
+        (uint16_t)target_bearing_cd,
+        (uint16_t)nav_bearing_cd,
+        (int16_t)altitude_error_cm,
+        (int16_t)airspeed.get_airspeed_cm(),
+        0,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
 // Write a mode packet. Total length : 5 bytes
 static void Log_Write_Mode(byte mode)
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_MODE_MSG);
-    DataFlash.WriteByte(mode);
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Mode pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_MODE_MSG),
+        mode,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
-// Write an GPS packet. Total length : 30 bytes
+// Write an GPS packet. Total length : 36 bytes
 static void Log_Write_GPS(      int32_t log_Time, int32_t log_Lattitude, int32_t log_Longitude, int32_t log_gps_alt, int32_t log_mix_alt,
                                 int32_t log_Ground_Speed, int32_t log_Ground_Course, byte log_Fix, byte log_NumSats)
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_GPS_MSG);
-    DataFlash.WriteLong(log_Time);
-    DataFlash.WriteByte(log_Fix);
-    DataFlash.WriteByte(log_NumSats);
-    DataFlash.WriteLong(log_Lattitude);
-    DataFlash.WriteLong(log_Longitude);
-    DataFlash.WriteInt(0); // was sonar_alt
-    DataFlash.WriteLong(log_mix_alt);
-    DataFlash.WriteLong(log_gps_alt);
-    DataFlash.WriteLong(log_Ground_Speed);
-    DataFlash.WriteLong(log_Ground_Course);
-    DataFlash.WriteByte(END_BYTE);
+    struct log_GPS pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_GPS_MSG),
+        log_Time,
+        log_Fix,
+        log_NumSats,
+        log_Lattitude,
+        log_Longitude,
+        0,
+        log_mix_alt,
+        log_gps_alt,
+        log_Ground_Speed,
+        log_Ground_Course,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
 // Write an raw accel/gyro data packet. Total length : 28 bytes
@@ -352,184 +877,427 @@ static void Log_Write_Raw()
     Vector3f accel = ins.get_accel();
     gyro *= t7;                                                                 // Scale up for storage as long integers
     accel *= t7;
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_RAW_MSG);
-
-    DataFlash.WriteLong((long)gyro.x);
-    DataFlash.WriteLong((long)gyro.y);
-    DataFlash.WriteLong((long)gyro.z);
-    DataFlash.WriteLong((long)accel.x);
-    DataFlash.WriteLong((long)accel.y);
-    DataFlash.WriteLong((long)accel.z);
 
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Raw pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_RAW_MSG),
+        (int32_t)gyro.x,
+        (int32_t)gyro.y,
+        (int32_t)gyro.z,
+        (int32_t)accel.x,
+        (int32_t)accel.y,
+        (int32_t)accel.z,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
 static void Log_Write_Current()
 {
-    DataFlash.WriteByte(HEAD_BYTE1);
-    DataFlash.WriteByte(HEAD_BYTE2);
-    DataFlash.WriteByte(LOG_CURRENT_MSG);
-    DataFlash.WriteInt(g.channel_throttle.control_in);
-    DataFlash.WriteInt((int)(battery_voltage1       * 100.0));
-    DataFlash.WriteInt((int)(current_amps1          * 100.0));
-    DataFlash.WriteInt((int)current_total1);
-    DataFlash.WriteByte(END_BYTE);
+    struct log_Current pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_CURRENT_MSG),
+        (int16_t)g.channel_throttle.control_in,
+        (int16_t)(battery_voltage1       * 100.0),
+        (int16_t)(current_amps1          * 100.0),
+        (int16_t)current_total1,
+        END_BYTE
+    };
+    Log_Write_Record(&pkt, sizeof(pkt));
 }
 
-// Read a Current packet
-static void Log_Read_Current()
+static int32_t vscl_log_last[VSCL_LOG_FIELDS];
+static int32_t vscl_log_state_last[VSCL_LOG_STATE_FIELDS];
+static uint8_t vscl_log_seq;
+static uint8_t vscl_log_since_key = VSCL_LOG_KEY_INTERVAL;
+
+// fill in the change in each value, returning false if one won't fit
+static bool vscl_log_deltas(const int32_t *v, const int32_t *last, int8_t *delta, uint8_t n)
 {
-    cliSerial->printf_P(PSTR("CURR: %d, %4.4f, %4.4f, %d\n"),
-                    (int)DataFlash.ReadInt(),
-                    ((float)DataFlash.ReadInt() / 100.f),
-                    ((float)DataFlash.ReadInt() / 100.f),
-                    (int)DataFlash.ReadInt());
+    bool fits = true;
+    for (uint8_t i=0; i<n; i++) {
+        int32_t d = v[i] - last[i];
+        if (d < -128 || d > 127) {
+            fits = false;
+        }
+        delta[i] = d;
+    }
+    return fits;
 }
 
-// Read an control tuning packet
-static void Log_Read_Control_Tuning()
+// Write a VSCL experiment sample, as key or delta records
+static void Log_Write_Vscl()
 {
-    float logvar;
+    int32_t v[VSCL_LOG_FIELDS] = {
+        VSCL_PHI,
+        VSCL_SPD,
+        VSCL_ALT,
+        (int16_t)nav_roll_cd,
+        (int16_t)nav_pitch_cd,
+        altitude_error_cm,
+        (int16_t)airspeed_error_cm,
+        energy_error,
+        g.channel_roll.servo_out,
+        g.channel_pitch.servo_out,
+        g.channel_throttle.servo_out,
+        g.channel_rudder.servo_out
+    };
+    int32_t state[VSCL_LOG_STATE_FIELDS] = {
+        (int16_t)ahrs.roll_sensor,
+        (int16_t)ahrs.pitch_sensor,
+        (int16_t)airspeed.get_airspeed_cm(),
+        current_loc.alt
+    };
+    struct log_Vscl_Delta delta;
+    struct log_Vscl_State_Delta state_delta;
+    bool key = vscl_log_since_key >= VSCL_LOG_KEY_INTERVAL;
+    if (!vscl_log_deltas(v, vscl_log_last, delta.delta, VSCL_LOG_FIELDS)) {
+        key = true;
+    }
+    if (!vscl_log_deltas(state, vscl_log_state_last, state_delta.delta, VSCL_LOG_STATE_FIELDS)) {
+        key = true;
+    }
+    vscl_log_seq++;
+
+    bool written;
+    if (key) {
+        struct log_Vscl_Key pkt = {
+            LOG_PACKET_HEADER_INIT(LOG_VSCL_KEY_MSG),
+            (uint32_t)millis(),
+            vscl_log_seq,
+            (int16_t)v[0],
+            (int16_t)v[1],
+            (int16_t)v[2],
+            (int16_t)v[3],
+            (int16_t)v[4],
+            v[5],
+            (int16_t)v[6],
+            v[7],
+            (int16_t)v[8],
+            (int16_t)v[9],
+            (int16_t)v[10],
+            (int16_t)v[11],
+            END_BYTE
+        };
+        struct log_Vscl_State_Key state_pkt = {
+            LOG_PACKET_HEADER_INIT(LOG_VSCL_STATE_KEY_MSG),
+            vscl_log_seq,
+            (int16_t)state[0],
+            (int16_t)state[1],
+            (int16_t)state[2],
+            state[3],
+            END_BYTE
+        };
+        written = Log_Write_Record(&pkt, sizeof(pkt));
+        written = Log_Write_Record(&state_pkt, sizeof(state_pkt)) && written;
+    } else {
+        delta.head1 = HEAD_BYTE1;
+        delta.head2 = HEAD_BYTE2;
+        delta.msgid = LOG_VSCL_DELTA_MSG;
+        delta.seq = vscl_log_seq;
+        delta.end = END_BYTE;
+        state_delta.head1 = HEAD_BYTE1;
+        state_delta.head2 = HEAD_BYTE2;
+        state_delta.msgid = LOG_VSCL_STATE_DELTA_MSG;
+        state_delta.seq = vscl_log_seq;
+        state_delta.end = END_BYTE;
+        written = Log_Write_Record(&delta, sizeof(delta));
+        written = Log_Write_Record(&state_delta, sizeof(state_delta)) && written;
+    }
 
-    cliSerial->printf_P(PSTR("CTUN:"));
-    for (int16_t y = 1; y < 10; y++) {
-        logvar = DataFlash.ReadInt();
-        if(y < 8) logvar        = logvar/100.f;
-        if(y == 9) logvar       = logvar/10000.f;
-        cliSerial->print(logvar);
-        print_comma();
+    if (!written) {
+        // the next sample can't be a delta from one that was lost
+        vscl_log_since_key = VSCL_LOG_KEY_INTERVAL;
+        return;
     }
-    cliSerial->println();
+    memcpy(vscl_log_last, v, sizeof(v));
+    memcpy(vscl_log_state_last, state, sizeof(state));
+    vscl_log_since_key = key ? 1 : vscl_log_since_key + 1;
 }
 
-// Read a nav tuning packet
-static void Log_Read_Nav_Tuning()
+/*
+ *  replay records, see replay.ino. Each tick's records are counted so
+ *  that the tick record can say which came before the tick started
+ */
+static uint8_t log_replay_count;    // written since the last tick record
+static uint8_t log_replay_pre;      // written before this tick started
+static uint8_t log_replay_dropped;  // lost since the last tick record
+static uint16_t log_replay_seq;     // tick records made, written or not
+static int16_t log_replay_rc[8];    // the last RC inputs written
+
+static void Log_Write_Replay(const void *pkt, uint8_t size)
 {
-    int16_t d[7];
-    for (int8_t i=0; i<7; i++) {
-        d[i] = DataFlash.ReadInt();
+    if (Log_Write_Record(pkt, size)) {
+        if (log_replay_count < 0xFF) {
+            log_replay_count++;
+        }
+    } else if (log_replay_dropped < 0xFF) {
+        log_replay_dropped++;
     }
-    cliSerial->printf_P(PSTR("NTUN: %4.4f, %d, %4.4f, %4.4f, %4.4f, %4.4f, %4.4f,\n"),              // \n
-                    d[0]/100.0,
-                    (int)d[1],
-                    ((uint16_t)d[2])/100.0,
-                    ((uint16_t)d[3])/100.0,
-                    d[4]/100.0,
-                    d[5]/100.0,
-                    d[5]/1000.0);
 }
 
-// Read a performance packet
-static void Log_Read_Performance()
+static void Log_Replay_Tick_Start(void)
 {
-    int32_t pm_time;
-    int16_t logvar;
+    log_replay_pre = log_replay_count;
+}
 
-    cliSerial->printf_P(PSTR("PM:"));
-    pm_time = DataFlash.ReadLong();
-    cliSerial->print(pm_time);
-    print_comma();
-    for (int16_t y = 1; y <= 12; y++) {
-        if(y < 3 || y > 7) {
-            logvar = DataFlash.ReadInt();
-        }else{
-            logvar = DataFlash.ReadByte();
-        }
-        cliSerial->print(logvar);
-        print_comma();
+// Write the tick record, at the end of the tick. If it is lost the
+// sequence number skips, so the replay can tell. Total length : 44 bytes
+static void Log_Write_Replay_Tick(uint32_t sched_ran)
+{
+    Vector3f gyro = ins.get_gyro();
+    Vector3f accel = ins.get_accel();
+    struct log_Replay_Tick pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_REPLAY_TICK_MSG),
+        fast_loopTimer_ms,
+        fast_loopTimer_us,
+        sched_ran,
+        log_replay_pre,
+        gyro.x, gyro.y, gyro.z,
+        accel.x, accel.y, accel.z,
+        log_replay_seq++,
+        log_replay_dropped,
+        END_BYTE
+    };
+    if (Log_Write_Record(&pkt, sizeof(pkt))) {
+        log_replay_dropped = 0;
     }
-    cliSerial->println();
+    log_replay_count = 0;
+    log_replay_pre = 0;
 }
 
-// Read a command processing packet
-static void Log_Read_Cmd()
+// Write the RC inputs, if they have changed. Total length : 20 bytes
+static void Log_Write_Replay_RC(const int16_t pwm[8])
 {
-    byte logvarb;
-    int32_t logvarl;
-
-    cliSerial->printf_P(PSTR("CMD:"));
-    for(int16_t i = 1; i < 4; i++) {
-        logvarb = DataFlash.ReadByte();
-        cliSerial->print(logvarb, DEC);
-        print_comma();
+    if (memcmp(pwm, log_replay_rc, sizeof(log_replay_rc)) == 0) {
+        return;
     }
-    for(int16_t i = 1; i < 4; i++) {
-        logvarl = DataFlash.ReadLong();
-        cliSerial->print(logvarl, DEC);
-        print_comma();
+    struct log_Replay_RC pkt;
+    pkt.head1 = HEAD_BYTE1;
+    pkt.head2 = HEAD_BYTE2;
+    pkt.msgid = LOG_REPLAY_RC_MSG;
+    memcpy(pkt.pwm, pwm, sizeof(pkt.pwm));
+    pkt.end = END_BYTE;
+    uint8_t count = log_replay_count;
+    Log_Write_Replay(&pkt, sizeof(pkt));
+    if (log_replay_count != count) {
+        memcpy(log_replay_rc, pwm, sizeof(log_replay_rc));
     }
-    cliSerial->println();
 }
 
-static void Log_Read_Startup()
+// Write a new GPS fix exactly as the driver gave it. Total length : 30 bytes
+static void Log_Write_Replay_GPS()
 {
-    byte logbyte = DataFlash.ReadByte();
+    struct log_Replay_GPS pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_REPLAY_GPS_MSG),
+        g_gps->time,
+        g_gps->latitude,
+        g_gps->longitude,
+        g_gps->altitude,
+        (int32_t)g_gps->ground_speed,
+        g_gps->ground_course,
+        g_gps->num_sats,
+        g_gps->fix,
+        END_BYTE
+    };
+    Log_Write_Replay(&pkt, sizeof(pkt));
+}
 
-    if (logbyte == TYPE_AIRSTART_MSG)
-        cliSerial->printf_P(PSTR("AIR START - "));
-    else if (logbyte == TYPE_GROUNDSTART_MSG)
-        cliSerial->printf_P(PSTR("GROUND START - "));
-    else
-        cliSerial->printf_P(PSTR("UNKNOWN STARTUP - "));
+// Write a barometer reading. Total length : 10 bytes
+static void Log_Write_Replay_Baro()
+{
+    struct log_Replay_Baro pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_REPLAY_BARO_MSG),
+        barometer.get_pressure(),
+        barometer.get_temperature(),
+        END_BYTE
+    };
+    Log_Write_Replay(&pkt, sizeof(pkt));
+}
 
-    cliSerial->printf_P(PSTR(" %d commands in memory\n"),(int)DataFlash.ReadByte());
+// Write an airspeed reading. Total length : 8 bytes
+static void Log_Write_Replay_Airspeed()
+{
+    struct log_Replay_Airspeed pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_REPLAY_ASPD_MSG),
+        airspeed.get_airspeed(),
+        END_BYTE
+    };
+    Log_Write_Replay(&pkt, sizeof(pkt));
 }
 
-// Read an attitude packet
-static void Log_Read_Attitude()
+// Write a compass reading. Total length : 10 bytes
+static void Log_Write_Replay_Mag()
 {
-    int16_t d[3];
-    d[0] = DataFlash.ReadInt();
-    d[1] = DataFlash.ReadInt();
-    d[2] = DataFlash.ReadInt();
-    cliSerial->printf_P(PSTR("ATT: %d, %d, %u\n"),
-                    (int)d[0], (int)d[1],
-                    (unsigned)d[2]);
+    struct log_Replay_Mag pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_REPLAY_MAG_MSG),
+        compass.mag_x,
+        compass.mag_y,
+        compass.mag_z,
+        END_BYTE
+    };
+    Log_Write_Replay(&pkt, sizeof(pkt));
 }
 
-// Read a mode packet
-static void Log_Read_Mode()
+// Write a received MAVLink message. Total length : 46 bytes a chunk
+static void Log_Write_Replay_Mavlink(uint8_t chan, const mavlink_message_t *msg)
 {
-    cliSerial->printf_P(PSTR("MOD:"));
-    print_flight_mode(DataFlash.ReadByte());
+    const uint8_t *payload = (const uint8_t *)_MAV_PAYLOAD(msg);
+    uint16_t ofs = 0;
+    do {
+        struct log_Replay_Mavlink pkt;
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.head1 = HEAD_BYTE1;
+        pkt.head2 = HEAD_BYTE2;
+        pkt.msgid = LOG_REPLAY_MAV_MSG;
+        pkt.time_ms = millis();
+        pkt.chan = chan;
+        pkt.mav_msgid = msg->msgid;
+        pkt.sysid = msg->sysid;
+        pkt.compid = msg->compid;
+        pkt.len = msg->len;
+        pkt.ofs = ofs;
+        memcpy(pkt.data, &payload[ofs], min(msg->len - ofs, LOG_REPLAY_MAV_CHUNK));
+        pkt.end = END_BYTE;
+        if (LOG_RING_SIZE - log_ring_used < sizeof(pkt)) {
+            // long messages don't fit in the ring in one go, and a
+            // replay can't do without any part of them
+            Log_Flush();
+        }
+        Log_Write_Replay(&pkt, sizeof(pkt));
+        ofs += LOG_REPLAY_MAV_CHUNK;
+    } while (ofs < msg->len);
 }
 
-// Read a GPS packet
-static void Log_Read_GPS()
+// Write the barometer ground calibration, after startup. Total length : 12 bytes
+static void Log_Write_Replay_Ground()
 {
-    int32_t l[7];
-    byte b[2];
-    int16_t i;
-    l[0] = DataFlash.ReadLong();
-    b[0] = DataFlash.ReadByte();
-    b[1] = DataFlash.ReadByte();
-    l[1] = DataFlash.ReadLong();
-    l[2] = DataFlash.ReadLong();
-    i = DataFlash.ReadInt();
-    l[3] = DataFlash.ReadLong();
-    l[4] = DataFlash.ReadLong();
-    l[5] = DataFlash.ReadLong();
-    l[6] = DataFlash.ReadLong();
-    cliSerial->printf_P(PSTR("GPS: %ld, %d, %d, %4.7f, %4.7f, %d, %4.4f, %4.4f, %4.4f, %4.4f\n"),
-                    (long)l[0], (int)b[0], (int)b[1],
-                    l[1]/t7, l[2]/t7,
-                    (int)i,
-                    l[3]/100.0, l[4]/100.0, l[5]/100.0, l[6]/100.0);
+    struct log_Replay_Ground pkt = {
+        LOG_PACKET_HEADER_INIT(LOG_REPLAY_GND_MSG),
+        barometer.get_ground_pressure(),
+        barometer.get_ground_temperature(),
+        END_BYTE
+    };
+    Log_Write_Replay(&pkt, sizeof(pkt));
 }
 
-// Read a raw accel/gyro packet
-static void Log_Read_Raw()
+/*
+ *  read the body of a record into its structure. The header has
+ *  already been read by Log_Read_Process(), and the end byte is left
+ *  for it to check
+ */
+static void Log_Read_Record(void *pkt, uint8_t size)
 {
-    float logvar;
-    cliSerial->printf_P(PSTR("RAW:"));
-    for (int16_t y = 0; y < 6; y++) {
-        logvar = (float)DataFlash.ReadLong() / t7;
-        cliSerial->print(logvar);
-        print_comma();
+    uint8_t *b = (uint8_t *)pkt;
+    for (uint8_t i=3; i<size-1; i++) {
+        b[i] = DataFlash.ReadByte();
+    }
+}
+
+/*
+ *  print a record using its entry in log_structure[]. Returns false if
+ *  the type is unknown
+ */
+static bool Log_Read_Generic(uint8_t msg_type)
+{
+    uint8_t i;
+    for (i=0; i<LOG_NUM_STRUCTURES; i++) {
+        if (pgm_read_byte(&log_structure[i].msg_type) == msg_type) {
+            break;
+        }
+    }
+    if (i == LOG_NUM_STRUCTURES) {
+        return false;
+    }
+
+    uint8_t pkt[LOG_MAX_RECORD];
+    uint8_t len = pgm_read_byte(&log_structure[i].msg_len);
+    Log_Read_Record(pkt, len);
+
+    cliSerial->printf_P(PSTR("%S"), log_structure[i].name);
+    const prog_char_t *fmt = log_structure[i].format;
+    uint8_t ofs = 3;
+    char c;
+    while ((c = pgm_read_byte(fmt++)) != 0) {
+        const uint8_t *p = &pkt[ofs];
+        int16_t i16;
+        int32_t i32;
+        char str[65];
+        cliSerial->printf_P(PSTR(", "));
+        switch (c) {
+        case 'b':
+            cliSerial->printf_P(PSTR("%d"), (int)(int8_t)p[0]);
+            ofs += 1;
+            break;
+        case 'B':
+            cliSerial->printf_P(PSTR("%u"), (unsigned)p[0]);
+            ofs += 1;
+            break;
+        case 'h':
+            memcpy(&i16, p, 2);
+            cliSerial->printf_P(PSTR("%d"), (int)i16);
+            ofs += 2;
+            break;
+        case 'H':
+            memcpy(&i16, p, 2);
+            cliSerial->printf_P(PSTR("%u"), (unsigned)(uint16_t)i16);
+            ofs += 2;
+            break;
+        case 'c':
+            memcpy(&i16, p, 2);
+            cliSerial->printf_P(PSTR("%.2f"), i16 * 0.01);
+            ofs += 2;
+            break;
+        case 'C':
+            memcpy(&i16, p, 2);
+            cliSerial->printf_P(PSTR("%.2f"), (uint16_t)i16 * 0.01);
+            ofs += 2;
+            break;
+        case 'i':
+            memcpy(&i32, p, 4);
+            cliSerial->printf_P(PSTR("%ld"), (long)i32);
+            ofs += 4;
+            break;
+        case 'I':
+            memcpy(&i32, p, 4);
+            cliSerial->printf_P(PSTR("%lu"), (unsigned long)(uint32_t)i32);
+            ofs += 4;
+            break;
+        case 'e':
+            memcpy(&i32, p, 4);
+            cliSerial->printf_P(PSTR("%.2f"), i32 * 0.01);
+            ofs += 4;
+            break;
+        case 'L':
+            memcpy(&i32, p, 4);
+            cliSerial->printf_P(PSTR("%.7f"), i32 / t7);
+            ofs += 4;
+            break;
+        case 'n':
+        case 'N':
+        case 'Z': {
+            uint8_t n = (c == 'n' ? 4 : c == 'N' ? 16 : 64);
+            memcpy(str, p, n);
+            str[n] = 0;
+            cliSerial->print(str);
+            ofs += n;
+            break;
+        }
+        case 'f': {
+            float f;
+            memcpy(&f, p, 4);
+            cliSerial->printf_P(PSTR("%.4f"), f);
+            ofs += 4;
+            break;
+        }
+        case 'a':
+            for (uint8_t n=0; n<32; n++) {
+                cliSerial->printf_P(PSTR("%02x"), (unsigned)p[n]);
+            }
+            ofs += 32;
+            break;
+        }
     }
     cliSerial->println();
+    return true;
 }
 
 // Read the DataFlash log memory : Packet Parser
@@ -537,6 +1305,9 @@ static void Log_Read(int16_t start_page, int16_t end_page)
 {
     int16_t packet_count = 0;
 
+    // make sure the log is complete
+    Log_Flush();
+
  #ifdef AIRFRAME_NAME
     cliSerial->printf_P(PSTR((AIRFRAME_NAME)
  #endif
@@ -555,6 +1326,194 @@ static void Log_Read(int16_t start_page, int16_t end_page)
     cliSerial->printf_P(PSTR("Number of packets read: %d\n"), (int) packet_count);
 }
 
+/*
+ *  send a log to the console exactly as it is stored, for decoding on
+ *  a PC with Tools/LogParser, which is much faster than printing it
+ */
+static void Log_Dump_Binary(int16_t start_page, int16_t end_page)
+{
+    Log_Flush();
+    cliSerial->printf_P(PSTR("BINARY LOG START\n"));
+    if (start_page > end_page) {
+        Log_Dump_Pages(start_page, DataFlash.df_NumPages);
+        Log_Dump_Pages(1, end_page);
+    } else {
+        Log_Dump_Pages(start_page, end_page);
+    }
+    cliSerial->printf_P(PSTR("\nBINARY LOG END\n"));
+}
+
+static void Log_Dump_Pages(int16_t start_page, int16_t end_page)
+{
+    int16_t page = start_page;
+
+    DataFlash.StartRead(start_page);
+    while (page < end_page && page != -1) {
+        cliSerial->write(DataFlash.ReadByte());
+        page = DataFlash.GetPage();
+    }
+}
+
+#if LOG_DOWNLOAD == ENABLED
+/*
+ *  log download over MAVLink. Logs are numbered from 1 for the oldest,
+ *  and addressed by byte offset. Reading the DataFlash disturbs the
+ *  page buffers used for writing, so logging is paused while a
+ *  download is in progress, and a new log is started when it is done.
+ */
+
+// each page starts with its log file number and page in the log
+#define LOG_PAGE_DATA ((uint16_t)(DataFlash.df_PageSize - 4))
+
+// stop a download the GCS has given up on after this long
+#define LOG_DOWNLOAD_TIMEOUT_MS 10000
+
+static uint16_t log_read_id;            // log being read, 0 for none
+static uint32_t log_read_ofs;           // next byte that ReadByte() returns
+static uint32_t log_download_ms;        // last activity
+
+// find the pages of a log, returning false if there is no such log
+static bool Log_Find(uint16_t id, int16_t &start_page, int16_t &end_page)
+{
+    uint16_t num_logs = DataFlash.get_num_logs();
+    if (id == 0 || id > num_logs) {
+        return false;
+    }
+    DataFlash.get_log_boundaries(DataFlash.find_last_log() - num_logs + id, start_page, end_page);
+    return true;
+}
+
+// number of pages in a log, read in the same way as Log_Read()
+static uint16_t Log_Num_Pages(int16_t start_page, int16_t end_page)
+{
+    if (start_page > end_page) {
+        return (DataFlash.df_NumPages - start_page) + (end_page - 1);
+    }
+    return end_page - start_page;
+}
+
+// size of a log in bytes, or 0 if there is no such log
+static uint32_t Log_Size(uint16_t id)
+{
+    int16_t start_page, end_page;
+    if (!Log_Find(id, start_page, end_page)) {
+        return 0;
+    }
+    return (uint32_t)Log_Num_Pages(start_page, end_page) * LOG_PAGE_DATA;
+}
+
+// position the DataFlash to read from an offset in a log
+static void Log_Seek(int16_t start_page, int16_t end_page, uint32_t ofs)
+{
+    uint16_t page = ofs / LOG_PAGE_DATA;
+    if (start_page > end_page && page >= DataFlash.df_NumPages - start_page) {
+        // wrapped around the end of the DataFlash
+        DataFlash.StartRead(1 + page - (DataFlash.df_NumPages - start_page));
+    } else {
+        DataFlash.StartRead(start_page + page);
+    }
+    for (uint16_t i = ofs % LOG_PAGE_DATA; i > 0; i--) {
+        DataFlash.ReadByte();
+    }
+}
+
+/*
+ *  read up to len bytes from an offset in a log, returning the number
+ *  read. Reads that follow on from the last one carry on from where
+ *  the DataFlash is, so a download in order doesn't need to seek
+ */
+static uint8_t Log_Read_Block(uint16_t id, uint32_t ofs, uint8_t *buf, uint8_t len)
+{
+    int16_t start_page, end_page;
+    if (!Log_Find(id, start_page, end_page)) {
+        return 0;
+    }
+    uint32_t size = (uint32_t)Log_Num_Pages(start_page, end_page) * LOG_PAGE_DATA;
+    if (ofs >= size) {
+        return 0;
+    }
+    if (len > size - ofs) {
+        len = size - ofs;
+    }
+
+    uint32_t wrap_ofs = 0xFFFFFFFF;
+    if (start_page > end_page) {
+        wrap_ofs = (uint32_t)(DataFlash.df_NumPages - start_page) * LOG_PAGE_DATA;
+    }
+    if (id != log_read_id || ofs != log_read_ofs) {
+        Log_Seek(start_page, end_page, ofs);
+    }
+    for (uint8_t i=0; i<len; i++, ofs++) {
+        if (ofs == wrap_ofs) {
+            Log_Seek(start_page, end_page, ofs);
+        }
+        buf[i] = DataFlash.ReadByte();
+    }
+    log_read_id = id;
+    log_read_ofs = ofs;
+    log_download_ms = millis();
+    return len;
+}
+
+/*
+ *  true if it is safe to pause logging or block on the DataFlash for
+ *  a GCS log request: still initialising, or in manual with the
+ *  throttle closed and not moving
+ */
+static bool Log_Download_Allowed(void)
+{
+    if (control_mode == INITIALISING) {
+        return true;
+    }
+    if (control_mode != MANUAL || g.channel_throttle.control_in > 0) {
+        return false;
+    }
+    if (airspeed.enabled() && airspeed.get_airspeed() > 3) {
+        return false;
+    }
+    if (g_gps != NULL && g_gps->status() == GPS::GPS_OK && g_gps->ground_speed > 300) {
+        return false;
+    }
+    return true;
+}
+
+// pause logging for a download
+static void Log_Download_Start(void)
+{
+    if (!log_download_active) {
+        Log_Flush();
+        log_download_active = true;
+        log_read_id = 0;
+    }
+    log_download_ms = millis();
+}
+
+// finish a download, and carry on logging in a new log
+static void Log_Download_End(void)
+{
+    if (!log_download_active) {
+        return;
+    }
+    log_download_active = false;
+    log_read_id = 0;
+    log_ring_used = 0;
+    if (g.log_bitmask != 0) {
+        DataFlash.start_new_log();
+        Log_Write_Formats();
+    }
+}
+
+// called once a second, in case the GCS has gone away mid download
+// or the aircraft has started to move
+static void Log_Download_Check(void)
+{
+    if (log_download_active &&
+        (millis() - log_download_ms > LOG_DOWNLOAD_TIMEOUT_MS || !Log_Download_Allowed())) {
+        Log_Download_End();
+    }
+}
+#endif // LOG_DOWNLOAD
+
 // Read the DataFlash log memory : Packet Parser
 static int16_t Log_Read_Process(int16_t start_page, int16_t end_page)
 {
@@ -580,49 +1539,11 @@ static int16_t Log_Read_Process(int16_t start_page, int16_t end_page)
                                     log_step = 0;
                                 break;
                             case 2:
-                                if(data == LOG_ATTITUDE_MSG) {
-                                    Log_Read_Attitude();
-                                    log_step++;
-
-                                }else if(data == LOG_MODE_MSG) {
-                                    Log_Read_Mode();
+                                if (Log_Read_Generic(data)) {
                                     log_step++;
-
-                                }else if(data == LOG_CONTROL_TUNING_MSG) {
-                                    Log_Read_Control_Tuning();
-                                    log_step++;
-
-                                }else if(data == LOG_NAV_TUNING_MSG) {
-                                    Log_Read_Nav_Tuning();
-                                    log_step++;
-
-                                }else if(data == LOG_PERFORMANCE_MSG) {
-                                    Log_Read_Performance();
-                                    log_step++;
-
-                                }else if(data == LOG_RAW_MSG) {
-                                    Log_Read_Raw();
-                                    log_step++;
-
-                                }else if(data == LOG_CMD_MSG) {
-                                    Log_Read_Cmd();
-                                    log_step++;
-
-                                }else if(data == LOG_CURRENT_MSG) {
-                                    Log_Read_Current();
-                                    log_step++;
-
-                                }else if(data == LOG_STARTUP_MSG) {
-                                    Log_Read_Startup();
-                                    log_step++;
-                                }else {
-                                    if(data == LOG_GPS_MSG) {
-                                        Log_Read_GPS();
-                                        log_step++;
-                                    }else{
-                                        cliSerial->printf_P(PSTR("Error Reading Packet: %d\n"),packet_count);
-                                        log_step = 0;            // Restart, we have a problem...
-                                    }
+                                } else {
+                                    cliSerial->printf_P(PSTR("Error Reading Packet: %d\n"),packet_count);
+                                    log_step = 0;            // Restart, we have a problem...
                                 }
                                 break;
                             case 3:
@@ -650,6 +1571,12 @@ static void Log_Write_Cmd(byte num, struct Location *wp) {
 }
 static void Log_Write_Current() {
 }
+static void Log_Write_Vscl() {
+}
+static void Log_Write_Isr() {
+}
+static void Log_Write_Stall() {
+}
 static void Log_Write_Nav_Tuning() {
 }
 static void Log_Write_GPS(      int32_t log_Time, int32_t log_Lattitude, int32_t log_Longitude, int32_t log_gps_alt, int32_t log_mix_alt,
@@ -657,6 +1584,8 @@ static void Log_Write_GPS(      int32_t log_Time, int32_t log_Lattitude, int32_t
 }
 static void Log_Write_Performance() {
 }
+static void Log_Write_Perf_Tasks() {
+}
 static int8_t process_logs(uint8_t argc, const Menu::arg *argv) {
     return 0;
 }
@@ -666,6 +1595,29 @@ static void Log_Write_Control_Tuning() {
 }
 static void Log_Write_Raw() {
 }
+static void Log_Replay_Tick_Start(void) {
+}
+static void Log_Write_Replay_Tick(uint32_t sched_ran) {
+}
+static void Log_Write_Replay_RC(const int16_t pwm[8]) {
+}
+static void Log_Write_Replay_GPS() {
+}
+static void Log_Write_Replay_Baro() {
+}
+static void Log_Write_Replay_Airspeed() {
+}
+static void Log_Write_Replay_Mag() {
+}
+static void Log_Write_Replay_Mavlink(uint8_t chan, const mavlink_message_t *msg) {
+}
+static void Log_Write_Replay_Ground() {
+}
+static bool Log_Flush_Step(void) {
+    return false;
+}
+static void Log_Write_Formats(void) {
+}
 
 
 #endif // LOGGING_ENABLED
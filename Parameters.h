@@ -213,6 +213,11 @@ public:
         k_param_pitchController,
         k_param_yawController,
 
+        //
+        // 235: more fence settings, the waypoint block above is full
+        //
+        k_param_fence_margin = 235,
+
         //
         // 240: PID Controllers
         k_param_pidNavRoll = 240,
@@ -273,6 +278,7 @@ public:
     AP_Int8 fence_channel;
     AP_Int16 fence_minalt;    // meters
     AP_Int16 fence_maxalt;    // meters
+    AP_Int16 fence_margin;    // meters
 #endif
 
     // Fly-by-wire
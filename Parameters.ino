@@ -227,6 +227,15 @@ const AP_Param::Info var_info[] PROGMEM = {
     // @Increment: 1
     // @User: Standard
     GSCALAR(fence_maxalt,           "FENCE_MAXALT",   0),
+
+    // @Param: FENCE_MARGIN
+    // @DisplayName: Fence Margin
+    // @Description: Distance inside the fence boundary at which the geofence triggers, so the plane turns back before it crosses the boundary. 0 triggers at the boundary
+    // @Units: meters
+    // @Range: 0 32767
+    // @Increment: 1
+    // @User: Standard
+    GSCALAR(fence_margin,           "FENCE_MARGIN",   0),
 #endif
 
     // @Param: ARSPD_FBW_MIN
@@ -718,3 +727,399 @@ static void load_parameters(void)
         cliSerial->printf_P(PSTR("load_all took %luus\n"), micros() - before);
     }
 }
+
+#if PARAM_INDEX == ENABLED
+/*
+ *  parameter index
+ *
+ *  AP_Param::find() and find_by_index() walk the whole var_info tree,
+ *  building and comparing the name of every parameter on the way,
+ *  which stalls the main loop for each PARAM_SET or PARAM_REQUEST_READ
+ *  from the GCS. The names are made up at run time from the group
+ *  prefixes, so the index is built once at startup instead. It holds
+ *  a 16 bit hash of each name, sorted, with the parameter's position
+ *  in the list, and the AP_Param token of every PARAM_INDEX_STRIDE'th
+ *  parameter. A lookup by name is a binary search and a name check.
+ *  A lookup by index starts from the nearest token and steps forward
+ *  at most PARAM_INDEX_STRIDE-1 parameters.
+ *
+ *  The tables are allocated for the real number of parameters, 4 bytes
+ *  each plus 7 bytes for every 8, about 1.3KB for the 270 or so of an
+ *  APM2 build with both mounts and the camera. It is built after the
+ *  mission cache is loaded, and leaves room for the largest geofence,
+ *  so it never takes memory those need. If there isn't the memory the
+ *  index is left out, and the lookups go to AP_Param as before.
+ */
+
+#define PARAM_INDEX_STRIDE 8
+
+static struct param_index_entry {
+    uint16_t hash;
+    uint16_t index;
+} *param_index_hash;
+
+static struct param_index_mark {
+    AP_Param::ParamToken token;
+    AP_Param *vp;
+    uint8_t type;       // an enum ap_var_type
+} *param_index_mark;
+
+// number of parameters indexed, zero if the index couldn't be built
+static uint16_t param_index_count;
+
+static uint16_t param_name_hash(const char *name)
+{
+    // FNV-1a, folded to 16 bits
+    uint32_t h = 2166136261UL;
+    for (uint8_t i=0; i<AP_MAX_NAME_SIZE && name[i] != 0; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619UL;
+    }
+    return (h >> 16) ^ (h & 0xFFFF);
+}
+
+static void param_index_build(void)
+{
+    AP_Param::ParamToken token;
+    enum ap_var_type type;
+    char name[AP_MAX_NAME_SIZE+1];
+    uint16_t n = 0;
+
+    param_index_count = 0;
+    name[AP_MAX_NAME_SIZE] = 0;
+
+    if (param_index_hash == NULL) {
+        uint16_t total = 0;
+        for (AP_Param *vp = AP_Param::first(&token, &type);
+             vp != NULL;
+             vp = AP_Param::next_scalar(&token, &type)) {
+            total++;
+        }
+        uint16_t marks = (total + PARAM_INDEX_STRIDE - 1) / PARAM_INDEX_STRIDE;
+        size_t size = total * sizeof(struct param_index_entry) +
+                      marks * sizeof(struct param_index_mark);
+        if (total == 0 ||
+            memcheck_available_memory() < 512 + size + geofence_memory_needed()) {
+            // too risky to enable as we could run out of stack, and the
+            // geofence matters more
+            return;
+        }
+        param_index_hash = (struct param_index_entry *)calloc(total, sizeof(struct param_index_entry));
+        param_index_mark = (struct param_index_mark *)calloc(marks, sizeof(struct param_index_mark));
+        if (param_index_hash == NULL || param_index_mark == NULL) {
+            free(param_index_hash);
+            free(param_index_mark);
+            param_index_hash = NULL;
+            param_index_mark = NULL;
+            return;
+        }
+    }
+
+    for (AP_Param *vp = AP_Param::first(&token, &type);
+         vp != NULL;
+         vp = AP_Param::next_scalar(&token, &type)) {
+        if (n % PARAM_INDEX_STRIDE == 0) {
+            param_index_mark[n / PARAM_INDEX_STRIDE].token = token;
+            param_index_mark[n / PARAM_INDEX_STRIDE].vp = vp;
+            param_index_mark[n / PARAM_INDEX_STRIDE].type = type;
+        }
+        vp->copy_name(name, AP_MAX_NAME_SIZE, true);
+
+        // insertion sort by hash. This is only done once
+        uint16_t hash = param_name_hash(name);
+        uint16_t i = n;
+        while (i > 0 && param_index_hash[i-1].hash > hash) {
+            param_index_hash[i] = param_index_hash[i-1];
+            i--;
+        }
+        param_index_hash[i].hash = hash;
+        param_index_hash[i].index = n;
+        n++;
+    }
+    param_index_count = n;
+}
+
+/*
+ *  the parameter at position index in the list sent to the GCS, or NULL
+ */
+static AP_Param *param_find_by_index(uint16_t index, enum ap_var_type *ptype)
+{
+    if (param_index_count == 0) {
+        return AP_Param::find_by_index(index, ptype);
+    }
+    if (index >= param_index_count) {
+        return NULL;
+    }
+    AP_Param::ParamToken token = param_index_mark[index / PARAM_INDEX_STRIDE].token;
+    AP_Param *vp = param_index_mark[index / PARAM_INDEX_STRIDE].vp;
+    enum ap_var_type type = (enum ap_var_type)param_index_mark[index / PARAM_INDEX_STRIDE].type;
+    for (uint8_t i = index % PARAM_INDEX_STRIDE; i > 0 && vp != NULL; i--) {
+        vp = AP_Param::next_scalar(&token, &type);
+    }
+    if (ptype != NULL) {
+        *ptype = type;
+    }
+    return vp;
+}
+
+/*
+ *  find a parameter by its full name, and its position in the list
+ */
+static AP_Param *param_find(const char *name, enum ap_var_type *ptype, int16_t *pindex)
+{
+    if (param_index_count == 0) {
+        *pindex = -1;
+        return AP_Param::find(name, ptype);
+    }
+
+    uint16_t hash = param_name_hash(name);
+    uint16_t lo = 0, hi = param_index_count;
+    while (lo < hi) {
+        uint16_t mid = (lo + hi) / 2;
+        if (param_index_hash[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // check the name of each parameter with this hash
+    char vname[AP_MAX_NAME_SIZE+1];
+    vname[AP_MAX_NAME_SIZE] = 0;
+    for ( ; lo < param_index_count && param_index_hash[lo].hash == hash; lo++) {
+        AP_Param *vp = param_find_by_index(param_index_hash[lo].index, ptype);
+        if (vp == NULL) {
+            continue;
+        }
+        vp->copy_name(vname, AP_MAX_NAME_SIZE, true);
+        if (strncmp(vname, name, AP_MAX_NAME_SIZE) == 0) {
+            *pindex = param_index_hash[lo].index;
+            return vp;
+        }
+    }
+    return NULL;
+}
+
+#else // PARAM_INDEX
+
+static void param_index_build(void)
+{
+}
+
+static AP_Param *param_find_by_index(uint16_t index, enum ap_var_type *ptype)
+{
+    return AP_Param::find_by_index(index, ptype);
+}
+
+static AP_Param *param_find(const char *name, enum ap_var_type *ptype, int16_t *pindex)
+{
+    *pindex = -1;
+    return AP_Param::find(name, ptype);
+}
+
+#endif // PARAM_INDEX
+
+#if LOG_DOWNLOAD == ENABLED
+/*
+ *  parameter snapshot
+ *
+ *  Sending the parameters one PARAM_VALUE at a time takes many seconds
+ *  over telemetry. A GCS that knows about it can instead download all
+ *  of them as one packed snapshot, through the log download messages
+ *  with the log id PARAM_SNAPSHOT_LOG_ID. The snapshot is a 12 byte
+ *  header, then one entry per parameter in the PARAM_REQUEST_LIST
+ *  order. Everything is little endian.
+ *
+ *    header:  uint16_t magic, 0x5350
+ *             uint16_t number of parameters
+ *             uint32_t length of the snapshot, including the header
+ *             uint32_t CRC-32 of everything after the header
+ *    entry:   uint8_t  ap_var_type
+ *             name, NUL terminated
+ *             value, 1, 2 or 4 bytes for INT8, INT16, INT32 or FLOAT
+ *
+ *  The CRC is worked out when the GCS asks for a window that includes
+ *  the header. A GCS can ask for just the header first, and skip the
+ *  download if the CRC matches what it already has. The entries are
+ *  packed as they are sent, so a parameter changed during the download
+ *  shows up as a CRC mismatch and the GCS should ask again.
+ */
+
+#define PARAM_SNAPSHOT_MAGIC        0x5350
+#define PARAM_SNAPSHOT_HEADER_LEN   12
+#define PARAM_SNAPSHOT_ENTRY_MAX    (1 + AP_MAX_NAME_SIZE + 1 + 4)
+
+// these don't change while we run, the names and types are fixed
+static uint16_t param_snapshot_count;
+static uint32_t param_snapshot_length;
+
+// the entry the next read starts from
+static struct {
+    AP_Param::ParamToken token;
+    AP_Param *vp;
+    enum ap_var_type type;
+    uint32_t ofs;
+} param_snapshot_cursor;
+
+// CRC of the entries, and how far it has got
+static uint32_t param_snapshot_crc;
+static uint32_t param_snapshot_crc_ofs;
+
+/*
+ *  pack one entry into buf, returning its length
+ */
+static uint8_t param_snapshot_entry(AP_Param *vp, enum ap_var_type type, uint8_t *buf)
+{
+    buf[0] = type;
+    vp->copy_name((char *)&buf[1], AP_MAX_NAME_SIZE, true);
+    buf[1 + AP_MAX_NAME_SIZE] = 0;
+    uint8_t len = 1 + strlen((char *)&buf[1]) + 1;
+
+    switch (type) {
+    case AP_PARAM_INT8: {
+        int8_t v = ((AP_Int8 *)vp)->get();
+        memcpy(&buf[len], &v, 1);
+        len += 1;
+        break;
+    }
+    case AP_PARAM_INT16: {
+        int16_t v = ((AP_Int16 *)vp)->get();
+        memcpy(&buf[len], &v, 2);
+        len += 2;
+        break;
+    }
+    case AP_PARAM_INT32: {
+        int32_t v = ((AP_Int32 *)vp)->get();
+        memcpy(&buf[len], &v, 4);
+        len += 4;
+        break;
+    }
+    case AP_PARAM_FLOAT: {
+        float v = ((AP_Float *)vp)->get();
+        memcpy(&buf[len], &v, 4);
+        len += 4;
+        break;
+    }
+    default:
+        break;
+    }
+    return len;
+}
+
+/*
+ *  work out the size of the snapshot, once at startup
+ */
+static void param_snapshot_init(void)
+{
+    AP_Param::ParamToken token;
+    enum ap_var_type type;
+    uint8_t entry[PARAM_SNAPSHOT_ENTRY_MAX];
+
+    param_snapshot_count = 0;
+    param_snapshot_length = PARAM_SNAPSHOT_HEADER_LEN;
+    for (AP_Param *vp = AP_Param::first(&token, &type);
+         vp != NULL;
+         vp = AP_Param::next_scalar(&token, &type)) {
+        param_snapshot_length += param_snapshot_entry(vp, type, entry);
+        param_snapshot_count++;
+    }
+    param_snapshot_crc_ofs = param_snapshot_length;
+    param_snapshot_cursor.vp = NULL;
+}
+
+static uint32_t param_snapshot_size(void)
+{
+    return param_snapshot_length;
+}
+
+/*
+ *  copy up to len bytes of the snapshot from ofs into data, returning
+ *  the number copied. Reading on from where the last read stopped
+ *  is cheap, going backwards starts again from the first parameter
+ */
+static uint16_t param_snapshot_read(uint32_t ofs, uint8_t *data, uint16_t len)
+{
+    if (ofs >= param_snapshot_length) {
+        return 0;
+    }
+    if (len > param_snapshot_length - ofs) {
+        len = param_snapshot_length - ofs;
+    }
+
+    uint16_t n = 0;
+    if (ofs < PARAM_SNAPSHOT_HEADER_LEN) {
+        uint8_t header[PARAM_SNAPSHOT_HEADER_LEN];
+        uint16_t magic = PARAM_SNAPSHOT_MAGIC;
+        memcpy(&header[0], &magic, 2);
+        memcpy(&header[2], &param_snapshot_count, 2);
+        memcpy(&header[4], &param_snapshot_length, 4);
+        memcpy(&header[8], &param_snapshot_crc, 4);
+        n = min(len, PARAM_SNAPSHOT_HEADER_LEN - ofs);
+        memcpy(data, &header[ofs], n);
+        ofs += n;
+    }
+
+    if (param_snapshot_cursor.vp == NULL || param_snapshot_cursor.ofs > ofs) {
+        param_snapshot_cursor.vp = AP_Param::first(&param_snapshot_cursor.token, &param_snapshot_cursor.type);
+        param_snapshot_cursor.ofs = PARAM_SNAPSHOT_HEADER_LEN;
+    }
+
+    uint8_t entry[PARAM_SNAPSHOT_ENTRY_MAX];
+    while (n < len && param_snapshot_cursor.vp != NULL) {
+        uint8_t elen = param_snapshot_entry(param_snapshot_cursor.vp, param_snapshot_cursor.type, entry);
+        if (ofs < param_snapshot_cursor.ofs + elen) {
+            uint8_t from = ofs - param_snapshot_cursor.ofs;
+            uint8_t count = min(elen - from, len - n);
+            memcpy(&data[n], &entry[from], count);
+            n += count;
+            ofs += count;
+            if (from + count < elen) {
+                // the next read carries on from this entry
+                break;
+            }
+        }
+        param_snapshot_cursor.ofs += elen;
+        param_snapshot_cursor.vp = AP_Param::next_scalar(&param_snapshot_cursor.token, &param_snapshot_cursor.type);
+    }
+    return n;
+}
+
+/*
+ *  called when the GCS asks for a window of the snapshot starting at
+ *  ofs. If that includes the header, start working out the CRC
+ */
+static void param_snapshot_start(uint32_t ofs)
+{
+    if (ofs < PARAM_SNAPSHOT_HEADER_LEN) {
+        param_snapshot_crc = 0xFFFFFFFF;
+        param_snapshot_crc_ofs = PARAM_SNAPSHOT_HEADER_LEN;
+    }
+}
+
+/*
+ *  add the next few entries to the CRC. Returns true once the header
+ *  is ready to send
+ */
+static bool param_snapshot_summed(void)
+{
+    if (param_snapshot_crc_ofs >= param_snapshot_length) {
+        return true;
+    }
+
+    uint8_t buf[64];
+    uint16_t n = param_snapshot_read(param_snapshot_crc_ofs, buf, sizeof(buf));
+    for (uint16_t i=0; i<n; i++) {
+        // CRC-32 as used by zlib, one bit at a time
+        param_snapshot_crc ^= buf[i];
+        for (uint8_t b=0; b<8; b++) {
+            param_snapshot_crc = (param_snapshot_crc >> 1) ^ (0xEDB88320UL & -(param_snapshot_crc & 1));
+        }
+    }
+    param_snapshot_crc_ofs += n;
+    if (n == 0 || param_snapshot_crc_ofs >= param_snapshot_length) {
+        param_snapshot_crc_ofs = param_snapshot_length;
+        param_snapshot_crc ^= 0xFFFFFFFF;
+        return true;
+    }
+    return false;
+}
+#endif // LOG_DOWNLOAD
@@ -0,0 +1,344 @@
+/*
+ *  LogParser - convert an ArduPlane_vscl binary DataFlash log to CSV
+ *
+ *  The log is read with "dump <n> raw" from the log menu of the CLI, and
+ *  saved to a file (anything before "BINARY LOG START" is skipped). The
+ *  layout of every record is learnt from the FMT records at the start
+ *  of the log, so the parser doesn't need to be changed when records are
+ *  added to the firmware.
+ *
+ *  The delta encoded VSCL experiment records are also expanded back into
+ *  full samples, VSCK and VSCD as VSCL rows, and the achieved states in
+ *  VSAK and VSAD as VSCA rows.
+ *
+ *  usage: LogParser <logfile>             all records to stdout
+ *         LogParser <logfile> <dir>       one <NAME>.csv per record type
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HEAD_BYTE1      0xA3
+#define HEAD_BYTE2      0x95
+#define END_BYTE        0xBA
+#define LOG_FORMAT_MSG  0x80
+#define LOG_FORMAT_LEN  90
+
+struct log_format {
+    bool known;
+    uint8_t length;
+    char name[5];
+    char format[17];
+    char labels[65];
+    FILE *out;
+};
+
+static struct log_format formats[256];
+static const char *out_dir;
+
+// VSCL experiment samples, see Log_Write_Vscl()
+#define VSCL_FIELDS         12
+#define VSCL_SAMPLE_MS      20
+
+struct vscl_stream {
+    bool valid;             // have a key, and haven't missed a sample since
+    uint8_t seq;
+    int32_t value[VSCL_FIELDS];
+    struct log_format fmt;
+};
+
+// commands and outputs, VSCK/VSCD, and achieved states, VSAK/VSAD.
+// Only the command key holds the time, the states take it by seq
+static struct vscl_stream vscl, vscl_state;
+static uint32_t vscl_time_ms;
+
+static uint16_t get_u16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// length of the body of a record with this format, or -1 if it is invalid
+static int format_length(const char *fmt)
+{
+    int len = 0;
+    for (; *fmt; fmt++) {
+        switch (*fmt) {
+        case 'b': case 'B':                         len += 1; break;
+        case 'h': case 'H': case 'c': case 'C':     len += 2; break;
+        case 'i': case 'I': case 'e': case 'L':     len += 4; break;
+        case 'f': case 'n':                         len += 4; break;
+        case 'N':                                   len += 16; break;
+        case 'a':                                   len += 32; break;
+        case 'Z':                                   len += 64; break;
+        default:                                    return -1;
+        }
+    }
+    return len;
+}
+
+static void set_format(uint8_t type, uint8_t length, const char *name,
+                       const char *format, const char *labels)
+{
+    struct log_format *f = &formats[type];
+    if (format_length(format) != length - 4) {
+        fprintf(stderr, "bad format for type 0x%02x: %s\n", type, format);
+        return;
+    }
+    f->known = true;
+    f->length = length;
+    strncpy(f->name, name, 4);
+    strncpy(f->format, format, 16);
+    strncpy(f->labels, labels, 64);
+}
+
+static FILE *output(struct log_format *f)
+{
+    if (out_dir == NULL) {
+        return stdout;
+    }
+    if (f->out == NULL) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s.csv", out_dir, f->name);
+        f->out = fopen(path, "w");
+        if (f->out == NULL) {
+            perror(path);
+            exit(1);
+        }
+        fprintf(f->out, "%s\n", f->labels);
+    }
+    return f->out;
+}
+
+static void print_record(struct log_format *f, const uint8_t *p)
+{
+    FILE *out = output(f);
+    char str[65];
+
+    if (out_dir == NULL) {
+        fprintf(out, "%s", f->name);
+    }
+    for (const char *c = f->format; *c; c++) {
+        if (out_dir == NULL || c != f->format) {
+            fputs(", ", out);
+        }
+        switch (*c) {
+        case 'b': fprintf(out, "%d", (int8_t)p[0]); p += 1; break;
+        case 'B': fprintf(out, "%u", p[0]); p += 1; break;
+        case 'h': fprintf(out, "%d", (int16_t)get_u16(p)); p += 2; break;
+        case 'H': fprintf(out, "%u", get_u16(p)); p += 2; break;
+        case 'c': fprintf(out, "%.2f", (int16_t)get_u16(p) * 0.01); p += 2; break;
+        case 'C': fprintf(out, "%.2f", get_u16(p) * 0.01); p += 2; break;
+        case 'i': fprintf(out, "%d", (int32_t)get_u32(p)); p += 4; break;
+        case 'I': fprintf(out, "%u", get_u32(p)); p += 4; break;
+        case 'e': fprintf(out, "%.2f", (int32_t)get_u32(p) * 0.01); p += 4; break;
+        case 'L': fprintf(out, "%.7f", (int32_t)get_u32(p) * 1.0e-7); p += 4; break;
+        case 'f': {
+            uint32_t u = get_u32(p);
+            float v;
+            memcpy(&v, &u, 4);
+            fprintf(out, "%.9g", v);
+            p += 4;
+            break;
+        }
+        case 'a':
+            for (int i=0; i<32; i++) {
+                fprintf(out, "%02x", p[i]);
+            }
+            p += 32;
+            break;
+        case 'n':
+        case 'N':
+        case 'Z': {
+            int n = (*c == 'n' ? 4 : *c == 'N' ? 16 : 64);
+            memcpy(str, p, n);
+            str[n] = 0;
+            fputs(str, out);
+            p += n;
+            break;
+        }
+        }
+    }
+    fputc('\n', out);
+}
+
+static int32_t get_field(const char **fmt, const uint8_t **p)
+{
+    const uint8_t *b = *p;
+    switch (*(*fmt)++) {
+    case 'b': *p += 1; return (int8_t)b[0];
+    case 'h': *p += 2; return (int16_t)get_u16(b);
+    case 'i': *p += 4; return (int32_t)get_u32(b);
+    }
+    return 0;
+}
+
+static void print_vscl(struct vscl_stream *v)
+{
+    FILE *out = output(&v->fmt);
+    if (out_dir == NULL) {
+        fprintf(out, "%s, ", v->fmt.name);
+    }
+    fprintf(out, "%u, %u", vscl_time_ms, v->seq);
+    int n = strlen(v->fmt.format) - 2;
+    for (int i=0; i<n && i<VSCL_FIELDS; i++) {
+        fprintf(out, ", %d", v->value[i]);
+    }
+    fputc('\n', out);
+}
+
+// a key record, starting at the first value
+static void vscl_key(struct vscl_stream *v, const struct log_format *f,
+                     const char *fmt, const uint8_t *p, uint8_t seq,
+                     const char *name)
+{
+    v->seq = seq;
+    for (int i=0; i<VSCL_FIELDS && *fmt; i++) {
+        v->value[i] = get_field(&fmt, &p);
+    }
+    if (!v->fmt.known) {
+        // the expanded rows are labelled like the key, with a time
+        v->fmt = *f;
+        v->fmt.out = NULL;
+        strcpy(v->fmt.name, name);
+        if (strncmp(f->format, "IB", 2) != 0) {
+            v->fmt.format[0] = 'I';
+            memcpy(v->fmt.format + 1, f->format, sizeof(v->fmt.format) - 2);
+            memcpy(v->fmt.labels, "TimeMS,", 7);
+            memcpy(v->fmt.labels + 7, f->labels, sizeof(v->fmt.labels) - 8);
+        }
+    }
+    v->valid = true;
+}
+
+// a delta record, returns false if a sample has been missed
+static bool vscl_delta(struct vscl_stream *v, const char *fmt, const uint8_t *p)
+{
+    if (!v->valid || p[0] != (uint8_t)(v->seq + 1)) {
+        // missed a sample, wait for the next key
+        v->valid = false;
+        return false;
+    }
+    v->seq = p[0];
+    p += 1;
+    fmt += 1;
+    for (int i=0; i<VSCL_FIELDS && *fmt; i++) {
+        v->value[i] += get_field(&fmt, &p);
+    }
+    return true;
+}
+
+// rebuild full samples from the key and delta records
+static void expand_vscl(const struct log_format *f, const uint8_t *p)
+{
+    if (strcmp(f->name, "VSCK") == 0) {
+        vscl_time_ms = get_u32(p);
+        vscl_key(&vscl, f, f->format + 2, p + 5, p[4], "VSCL");
+        print_vscl(&vscl);
+    } else if (strcmp(f->name, "VSCD") == 0) {
+        if (vscl_delta(&vscl, f->format, p)) {
+            vscl_time_ms += VSCL_SAMPLE_MS;
+            print_vscl(&vscl);
+        }
+    } else if (strcmp(f->name, "VSAK") == 0) {
+        vscl_key(&vscl_state, f, f->format + 1, p + 1, p[0], "VSCA");
+    } else if (strcmp(f->name, "VSAD") == 0) {
+        vscl_delta(&vscl_state, f->format, p);
+    } else {
+        return;
+    }
+    // a state sample is only printed once we have its time
+    if ((f->name[2] == 'A') && vscl_state.valid && vscl.valid &&
+        vscl_state.seq == vscl.seq) {
+        print_vscl(&vscl_state);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <logfile> [outdir]\n", argv[0]);
+        return 1;
+    }
+    out_dir = argc == 3 ? argv[2] : NULL;
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size == 0) {
+        return 0;
+    }
+    const uint8_t *data = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    const uint8_t *end = data + st.st_size;
+    const uint8_t *p = data;
+
+    const char *start = (const char *)memmem(data, st.st_size, "BINARY LOG START\n", 17);
+    if (start != NULL) {
+        p = (const uint8_t *)start + 17;
+    }
+
+    // the FMT record describes itself, so we only need to know it
+    set_format(LOG_FORMAT_MSG, LOG_FORMAT_LEN, "FMT", "BBnNZ",
+               "Type,Length,Name,Format,Labels");
+
+    unsigned records = 0, skipped = 0;
+    while (end - p >= 4) {
+        if (p[0] != HEAD_BYTE1 || p[1] != HEAD_BYTE2) {
+            // lost sync, step forward until we find a header
+            p++;
+            skipped++;
+            continue;
+        }
+        struct log_format *f = &formats[p[2]];
+        if (!f->known || end - p < f->length || p[f->length-1] != END_BYTE) {
+            p++;
+            skipped++;
+            continue;
+        }
+        if (p[2] == LOG_FORMAT_MSG) {
+            char name[5], format[17], labels[65];
+            memcpy(name, p+5, 4);       name[4] = 0;
+            memcpy(format, p+9, 16);    format[16] = 0;
+            memcpy(labels, p+25, 64);   labels[64] = 0;
+            if (p[3] != LOG_FORMAT_MSG) {
+                set_format(p[3], p[4], name, format, labels);
+            }
+        }
+        print_record(f, p+3);
+        expand_vscl(f, p+3);
+        records++;
+        p += f->length;
+    }
+
+    for (int i=0; i<256; i++) {
+        if (formats[i].out != NULL) {
+            fclose(formats[i].out);
+        }
+    }
+    if (vscl.fmt.out != NULL) {
+        fclose(vscl.fmt.out);
+    }
+    if (vscl_state.fmt.out != NULL) {
+        fclose(vscl_state.fmt.out);
+    }
+    fprintf(stderr, "%u records, %u bytes skipped\n", records, skipped);
+    return 0;
+}
@@ -0,0 +1,274 @@
+#!/usr/bin/env python
+'''
+batchsim - run many SITL aircraft at once for tuning campaigns
+
+Each run gets its own SITL process, working directory and port
+block. A separate working directory means a separate EEPROM image, so
+each run has its own parameters. A run loads the campaign's parameters
+and plays a script of MAVLink commands, such as VSCL_TEST and
+VSCL_BUMP, against the time the autopilot reports. When the run ends,
+its DataFlash log is kept and converted to CSV with
+Tools/LogParser. Runs are spread over all cores, and summary.csv lists
+how each one went.
+
+Build the firmware with 'make sitl-fast' so that runs go faster than
+real time. That build expects a lockstep simulator, given as the
+campaign's sim_command. 'make sitl-fdm' builds in its own flight model
+instead, and then no sim_command is needed.
+
+VSCL_TEST and VSCL_BUMP aren't in the stock ardupilotmega dialect that
+ships with pymavlink. Generate a dialect from the ardupilotmega.xml the
+firmware was built with, in libraries/GCS_MAVLink/message_definitions:
+
+  mavgen.py --lang=Python --wire-protocol=1.0 \\
+      --output=<pymavlink>/dialects/v10/vscl.py ardupilotmega.xml
+
+and name it as the campaign's dialect. The dialect is checked for every
+scripted message before any run starts.
+
+A campaign is a JSON file:
+
+  {
+    "binary":      "/tmp/ArduPlane_vscl.build/ArduPlane_vscl.elf",
+    "dialect":     "vscl",
+    "duration":    600,
+    "sim_command": "sim_vscl.py --instance {instance}",
+    "params":      { "THR_MAX": 80 },
+    "sweep":       { "KFF_PTCH2THR": [0, 0.5, 1.0] },
+    "commands": [
+      { "t": 60,  "msg": "VSCL_TEST", "fields": { "dummy": 20 } },
+      { "t": 120, "msg": "VSCL_BUMP", "fields": { "bumpID": 0, "bumpval": 500 } }
+    ]
+  }
+
+Every combination of the sweep values is run once. Times are seconds
+of autopilot time. {instance}, {mav_port} and {sim_port} in
+sim_command are replaced for each run.
+
+usage: batchsim.py campaign.json [--out DIR] [--jobs N]
+'''
+
+import argparse
+import csv
+import itertools
+import json
+import multiprocessing
+import os
+import queue
+import shutil
+import subprocess
+import sys
+import threading
+import time
+
+MAV_PORT_BASE = 5760        # SITL serial0 TCP port for instance 0
+SIM_PORT_BASE = 5501        # simulator UDP port for instance 0
+PORT_STRIDE = 10            # ports used by each instance
+
+TOOLS = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def expand_runs(campaign):
+    '''one parameter set per combination of the sweep values'''
+    sweep = campaign.get('sweep', {})
+    names = sorted(sweep.keys())
+    runs = []
+    for values in itertools.product(*[sweep[n] for n in names]):
+        params = dict(campaign.get('params', {}))
+        params.update(zip(names, values))
+        runs.append(params)
+    return runs
+
+
+def check_dialect(campaign):
+    '''make sure the dialect knows every scripted message, returning an
+    error message if it doesn't'''
+    from pymavlink import mavutil
+    dialect = campaign.get('dialect', 'ardupilotmega')
+    try:
+        mavutil.set_dialect(dialect)
+    except ImportError:
+        return 'no pymavlink dialect %s' % dialect
+    for cmd in campaign.get('commands', []):
+        if not hasattr(mavutil.mavlink, 'MAVLINK_MSG_ID_' + cmd['msg'].upper()):
+            return 'dialect %s has no %s message, see the VSCL dialect in batchsim.py' % (
+                dialect, cmd['msg'])
+    return None
+
+
+def connect(port, dialect, logfile, timeout):
+    '''connect to an autopilot, waiting for it to start listening'''
+    from pymavlink import mavutil
+    deadline = time.time() + timeout
+    while True:
+        try:
+            mav = mavutil.mavlink_connection('tcp:127.0.0.1:%u' % port,
+                                             dialect=dialect, autoreconnect=False)
+            break
+        except Exception:
+            if time.time() > deadline:
+                raise
+            time.sleep(0.2)
+    mav.setup_logfile(logfile)
+    if mav.wait_heartbeat(timeout=timeout) is None:
+        raise RuntimeError('no heartbeat on port %u' % port)
+    return mav
+
+
+def set_params(mav, params, timeout=5):
+    '''set parameters, waiting for each to be echoed back'''
+    for name, value in sorted(params.items()):
+        for attempt in range(3):
+            mav.param_set_send(name, float(value))
+            m = mav.recv_match(type='PARAM_VALUE', blocking=True, timeout=timeout)
+            while m is not None and m.param_id.rstrip('\x00') != name:
+                m = mav.recv_match(type='PARAM_VALUE', blocking=True, timeout=timeout)
+            if m is not None:
+                break
+        else:
+            raise RuntimeError('failed to set %s' % name)
+
+
+def send_command(mav, cmd):
+    '''send a scripted message, named as in the MAVLink XML'''
+    fn = getattr(mav.mav, cmd['msg'].lower() + '_send')
+    fn(**cmd.get('fields', {}))
+
+
+def fly(mav, campaign):
+    '''play the command script until the run's duration has passed.
+    Returns the autopilot time reached, in seconds'''
+    commands = sorted(campaign.get('commands', []), key=lambda c: c['t'])
+    duration = campaign.get('duration', 600)
+    stall_timeout = campaign.get('stall_timeout', 30)
+    t = 0
+    last_progress = time.time()
+    while t < duration:
+        m = mav.recv_match(blocking=True, timeout=1)
+        if m is not None and hasattr(m, 'time_boot_ms'):
+            if m.time_boot_ms * 0.001 > t:
+                t = m.time_boot_ms * 0.001
+                last_progress = time.time()
+        if time.time() - last_progress > stall_timeout:
+            raise RuntimeError('autopilot time stopped at %.1fs' % t)
+        while commands and commands[0]['t'] <= t:
+            send_command(mav, commands.pop(0))
+    return t
+
+
+def collect_logs(rundir):
+    '''convert the SITL DataFlash image to CSV, if we have the parser'''
+    parser = os.path.join(TOOLS, 'LogParser', 'LogParser')
+    for name in ('dataflash.bin', 'logs.bin'):
+        path = os.path.join(rundir, name)
+        if os.path.exists(path) and os.path.exists(parser):
+            csvdir = os.path.join(rundir, 'csv')
+            os.makedirs(csvdir, exist_ok=True)
+            with open(os.path.join(rundir, 'logparser.txt'), 'w') as out:
+                subprocess.call([parser, path, csvdir], stdout=out, stderr=out)
+
+
+def run_one(campaign, run_id, params, instance, outdir):
+    '''run one aircraft to completion, returning a summary row'''
+    rundir = os.path.join(outdir, 'run%04u' % run_id)
+    shutil.rmtree(rundir, ignore_errors=True)
+    os.makedirs(rundir)
+    with open(os.path.join(rundir, 'params.json'), 'w') as f:
+        json.dump(params, f, indent=2, sort_keys=True)
+
+    mav_port = MAV_PORT_BASE + PORT_STRIDE * instance
+    sim_port = SIM_PORT_BASE + PORT_STRIDE * instance
+    console = open(os.path.join(rundir, 'console.txt'), 'w')
+    procs = []
+    row = {'run': run_id, 'instance': instance, 'status': 'ok', 'sim_time': 0}
+    row.update(params)
+    tstart = time.time()
+    try:
+        # -w starts from a fresh EEPROM, -I picks the port block
+        procs.append(subprocess.Popen([campaign['binary'], '-w', '-I', str(instance)],
+                                      cwd=rundir, stdout=console, stderr=console))
+        if campaign.get('sim_command'):
+            cmd = campaign['sim_command'].format(instance=instance,
+                                                 mav_port=mav_port, sim_port=sim_port)
+            procs.append(subprocess.Popen(cmd, shell=True, cwd=rundir,
+                                          stdout=console, stderr=console))
+        mav = connect(mav_port, campaign.get('dialect', 'ardupilotmega'),
+                      os.path.join(rundir, 'flight.tlog'), campaign.get('start_timeout', 60))
+        set_params(mav, params)
+        row['sim_time'] = round(fly(mav, campaign), 1)
+        mav.close()
+    except Exception as e:
+        row['status'] = str(e)
+    finally:
+        for p in procs:
+            if p.poll() is None:
+                p.terminate()
+        for p in procs:
+            try:
+                p.wait(timeout=10)
+            except subprocess.TimeoutExpired:
+                p.kill()
+        console.close()
+    row['wall_time'] = round(time.time() - tstart, 1)
+    collect_logs(rundir)
+    return row
+
+
+def main():
+    ap = argparse.ArgumentParser(description='run a SITL campaign')
+    ap.add_argument('campaign', help='campaign JSON file')
+    ap.add_argument('--out', default='batchsim.out', help='output directory')
+    ap.add_argument('--jobs', type=int, default=multiprocessing.cpu_count(),
+                    help='aircraft to run at once')
+    args = ap.parse_args()
+
+    with open(args.campaign) as f:
+        campaign = json.load(f)
+    error = check_dialect(campaign)
+    if error is not None:
+        print(error)
+        return 1
+    runs = expand_runs(campaign)
+    os.makedirs(args.out, exist_ok=True)
+    print('%u runs, %u at a time' % (len(runs), args.jobs))
+
+    # each worker owns one instance number, and so one port block
+    work = queue.Queue()
+    for run_id, params in enumerate(runs):
+        work.put((run_id, params))
+    rows = []
+    lock = threading.Lock()
+
+    def worker(instance):
+        while True:
+            try:
+                run_id, params = work.get_nowait()
+            except queue.Empty:
+                return
+            row = run_one(campaign, run_id, params, instance, args.out)
+            with lock:
+                rows.append(row)
+                print('run %u: %s, %.1fs simulated in %.1fs' % (
+                    run_id, row['status'], row['sim_time'], row['wall_time']))
+                sys.stdout.flush()
+
+    threads = [threading.Thread(target=worker, args=(i,)) for i in range(args.jobs)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    rows.sort(key=lambda r: r['run'])
+    fields = ['run', 'instance', 'status', 'sim_time', 'wall_time']
+    fields += sorted(set(k for r in rows for k in r) - set(fields))
+    with open(os.path.join(args.out, 'summary.csv'), 'w') as f:
+        w = csv.DictWriter(f, fieldnames=fields)
+        w.writeheader()
+        w.writerows(rows)
+    failed = [r for r in rows if r['status'] != 'ok']
+    print('%u of %u runs failed' % (len(failed), len(rows)))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
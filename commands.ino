@@ -3,9 +3,27 @@
  *  logic for dealing with the current command in the mission and home location
  */
 
+#if MISSION_CACHE_SIZE > 0
+/*
+ *  RAM copy of the first MISSION_CACHE_SIZE mission commands, so that
+ *  looking up a command doesn't mean reading it back from EEPROM each
+ *  time. Changed commands are marked dirty and written back to EEPROM a
+ *  byte at a time from the idle loop, or all at once when a mission
+ *  upload completes. The cache is allocated when the mission is loaded
+ *  at a ground or air start; if there isn't the memory for it we run
+ *  straight from EEPROM as before
+ */
+static struct mission_cache {
+    uint8_t dirty[(MISSION_CACHE_SIZE+7)/8];
+    uint8_t flush_index;        // next command to look at for write back
+    struct Location cmd[MISSION_CACHE_SIZE];
+} *mission_cache;
+#endif
+
 static void init_commands()
 {
-    g.command_index.set_and_save(0);
+    g.command_index.set(0);
+    param_save_deferred(&g.command_index, AP_PARAM_INT8);
     nav_command_ID  = NO_COMMAND;
     non_nav_command_ID      = NO_COMMAND;
     next_nav_command.id     = CMD_BLANK;
@@ -35,42 +53,57 @@ static void update_auto()
 // this is only used by an air-start
 static void reload_commands_airstart()
 {
+    mission_cache_load();
     init_commands();
     decrement_cmd_index();
 }
 
 /*
-  fetch a mission item from EEPROM
+  read a mission item directly from EEPROM
 */
-static struct Location get_cmd_with_index_raw(int16_t i)
+static struct Location get_cmd_from_eeprom(int16_t i)
 {
     struct Location temp;
-    uint16_t mem;
 
     // Find out proper location in memory by using the start_byte position + the index
     // --------------------------------------------------------------------------------
-    if (i > g.command_total) {
-        memset(&temp, 0, sizeof(temp));
-        temp.id = CMD_BLANK;
-    }else{
-        // read WP position
-        mem = (WP_START_BYTE) + (i * WP_SIZE);
-        temp.id = eeprom_read_byte((uint8_t*)(uintptr_t)mem);
+    uint16_t mem = (WP_START_BYTE) + (i * WP_SIZE);
+    temp.id = eeprom_read_byte((uint8_t*)(uintptr_t)mem);
+
+    mem++;
+    temp.options = eeprom_read_byte((uint8_t*)(uintptr_t)mem);
 
-        mem++;
-        temp.options = eeprom_read_byte((uint8_t*)(uintptr_t)mem);
+    mem++;
+    temp.p1 = eeprom_read_byte((uint8_t*)(uintptr_t)mem);
 
-        mem++;
-        temp.p1 = eeprom_read_byte((uint8_t*)(uintptr_t)mem);
+    mem++;
+    temp.alt = (long)eeprom_read_dword((uint32_t*)(uintptr_t)mem);
 
-        mem++;
-        temp.alt = (long)eeprom_read_dword((uint32_t*)(uintptr_t)mem);
+    mem += 4;
+    temp.lat = (long)eeprom_read_dword((uint32_t*)(uintptr_t)mem);
 
-        mem += 4;
-        temp.lat = (long)eeprom_read_dword((uint32_t*)(uintptr_t)mem);
+    mem += 4;
+    temp.lng = (long)eeprom_read_dword((uint32_t*)(uintptr_t)mem);
 
-        mem += 4;
-        temp.lng = (long)eeprom_read_dword((uint32_t*)(uintptr_t)mem);
+    return temp;
+}
+
+/*
+  fetch a mission item, from the cache if it is there
+*/
+static struct Location get_cmd_with_index_raw(int16_t i)
+{
+    struct Location temp;
+
+    if (i > g.command_total) {
+        memset(&temp, 0, sizeof(temp));
+        temp.id = CMD_BLANK;
+#if MISSION_CACHE_SIZE > 0
+    } else if (mission_cache != NULL && i >= 0 && i < MISSION_CACHE_SIZE) {
+        temp = mission_cache->cmd[i];
+#endif
+    }else{
+        temp = get_cmd_from_eeprom(i);
     }
 
     return temp;
@@ -100,7 +133,10 @@ static struct Location get_cmd_with_index(int16_t i)
 static void set_cmd_with_index(struct Location temp, int16_t i)
 {
     i = constrain(i, 0, g.command_total.get());
-    intptr_t mem = WP_START_BYTE + (i * WP_SIZE);
+    if (i >= MAX_WAYPOINTS) {
+        // would overwrite the fence points
+        return;
+    }
 
     // Set altitude options bitmask
     // XXX What is this trying to do?
@@ -110,6 +146,20 @@ static void set_cmd_with_index(struct Location temp, int16_t i)
         temp.options = 0;
     }
 
+#if MISSION_CACHE_SIZE > 0
+    if (mission_cache != NULL && i < MISSION_CACHE_SIZE) {
+        // written back to EEPROM later by mission_cache_flush_step()
+        mission_cache->cmd[i] = temp;
+        mission_cache->dirty[i>>3] |= (1<<(i&7));
+        idle_work_request(IDLE_WORK_MISSION_FLUSH);
+        return;
+    }
+#endif
+
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_EEPROM_WRITE;
+
+    intptr_t mem = WP_START_BYTE + (i * WP_SIZE);
     eeprom_write_byte((uint8_t *)   mem, temp.id);
 
     mem++;
@@ -126,12 +176,121 @@ static void set_cmd_with_index(struct Location temp, int16_t i)
 
     mem += 4;
     eeprom_write_dword((uint32_t *) mem, temp.lng);
+
+    loop_stage = saved_stage;
 }
 
+#if MISSION_CACHE_SIZE > 0
+/*
+  (re)load the mission cache from EEPROM, discarding any changes that
+  haven't been written back yet
+*/
+static void mission_cache_load(void)
+{
+    if (mission_cache == NULL) {
+        if (memcheck_available_memory() < 512 + sizeof(struct mission_cache)) {
+            // too risky to enable as we could run out of stack
+            return;
+        }
+        mission_cache = (struct mission_cache *)calloc(1, sizeof(struct mission_cache));
+        if (mission_cache == NULL) {
+            return;
+        }
+    }
+    for (uint8_t i=0; i<MISSION_CACHE_SIZE; i++) {
+        mission_cache->cmd[i] = get_cmd_from_eeprom(i);
+    }
+    memset(mission_cache->dirty, 0, sizeof(mission_cache->dirty));
+}
+
+/*
+  write back one byte of a changed command, in the same layout that
+  get_cmd_from_eeprom() reads. Bytes that already match are skipped, so
+  only the parts of a command that changed use up EEPROM write
+  cycles. Returns true while there is more to write
+*/
+static bool mission_cache_flush_step(void)
+{
+    if (mission_cache == NULL) {
+        return false;
+    }
+    for (uint8_t n=0; n<MISSION_CACHE_SIZE; n++) {
+        uint8_t i = mission_cache->flush_index;
+        uint8_t mask = (1<<(i&7));
+        if (mission_cache->dirty[i>>3] & mask) {
+            if (!eeprom_is_ready()) {
+                // previous byte still being written
+                return true;
+            }
+            const struct Location *cmd = &mission_cache->cmd[i];
+            uint8_t buf[WP_SIZE];
+            buf[0] = cmd->id;
+            buf[1] = cmd->options;
+            buf[2] = cmd->p1;
+            for (uint8_t b=0; b<4; b++) {
+                buf[3+b]  = ((uint32_t)cmd->alt) >> (8*b);
+                buf[7+b]  = ((uint32_t)cmd->lat) >> (8*b);
+                buf[11+b] = ((uint32_t)cmd->lng) >> (8*b);
+            }
+            uint8_t *mem = (uint8_t *)(uintptr_t)(WP_START_BYTE + (i * WP_SIZE));
+            for (uint8_t b=0; b<WP_SIZE; b++) {
+                if (eeprom_read_byte(mem+b) != buf[b]) {
+                    eeprom_write_byte(mem+b, buf[b]);
+                    return true;
+                }
+            }
+            // this command is now the same in EEPROM
+            mission_cache->dirty[i>>3] &= ~mask;
+        }
+        if (++mission_cache->flush_index == MISSION_CACHE_SIZE) {
+            mission_cache->flush_index = 0;
+        }
+    }
+    return false;
+}
+
+// true if there are changed commands not yet written back
+static bool mission_cache_dirty(void)
+{
+    if (mission_cache == NULL) {
+        return false;
+    }
+    for (uint8_t i=0; i<sizeof(mission_cache->dirty); i++) {
+        if (mission_cache->dirty[i] != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+  write back all changed commands now, for when we are about to reboot
+*/
+static void mission_cache_flush_all(void)
+{
+    while (mission_cache_flush_step()) ;
+}
+
+#else // MISSION_CACHE_SIZE
+
+static void mission_cache_load(void) {
+}
+static bool mission_cache_flush_step(void) {
+    return false;
+}
+static bool mission_cache_dirty(void) {
+    return false;
+}
+static void mission_cache_flush_all(void) {
+}
+
+#endif // MISSION_CACHE_SIZE
+
 static void decrement_cmd_index()
 {
     if (g.command_index > 0) {
-        g.command_index.set_and_save(g.command_index - 1);
+        g.command_index.set(g.command_index - 1);
+        param_save_deferred(&g.command_index, AP_PARAM_INT8);
     }
 }
 
@@ -195,19 +354,18 @@ static void set_next_WP(struct Location *wp)
     loiter_sum                      = 0;
     loiter_total            = 0;
 
+    // set up the new leg and a new crosstrack bearing
+    // ----------------------------
+    reset_crosstrack();
+
     // this is handy for the groundstation
-    wp_totalDistance        = get_distance(&current_loc, &next_WP);
-    wp_distance             = wp_totalDistance;
-    target_bearing_cd       = get_bearing_cd(&current_loc, &next_WP);
+    update_leg_position();
+    wp_totalDistance        = wp_distance;
     nav_bearing_cd          = target_bearing_cd;
 
     // to check if we have missed the WP
     // ----------------------------
     old_target_bearing_cd   = target_bearing_cd;
-
-    // set a new crosstrack bearing
-    // ----------------------------
-    reset_crosstrack();
 }
 
 static void set_guided_WP(void)
@@ -225,18 +383,17 @@ static void set_guided_WP(void)
     target_altitude_cm = current_loc.alt;
     offset_altitude_cm = next_WP.alt - prev_WP.alt;
 
+    // set up the new leg and a new crosstrack bearing
+    // ----------------------------
+    reset_crosstrack();
+
     // this is handy for the groundstation
-    wp_totalDistance        = get_distance(&current_loc, &next_WP);
-    wp_distance             = wp_totalDistance;
-    target_bearing_cd       = get_bearing_cd(&current_loc, &next_WP);
+    update_leg_position();
+    wp_totalDistance        = wp_distance;
 
     // to check if we have missed the WP
     // ----------------------------
     old_target_bearing_cd = target_bearing_cd;
-
-    // set a new crosstrack bearing
-    // ----------------------------
-    reset_crosstrack();
 }
 
 // run this at setup on the ground
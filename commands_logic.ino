@@ -522,7 +522,8 @@ static void do_jump()
     non_nav_command_ID      = NO_COMMAND;
 
     gcs_send_text_fmt(PSTR("setting command index: %i"), next_nonnav_command.p1);
-    g.command_index.set_and_save(next_nonnav_command.p1);
+    g.command_index.set(next_nonnav_command.p1);
+    param_save_deferred(&g.command_index, AP_PARAM_INT8);
     nav_command_index       = next_nonnav_command.p1;
     // Need to back "next_WP" up as it was set to the next waypoint following the jump
     next_WP = prev_WP;
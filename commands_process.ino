@@ -24,7 +24,8 @@ void change_command(uint8_t cmd_index)
         non_nav_command_ID      = NO_COMMAND;
 
         nav_command_index       = cmd_index - 1;
-        g.command_index.set_and_save(cmd_index);
+        g.command_index.set(cmd_index);
+        param_save_deferred(&g.command_index, AP_PARAM_INT8);
         update_commands();
     }
 }
@@ -104,7 +105,8 @@ static void process_next_command()
         temp = get_cmd_with_index(non_nav_command_index);
         if (temp.id <= MAV_CMD_NAV_LAST) {                       
             // The next command is a nav command.  No non-nav commands to do
-            g.command_index.set_and_save(nav_command_index);
+            g.command_index.set(nav_command_index);
+            param_save_deferred(&g.command_index, AP_PARAM_INT8);
             non_nav_command_index = nav_command_index;
             non_nav_command_ID = WAIT_COMMAND;
             gcs_send_text_fmt(PSTR("Non-Nav command ID updated to #%i idx=%u"),
@@ -113,7 +115,8 @@ static void process_next_command()
 
         } else {                                                                        
             // The next command is a non-nav command.  Prepare to execute it.
-            g.command_index.set_and_save(non_nav_command_index);
+            g.command_index.set(non_nav_command_index);
+            param_save_deferred(&g.command_index, AP_PARAM_INT8);
             next_nonnav_command = temp;
             non_nav_command_ID = next_nonnav_command.id;
             gcs_send_text_fmt(PSTR("(2) Non-Nav command ID updated to #%i idx=%u"),
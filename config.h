@@ -80,6 +80,15 @@
  #ifndef CAMERA
  # define CAMERA DISABLED
  #endif
+ #ifndef LOOP_PROFILER
+ # define LOOP_PROFILER DISABLED
+ #endif
+ #ifndef MISSION_CACHE_SIZE
+ # define MISSION_CACHE_SIZE 0
+ #endif
+ #ifndef PARAM_INDEX
+ # define PARAM_INDEX DISABLED
+ #endif
 #endif
 
 //////////////////////////////////////////////////////////////////////////////
@@ -194,6 +203,78 @@
  #define CONFIG_PITOT_SOURCE_ANALOG_PIN -1
 #endif
 
+//////////////////////////////////////////////////////////////////////////////
+// REPLAY                                    OPTIONAL
+//
+// Replay the control stack inputs recorded in a flight log, in a
+// desktop HIL sensors build. See replay.ino
+//
+#ifndef REPLAY
+ # define REPLAY DISABLED
+#endif
+
+#if REPLAY == ENABLED
+ # if !defined(DESKTOP_BUILD) || HIL_MODE != HIL_MODE_SENSORS
+  # error REPLAY needs a desktop HIL_MODE_SENSORS build
+ # endif
+ // the replay drives the sketch clock
+ # undef SITL_FAST
+ # define SITL_FAST ENABLED
+#endif
+
+#ifndef REPLAY_FILE
+ # define REPLAY_FILE "replay.bin"
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// SITL_FAST                                 OPTIONAL
+//
+// Run a desktop HIL build on a virtual clock driven by the simulator,
+// so flights run faster than real time. See vclock.ino
+//
+#ifndef SITL_FAST
+ # define SITL_FAST DISABLED
+#endif
+
+#if SITL_FAST == ENABLED && (!defined(DESKTOP_BUILD) || HIL_MODE == HIL_MODE_DISABLED)
+ # error SITL_FAST needs a desktop HIL build
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// SIM_FDM                                   OPTIONAL
+//
+// Fly a desktop HIL build against a flight model built into the sketch
+// instead of an external simulator. See sim_fdm.ino
+//
+#ifndef SIM_FDM
+ # define SIM_FDM DISABLED
+#endif
+
+#if SIM_FDM == ENABLED && (!defined(DESKTOP_BUILD) || HIL_MODE == HIL_MODE_DISABLED)
+ # error SIM_FDM needs a desktop HIL build
+#endif
+#if SIM_FDM == ENABLED && REPLAY == ENABLED
+ # error SIM_FDM and REPLAY can't be used together
+#endif
+
+// where the simulated aircraft starts. The default height is the one
+// the HIL barometer approximation is referenced to
+#ifndef SIM_FDM_START_LAT
+ # define SIM_FDM_START_LAT     -353632620     // degrees * 10^7
+#endif
+#ifndef SIM_FDM_START_LNG
+ # define SIM_FDM_START_LNG     1491652370     // degrees * 10^7
+#endif
+#ifndef SIM_FDM_START_ALT
+ # define SIM_FDM_START_ALT     584            // meters above sea level
+#endif
+#ifndef SIM_FDM_START_HEIGHT
+ # define SIM_FDM_START_HEIGHT  100            // meters above the ground
+#endif
+#ifndef SIM_FDM_START_SPEED
+ # define SIM_FDM_START_SPEED   15             // meters/second, heading north
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // GPS_PROTOCOL
 //
@@ -725,6 +806,12 @@
 #ifndef LOG_CUR
  # define LOG_CUR                        DISABLED
 #endif
+#ifndef LOG_VSCL
+ # define LOG_VSCL                       ENABLED
+#endif
+#ifndef LOG_REPLAY
+ # define LOG_REPLAY                     DISABLED
+#endif
 
 // calculate the default log_bitmask
 #define LOGBIT(_s)      (LOG_ ## _s ? MASK_LOG_ ## _s : 0)
@@ -739,7 +826,9 @@
     LOGBIT(MODE)                    | \
     LOGBIT(RAW)                             | \
     LOGBIT(CMD)                             | \
-    LOGBIT(CUR)
+    LOGBIT(CUR)                             | \
+    LOGBIT(VSCL)                    | \
+    LOGBIT(REPLAY)
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -818,7 +907,34 @@
 # define APM_CONTROL DISABLED
 #endif
 
+// fixed point stabilize, throttle and nav pitch control laws. See
+// control_fixed.ino
+#ifndef CONTROL_FIXED
+# define CONTROL_FIXED DISABLED
+#endif
+
+#if CONTROL_FIXED == ENABLED && APM_CONTROL == ENABLED
+# error CONTROL_FIXED replaces the PID control laws, it cannot be used with APM_CONTROL
+#endif
+
 #ifndef SERIAL_BUFSIZE
 # define SERIAL_BUFSIZE 256
 #endif
 
+// per-task execution time statistics for the main loop
+#ifndef LOOP_PROFILER
+# define LOOP_PROFILER ENABLED
+#endif
+
+
+// number of mission commands kept in RAM, 0 to always read them from EEPROM
+#ifndef MISSION_CACHE_SIZE
+# define MISSION_CACHE_SIZE 32
+#endif
+
+// index of parameter names for fast GCS parameter lookups. It is
+// allocated at startup if there is the memory for it, about 1.3KB on
+// an APM2. See the end of Parameters.ino
+#ifndef PARAM_INDEX
+# define PARAM_INDEX ENABLED
+#endif
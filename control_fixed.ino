@@ -0,0 +1,323 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  fixed point control laws
+ *
+ *  With CONTROL_FIXED enabled, stabilize(), the rudder and the
+ *  airspeed paths of calc_throttle() and calc_nav_pitch() run in
+ *  integer arithmetic instead of soft-float. The PIDs are fixed point
+ *  copies of the PID library, using the same gains, so the parameters
+ *  and their tuning are unchanged.
+ *
+ *  Formats are Q8 for values in the units of a PID input or output
+ *  (centidegrees, cm/s, throttle percent), and Q16 for gains, the speed
+ *  scaler and integrator state. All products go through fixed_mul(),
+ *  which is built from 16x16 bit multiplies that the AVR has in
+ *  hardware.
+ *
+ *  The results are within a unit or so of the float code, the
+ *  difference coming from rounding the gains to Q16. Use the "fixedpid"
+ *  CLI test to compare the two. Limits that the float code doesn't have:
+ *    - PID inputs saturate at +-32767, and derivatives at +-32767 per second
+ *    - the integrator limit is at most 16383
+ *    - gains are at most 127, and ki * dt at most 1
+ *
+ *  The gains are copied from the parameters at startup, and again
+ *  whenever a float parameter is queued for saving, which is how a gain
+ *  set from the GCS reaches EEPROM. A changed gain acts from the next tick.
+ */
+
+#if CONTROL_FIXED == ENABLED
+
+#define FIXED_ONE       65536L      // 1.0 in Q16
+#define FIXED_Q24_MAX   0xFFFFFFL   // largest fixed_mul() argument
+
+// stick influence is kept as an exact fraction of STICK_INF_ONE, which
+// gives the same result as the float code
+#define STICK_INF_ONE   400
+
+// the PID library's 20Hz derivative filter time constant, in
+// sixteenths of a millisecond
+#define FIXED_PID_RC    127
+
+static struct fixed_pid fixed_servo_roll;
+static struct fixed_pid fixed_servo_pitch;
+static struct fixed_pid fixed_servo_rudder;
+static struct fixed_pid fixed_wheel_steer;
+static struct fixed_pid fixed_nav_pitch_airspeed;
+static struct fixed_pid fixed_nav_pitch_altitude;
+static struct fixed_pid fixed_te_throttle;
+
+static int32_t fixed_kff_pitch_compensation;
+static int32_t fixed_kff_rudder_mix;
+static int32_t fixed_kff_pitch_to_throttle;
+static int32_t fixed_kff_throttle_to_pitch;
+static int32_t fixed_scaling_speed;         // cm/s, Q16
+
+/*
+ *  a * b >> 16, for |a| and |b| up to FIXED_Q24_MAX. The caller makes
+ *  sure the result fits
+ */
+static int32_t fixed_mul(int32_t a, int32_t b)
+{
+    bool negative = (a < 0) != (b < 0);
+    uint32_t ua = labs(a);
+    uint32_t ub = labs(b);
+    uint16_t ah = ua >> 8, bh = ub >> 8;
+    uint8_t al = ua, bl = ub;
+    uint32_t r = (uint32_t)ah * bh + (((uint32_t)ah * bl + (uint32_t)al * bh) >> 8);
+    return negative ? -(int32_t)r : (int32_t)r;
+}
+
+// Q8 to integer, rounding towards zero as a float to int conversion does
+static int32_t fixed_to_int(int32_t x)
+{
+    return x < 0 ? -((-x) >> 8) : x >> 8;
+}
+
+static int32_t fixed_gain(float k)
+{
+    k = constrain(k, -127, 127);
+    return k * FIXED_ONE + (k < 0 ? -0.5f : 0.5f);
+}
+
+static void fixed_pid_load(struct fixed_pid *pid, PID &source)
+{
+    pid->kp = fixed_gain(source.kP());
+    pid->ki = fixed_gain(source.kI());
+    pid->kd = fixed_gain(source.kD());
+    pid->imax = (int32_t)constrain(abs(source.imax()), 0, 16383) * FIXED_ONE;
+}
+
+static void fixed_pid_reset_I(struct fixed_pid *pid)
+{
+    pid->integrator = 0;
+    pid->derivative_valid = false;
+}
+
+/*
+ *  the PID library's get_pid(), in fixed point. The speed scaler is Q16
+ */
+static int32_t fixed_pid_get(struct fixed_pid *pid, int32_t error32, int32_t scaler)
+{
+    int16_t error = constrain(error32, -32767, 32767);
+    uint32_t tnow = millis();
+    uint32_t dt = tnow - pid->last_t;
+
+    if (pid->last_t == 0 || dt > 1000) {
+        dt = 0;
+        fixed_pid_reset_I(pid);
+    }
+    pid->last_t = tnow;
+
+    int32_t output = fixed_mul((int32_t)error * 256, pid->kp);
+
+    if (pid->kd != 0 && dt > 0) {
+        int32_t derivative;
+        if (!pid->derivative_valid) {
+            derivative = 0;
+            pid->last_derivative = 0;
+            pid->derivative_valid = true;
+        } else {
+            derivative = ((int32_t)error - pid->last_error) * 1000 / (int32_t)dt;
+            derivative = constrain(derivative, -32767, 32767);
+        }
+        // low pass filter, with the gain dt / (RC + dt) in Q15
+        int32_t alpha = ((int32_t)dt << 19) / ((int32_t)dt * 16 + FIXED_PID_RC);
+        derivative = pid->last_derivative + ((alpha * (derivative - pid->last_derivative)) >> 15);
+
+        pid->last_error = error;
+        pid->last_derivative = derivative;
+        output += fixed_mul(derivative * 256, pid->kd);
+    }
+
+    // scale the P and D components
+    output = fixed_mul(constrain(output, -FIXED_Q24_MAX, FIXED_Q24_MAX), scaler);
+
+    if (pid->ki != 0 && dt > 0) {
+        // dt in seconds, Q24
+        int32_t dt_q24 = min(dt * 16777 + dt * 27 / 125, (uint32_t)FIXED_Q24_MAX);
+        int32_t ki_dt = constrain(fixed_mul(pid->ki, dt_q24), -FIXED_Q24_MAX, FIXED_Q24_MAX);
+        int32_t scaled_error = constrain(fixed_mul((int32_t)error * 256, scaler), -0x7FFFFFL, 0x7FFFFFL);
+        int32_t change = constrain(fixed_mul(scaled_error, ki_dt), -0x3FFFFFFFL, 0x3FFFFFFFL);
+        pid->integrator = constrain(pid->integrator + change, -pid->imax, pid->imax);
+        output += pid->integrator >> 8;
+    }
+
+    return fixed_to_int(output);
+}
+
+/*
+ *  copy the gains from the parameters. Called at startup and from
+ *  param_save_deferred()
+ */
+static void control_fixed_load(void)
+{
+    fixed_pid_load(&fixed_servo_roll, g.pidServoRoll);
+    fixed_pid_load(&fixed_servo_pitch, g.pidServoPitch);
+    fixed_pid_load(&fixed_servo_rudder, g.pidServoRudder);
+    fixed_pid_load(&fixed_wheel_steer, g.pidWheelSteer);
+    fixed_pid_load(&fixed_nav_pitch_airspeed, g.pidNavPitchAirspeed);
+    fixed_pid_load(&fixed_nav_pitch_altitude, g.pidNavPitchAltitude);
+    fixed_pid_load(&fixed_te_throttle, g.pidTeThrottle);
+
+    fixed_kff_pitch_compensation = fixed_gain(g.kff_pitch_compensation);
+    fixed_kff_rudder_mix = fixed_gain(g.kff_rudder_mix);
+    fixed_kff_pitch_to_throttle = fixed_gain(g.kff_pitch_to_throttle);
+    fixed_kff_throttle_to_pitch = fixed_gain(g.kff_throttle_to_pitch);
+    fixed_scaling_speed = constrain(g.scaling_speed, 0, 300) * 100 * FIXED_ONE;
+}
+
+/*
+ *  get_speed_scaler(), as Q16. The airspeed is taken in whole cm/s
+ *  so the divide can be done in integers
+ */
+static int32_t get_speed_scaler_fixed(void)
+{
+    float aspeed;
+    int32_t speed_scaler;
+    if (ahrs.airspeed_estimate(&aspeed)) {
+        int32_t aspeed_cm = aspeed * 100;
+        if (aspeed_cm > 0) {
+            speed_scaler = fixed_scaling_speed / aspeed_cm;
+        } else {
+            speed_scaler = 2 * FIXED_ONE;
+        }
+        speed_scaler = constrain(speed_scaler, FIXED_ONE / 2, 2 * FIXED_ONE);
+    } else {
+        if (g.channel_throttle.servo_out > 0) {
+            speed_scaler = FIXED_ONE / 2 + (THROTTLE_CRUISE * FIXED_ONE / 2) / g.channel_throttle.servo_out;
+        } else {
+            speed_scaler = 109445;      // 1.67
+        }
+        speed_scaler = constrain(speed_scaler, 39322, 109445);
+    }
+    return speed_scaler;
+}
+
+// share of the autopilot output to keep with the stick off trim, in
+// parts of STICK_INF_ONE
+static int16_t stick_influence_fixed(RC_Channel &channel)
+{
+    int16_t deflection = abs(channel.radio_in - channel.radio_trim);
+    return STICK_INF_ONE - min(deflection, STICK_INF_ONE);
+}
+
+static int16_t stick_scale_fixed(int16_t servo_out, int16_t influence)
+{
+    return (int32_t)servo_out * influence / STICK_INF_ONE;
+}
+
+/*
+ *  stabilize() and calc_nav_yaw() from Attitude.ino, in fixed point
+ */
+static void stabilize()
+{
+    int16_t ch1_inf = STICK_INF_ONE;
+    int16_t ch2_inf = STICK_INF_ONE;
+    int16_t ch4_inf = STICK_INF_ONE;
+    int32_t speed_scaler = get_speed_scaler_fixed();
+
+    if(crash_timer > 0) {
+        nav_roll_cd = 0;
+    }
+
+    if (inverted_flight) {
+        // see stabilize() in Attitude.ino
+        nav_roll_cd += 18000;
+        if (ahrs.roll_sensor < 0) nav_roll_cd -= 36000;
+    }
+
+    // Calculate dersired servo output for the roll
+    // ---------------------------------------------
+    g.channel_roll.servo_out = fixed_pid_get(&fixed_servo_roll, nav_roll_cd - ahrs.roll_sensor, speed_scaler);
+    int32_t tempcalc = fixed_to_int((nav_pitch_cd - (ahrs.pitch_sensor - g.pitch_trim_cd)) * 256 +
+                                    labs(fixed_mul(ahrs.roll_sensor * 256, fixed_kff_pitch_compensation)) +
+                                    fixed_mul((int32_t)g.channel_throttle.servo_out * 256, fixed_kff_throttle_to_pitch));
+    if (inverted_flight) {
+        // when flying upside down the elevator control is inverted
+        tempcalc = -tempcalc;
+    }
+    g.channel_pitch.servo_out = fixed_pid_get(&fixed_servo_pitch, tempcalc, speed_scaler);
+
+    // Mix Stick input to allow users to override control surfaces
+    // -----------------------------------------------------------
+    if (stick_mixing_enabled()) {
+        if (control_mode != FLY_BY_WIRE_A) {
+            ch1_inf = stick_influence_fixed(g.channel_roll);
+            ch2_inf = stick_influence_fixed(g.channel_pitch);
+
+            g.channel_roll.servo_out = stick_scale_fixed(g.channel_roll.servo_out, ch1_inf);
+            g.channel_pitch.servo_out = stick_scale_fixed(g.channel_pitch.servo_out, ch2_inf);
+
+            g.channel_roll.servo_out +=     g.channel_roll.pwm_to_angle();
+            g.channel_pitch.servo_out +=    g.channel_pitch.pwm_to_angle();
+        }
+
+        // stick mixing performed for rudder for all cases including FBW
+        ch4_inf = stick_influence_fixed(g.channel_rudder);
+    }
+
+    // Apply output to Rudder
+    // ----------------------
+    calc_nav_yaw(speed_scaler);
+    g.channel_rudder.servo_out = stick_scale_fixed(g.channel_rudder.servo_out, ch4_inf);
+    g.channel_rudder.servo_out += g.channel_rudder.pwm_to_angle();
+}
+
+static void calc_nav_yaw(int32_t speed_scaler)
+{
+    int32_t rudder_mix = fixed_mul((int32_t)g.channel_roll.servo_out * 256, fixed_kff_rudder_mix);
+
+    if (hold_course != -1) {
+        // steering on or close to ground
+        int32_t steer = fixed_pid_get(&fixed_wheel_steer, bearing_error_cd, speed_scaler);
+        g.channel_rudder.servo_out = fixed_to_int(steer * 256 + rudder_mix);
+        return;
+    }
+
+    // always do rudder mixing from roll
+    g.channel_rudder.servo_out = fixed_to_int(rudder_mix);
+
+    // a PID to coordinate the turn (drive y axis accel to zero)
+    Vector3f temp = ins.get_accel();
+    int32_t error = -temp.y*100.0;
+
+    g.channel_rudder.servo_out += fixed_pid_get(&fixed_servo_rudder, error, speed_scaler);
+}
+
+/*
+ *  the airspeed path of calc_throttle()
+ */
+static void calc_throttle_fixed(void)
+{
+    // altitude_error_cm * 0.098, in Q8
+    energy_error = fixed_to_int((int32_t)airspeed_energy_error * 256 + altitude_error_cm * 3136 / 125);
+
+    // positive energy errors make the throttle go higher
+    g.channel_throttle.servo_out = g.throttle_cruise + fixed_pid_get(&fixed_te_throttle, energy_error, FIXED_ONE);
+    g.channel_throttle.servo_out = fixed_to_int((int32_t)g.channel_throttle.servo_out * 256 +
+                                                fixed_mul((int32_t)g.channel_pitch.servo_out * 256, fixed_kff_pitch_to_throttle));
+
+    g.channel_throttle.servo_out = constrain(g.channel_throttle.servo_out,
+                                             g.throttle_min.get(), g.throttle_max.get());
+}
+
+/*
+ *  the PID part of calc_nav_pitch()
+ */
+static int32_t calc_nav_pitch_fixed(void)
+{
+    if (alt_control_airspeed()) {
+        return -fixed_pid_get(&fixed_nav_pitch_airspeed, airspeed_error_cm, FIXED_ONE);
+    }
+    return fixed_pid_get(&fixed_nav_pitch_altitude, altitude_error_cm, FIXED_ONE);
+}
+
+// for takeoff below the minimum airspeed
+static void control_fixed_reset_servo_I(void)
+{
+    fixed_pid_reset_I(&fixed_servo_pitch);
+    fixed_pid_reset_I(&fixed_servo_roll);
+}
+
+#endif // CONTROL_FIXED
@@ -98,7 +98,8 @@ enum FlightMode {
 /// NOTE: to ensure we never block on sending MAVLink messages
 /// please keep each MSG_ to a single MAVLink message. If need be
 /// create new MSG_ IDs for additional messages on the same
-/// stream
+/// stream. Each MSG_ needs an entry in mavlink_priority[], and
+/// there can be at most 32 of them
 enum ap_message {
     MSG_HEARTBEAT,
     MSG_ATTITUDE,
@@ -125,6 +126,8 @@ enum ap_message {
     MSG_WIND,
     MSG_VSCL_TEST,//VSCL added cmd for new msg id
     MSG_VSCL_BUMP,//new command to bump alt/airspeed
+    MSG_PERF_INFO,
+    MSG_LOG_DATA,
     MSG_RETRY_DEFERRED // this must be last
 };
 
@@ -147,6 +150,34 @@ enum gcs_severity {
 #define LOG_CMD_MSG                             0x08
 #define LOG_CURRENT_MSG                 0x09
 #define LOG_STARTUP_MSG                 0x0A
+#define LOG_PERF_TASK_MSG               0x0B
+#define LOG_VSCL_KEY_MSG                0x0C
+#define LOG_VSCL_DELTA_MSG              0x0D
+#define LOG_ISR_MSG                     0x0E
+#define LOG_STALL_MSG                   0x0F
+// control stack inputs, for replaying a flight. See replay.ino
+#define LOG_REPLAY_TICK_MSG             0x10
+#define LOG_REPLAY_RC_MSG               0x11
+#define LOG_REPLAY_GPS_MSG              0x12
+#define LOG_REPLAY_BARO_MSG             0x13
+#define LOG_REPLAY_ASPD_MSG             0x14
+#define LOG_REPLAY_MAG_MSG              0x15
+#define LOG_REPLAY_MAV_MSG              0x16
+#define LOG_REPLAY_GND_MSG              0x17
+#define LOG_VSCL_STATE_KEY_MSG          0x18
+#define LOG_VSCL_STATE_DELTA_MSG        0x19
+#define LOG_FORMAT_MSG                  0x80
+
+// log download over MAVLink needs a MAVLink with the LOG_* messages
+#if LOGGING_ENABLED == ENABLED && defined(MAVLINK_MSG_ID_LOG_REQUEST_DATA)
+ # define LOG_DOWNLOAD ENABLED
+#else
+ # define LOG_DOWNLOAD DISABLED
+#endif
+
+// log id a GCS asks for to download all the parameters as one packed
+// snapshot. See the end of Parameters.ino
+#define PARAM_SNAPSHOT_LOG_ID           0xFFFF
 #define TYPE_AIRSTART_MSG               0x00
 #define TYPE_GROUNDSTART_MSG    0x01
 #define MAX_NUM_LOGS                    100
@@ -161,6 +192,109 @@ enum gcs_severity {
 #define MASK_LOG_RAW                    (1<<7)
 #define MASK_LOG_CMD                    (1<<8)
 #define MASK_LOG_CUR                    (1<<9)
+#define MASK_LOG_VSCL                   (1<<10)
+#define MASK_LOG_REPLAY                 (1<<11)
+
+// Loop profiler tasks. Each stage of fast_loop() and each scheduler
+// task gets its own execution time statistics
+enum perf_task {
+    PERF_TASK_READ_RADIO,
+    PERF_TASK_AHRS,
+    PERF_TASK_LOGGING,
+    PERF_TASK_FLIGHT_MODE,
+    PERF_TASK_STABILIZE,
+    PERF_TASK_SET_SERVOS,
+    PERF_TASK_VSCL_LOG,
+    PERF_TASK_GCS_UPDATE,
+    PERF_TASK_GCS_STREAM,
+    PERF_TASK_SCHED_0       // first entry of scheduler_tasks[], must be last
+};
+
+// execution time histogram: bin 0 holds times below 64us, each
+// following bin doubles in width, the last bin holds everything above
+#define PERF_HIST_BINS  10
+#define PERF_HIST_SHIFT 6
+
+// A regularly scheduled task, see scheduler_tasks[]
+struct sched_task {
+    void (*function)(void);
+    uint16_t interval_ticks;    // how often to run, in main loop ticks
+    uint16_t max_time_micros;   // expected worst case run time
+    char name[8];
+};
+
+// Main loop tick length, microseconds
+#define SCHED_LOOP_MICROS 20000
+
+// Deferred work done while waiting for the next IMU sample, see idle.ino.
+// At most 8 items, as pending work is kept as a bitmask
+enum idle_work {
+    IDLE_WORK_MAVLINK_RETRY,
+    IDLE_WORK_PARAM_SEND,
+    IDLE_WORK_WAYPOINT_SEND,
+    IDLE_WORK_GEOFENCE_LOAD,
+    IDLE_WORK_COMPASS,
+    IDLE_WORK_MISSION_FLUSH,
+    IDLE_WORK_PARAM_SAVE,
+    IDLE_WORK_LOG_FLUSH,
+    IDLE_NUM_WORK
+};
+
+// time kept free before the next IMU sample is due, microseconds
+#define IDLE_GUARD_MICROS 300
+
+// boards without an eeprom_is_ready() can always take a write
+#ifndef eeprom_is_ready
+ # define eeprom_is_ready() 1
+#endif
+
+// what the main loop is doing, sampled by the timer interrupt to find
+// where it stalls. The fast_loop() stages and the scheduler tasks use
+// their enum perf_task number, and other stages are numbered from here
+enum loop_stage {
+    STAGE_IDLE = 0xF0,
+    STAGE_EEPROM_WRITE,
+    STAGE_MAVLINK_DELAY,
+    STAGE_BARO_CALIBRATE,
+    STAGE_AIRSPEED_CALIBRATE,
+    STAGE_INS_CALIBRATE,
+    STAGE_LOG_ERASE,
+    STAGE_IMU_WAIT,         // loop() waiting for the next IMU sample
+    STAGE_LOOP,             // loop() itself, outside fast_loop() and the scheduler
+    STAGE_STARTUP
+};
+
+// events timestamped by the 1kHz timer interrupt for the main loop, see
+// failsafe.ino
+enum isr_event_type {
+    ISR_EVENT_LOOP,         // the main loop has started a tick
+    ISR_EVENT_RC,           // an RC frame has come in since the last read
+    ISR_EVENT_NUM
+};
+
+struct isr_event {
+    uint32_t time_us;
+    uint8_t type;           // enum isr_event_type
+};
+#define ISR_EVENT_RING_SIZE 16
+
+// State of a fixed point PID, see control_fixed.ino
+struct fixed_pid {
+    int32_t kp;                 // Q16
+    int32_t ki;                 // Q16, per second
+    int32_t kd;                 // Q16, seconds
+    int32_t imax;               // Q16
+    int32_t integrator;         // Q16
+    int32_t last_derivative;    // units per second
+    int16_t last_error;
+    bool derivative_valid;
+    uint32_t last_t;
+};
+
+// structures that are written out byte for byte, such as log records
+#ifndef PACKED
+ # define PACKED __attribute__((__packed__))
+#endif
 
 // Waypoint Modes
 // ----------------
@@ -206,16 +340,16 @@ enum gcs_severity {
                             // WP
 #define WP_SIZE 15
 
-// fence points are stored at the end of the EEPROM
-#define MAX_FENCEPOINTS 20
+// fence points are stored at the end of the EEPROM. 64 points take
+// 512 bytes, which leaves room for 152 waypoints where 20 points left
+// room for 176
+#define MAX_FENCEPOINTS 64
 #define FENCE_WP_SIZE sizeof(Vector2l)
 #define FENCE_START_BYTE (EEPROM_MAX_ADDR-(MAX_FENCEPOINTS*FENCE_WP_SIZE))
 
-#define MAX_WAYPOINTS  ((FENCE_START_BYTE - WP_START_BYTE) / WP_SIZE) - 1 // -
-                                                                          // 1
-                                                                          // to
-                                                                          // be
-                                                                          // safe
+// waypoints, home included, that fit below FENCE_START_BYTE, less 1 to
+// be safe
+#define MAX_WAYPOINTS  (((FENCE_START_BYTE - WP_START_BYTE) / WP_SIZE) - 1)
 
 // convert a boolean (0 or 1) to a sign for multiplying (0 maps to 1, 1 maps
 // to -1)
@@ -7,8 +7,14 @@
 /*
  *  our failsafe strategy is to detect main loop lockup and switch to
  *  passing inputs straight from the RC inputs to RC outputs.
+ *
+ *  The main loop keeps loop_stage set to what it is doing, so when it
+ *  stalls we can record where. The record survives a reset, and is
+ *  reported to the GCS and the log once the loop is running again.
  */
 
+#define LOOP_STALL_MAGIC 0x5A17
+
 /*
  *  this failsafe_check function is called from the core timer interrupt
  *  at 1kHz.
@@ -19,20 +25,57 @@ void failsafe_check(uint32_t tnow)
     static uint32_t last_timestamp;
     static bool in_failsafe;
 
+    isr_events_sample(tnow);
+
+    static uint32_t stall_start;
+    static bool main_loop_started;
+    static bool recording;
+
     if (mainLoop_count != last_mainLoop_count) {
         // the main loop is running, all is OK
         last_mainLoop_count = mainLoop_count;
         last_timestamp = tnow;
+        main_loop_started = true;
+        if (recording) {
+            loop_stall.active = false;
+        }
         in_failsafe = false;
+        recording = false;
         return;
     }
 
-    if (tnow - last_timestamp > 200000) {
+    if (!in_failsafe && tnow - last_timestamp > 200000) {
         // we have gone at least 0.2 seconds since the main loop
         // ran. That means we're in trouble, or perhaps are in
         // an initialisation routine or log erase. Start passing RC
         // inputs through to outputs
         in_failsafe = true;
+        stall_start = last_timestamp;
+
+        // startup and the sensor calibrations are expected to hold
+        // up the loop, and a stall that hasn't been reported yet,
+        // perhaps from before a reset, is kept rather than replaced
+        bool expected = !main_loop_started ||
+                        loop_stage == STAGE_STARTUP ||
+                        loop_stage == STAGE_BARO_CALIBRATE ||
+                        loop_stage == STAGE_AIRSPEED_CALIBRATE ||
+                        loop_stage == STAGE_INS_CALIBRATE;
+        if (!expected && loop_stall.count < 0xFF) {
+            loop_stall.count++;
+        }
+        recording = !expected && loop_stall.reported;
+        if (recording) {
+            loop_stall.stage = loop_stage;
+            loop_stall.start_ms = millis() - (tnow - stall_start) / 1000;
+            loop_stall.reported = false;
+            loop_stall.reset = false;
+            loop_stall.active = true;
+        }
+    }
+
+    if (recording) {
+        uint32_t duration = (tnow - stall_start) / 1000;
+        loop_stall.duration_ms = duration > 0xFFFF ? 0xFFFF : duration;
     }
 
     if (in_failsafe && tnow - last_timestamp > 20000) {
@@ -50,3 +93,126 @@ void failsafe_check(uint32_t tnow)
         RC_Channel_aux::copy_radio_in_out(RC_Channel_aux::k_aileron_with_input, true);
     }
 }
+
+/*
+ *  timestamp events for the main loop. This is called from the timer
+ *  interrupt at 1kHz, so each event is stamped within 1ms of when it
+ *  happened, however busy the main loop is. The main loop takes them
+ *  from the isr_events ring with isr_events_update()
+ */
+static void isr_events_sample(uint32_t tnow)
+{
+    static uint16_t last_loop_count;
+    static uint8_t last_rc_state;
+    struct isr_event e;
+
+    e.time_us = tnow;
+
+    // only plain reads of variables here. Calls into the drivers could
+    // turn interrupts back on, or talk to the sensors
+    if (mainLoop_count != last_loop_count) {
+        last_loop_count = mainLoop_count;
+        e.type = ISR_EVENT_LOOP;
+        isr_events.push(e);
+    }
+
+    // the RC driver sets its state when a frame comes in, and reading
+    // the inputs clears it. So this sees the first frame after each
+    // read_radio(), and a second frame before the next read is missed
+    uint8_t rc_state = APM_RC.GetState();
+    if (rc_state && !last_rc_state) {
+        e.type = ISR_EVENT_RC;
+        isr_events.push(e);
+    }
+    last_rc_state = rc_state;
+}
+
+// the time in microseconds from one time to another, limited to 16 bits
+static uint16_t isr_event_interval(uint32_t from, uint32_t to)
+{
+    uint32_t dt = to - from;
+    return dt > 0xFFFF ? 0xFFFF : dt;
+}
+
+/*
+ *  take the events from the timer interrupt, and keep the worst case
+ *  timings for the performance monitoring log. Called at the start of
+ *  each main loop tick
+ */
+static void isr_events_update(void)
+{
+    static uint32_t last_time_us[ISR_EVENT_NUM];
+    struct isr_event e;
+
+    while (isr_events.pop(e)) {
+        uint16_t gap = isr_event_interval(last_time_us[e.type], e.time_us);
+        switch (e.type) {
+        case ISR_EVENT_LOOP:
+            if (last_time_us[e.type] != 0 && gap > isr_loop_gap_max_us) {
+                isr_loop_gap_max_us = gap;
+            }
+            break;
+        case ISR_EVENT_RC:
+            if (last_time_us[e.type] != 0 && gap > isr_rc_gap_max_us) {
+                isr_rc_gap_max_us = gap;
+            }
+            break;
+        }
+        last_time_us[e.type] = e.time_us;
+    }
+}
+
+/*
+ *  set up the stall record at startup. After a power on it holds
+ *  garbage, otherwise it holds the last stall from before the reset
+ */
+static void loop_stall_init(void)
+{
+    if (loop_stall.magic != LOOP_STALL_MAGIC) {
+        loop_stall.magic = LOOP_STALL_MAGIC;
+        loop_stall.count = 0;
+        loop_stall.reported = true;
+    } else if (!loop_stall.reported || loop_stall.active) {
+        // we never got to report it, so it is likely what caused the
+        // reset
+        loop_stall.reset = true;
+        loop_stall.reported = false;
+    }
+    loop_stall.active = false;
+}
+
+// name of a loop stage, as a pointer to program memory
+static const char *loop_stage_name(uint8_t stage)
+{
+    if (stage >= STAGE_IDLE && stage <= STAGE_STARTUP) {
+        return loop_stage_names[stage - STAGE_IDLE];
+    }
+    if (stage < PERF_TASK_SCHED_0) {
+        return perf_task_names[stage];
+    }
+    if ((uint8_t)(stage - PERF_TASK_SCHED_0) < NUM_SCHED_TASKS) {
+        return scheduler_tasks[stage - PERF_TASK_SCHED_0].name;
+    }
+    return PSTR("?");
+}
+
+/*
+ *  report the last stall to the GCS and the log, once the main loop has
+ *  recovered from it. Called at 1Hz
+ */
+static void loop_stall_report(void)
+{
+    if (loop_stall.reported || loop_stall.active) {
+        return;
+    }
+    loop_stall.reported = true;
+
+    char name[9];
+    strncpy_P(name, loop_stage_name(loop_stall.stage), sizeof(name)-1);
+    name[sizeof(name)-1] = 0;
+    gcs_send_text_fmt(PSTR("Loop stall %ums in %s%s"),
+                      (unsigned)loop_stall.duration_ms,
+                      name,
+                      loop_stall.reset ? " (reset)" : "");
+    Log_Write_Stall();
+}
@@ -0,0 +1,207 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  fast math kernels
+ *
+ *  Table and polynomial replacements for the libm calls in navigation
+ *  and the HIL handlers. Each libm sin, atan2 or exp call takes hundreds
+ *  of microseconds on the AVR. These take a few tens. Angles are in
+ *  centidegrees. Trig results are Q14, so FAST_TRIG_ONE is 1.0.
+ *
+ *  Error bounds, checked against libm with the "fastmath" CLI test:
+ *    fast_sin_cd(), fast_cos_cd()   within 1e-4
+ *    fast_atan2_cd()                within 1 centidegree
+ *    fast_sqrt()                    exact, rounded down
+ *    fast_hypot()                   within 2 parts in 10^4, plus 1
+ *    fast_exp()                     within 5 parts in 10^6
+ *    fast_get_distance()            within 1 part in 10^3, plus 1m
+ *    fast_get_bearing_cd()          within 5 centidegrees
+ */
+
+#define FAST_TRIG_ONE   16384
+
+// sin of 0 to 90 degrees in 1 degree steps, Q14
+static const uint16_t fast_sin_table[91] PROGMEM = {
+        0,   286,   572,   857,  1143,  1428,  1713,  1997,  2280,  2563,
+     2845,  3126,  3406,  3686,  3964,  4240,  4516,  4790,  5063,  5334,
+     5604,  5872,  6138,  6402,  6664,  6924,  7182,  7438,  7692,  7943,
+     8192,  8438,  8682,  8923,  9162,  9397,  9630,  9860, 10087, 10311,
+    10531, 10749, 10963, 11174, 11381, 11585, 11786, 11982, 12176, 12365,
+    12551, 12733, 12911, 13085, 13255, 13421, 13583, 13741, 13894, 14044,
+    14189, 14330, 14466, 14598, 14726, 14849, 14968, 15082, 15191, 15296,
+    15396, 15491, 15582, 15668, 15749, 15826, 15897, 15964, 16026, 16083,
+    16135, 16182, 16225, 16262, 16294, 16322, 16344, 16362, 16374, 16382,
+    16384
+};
+
+// atan of 0 to 1 in steps of 1/64, in quarters of a centidegree
+static const uint16_t fast_atan_table[65] PROGMEM = {
+        0,   358,   716,  1074,  1431,  1787,  2142,  2497,  2850,  3202,
+     3552,  3901,  4248,  4593,  4936,  5276,  5614,  5950,  6283,  6614,
+     6942,  7266,  7588,  7907,  8222,  8535,  8844,  9149,  9452,  9751,
+    10046, 10338, 10626, 10911, 11192, 11469, 11743, 12013, 12280, 12543,
+    12802, 13058, 13310, 13558, 13803, 14045, 14283, 14517, 14748, 14975,
+    15199, 15420, 15638, 15852, 16062, 16270, 16474, 16676, 16874, 17069,
+    17261, 17450, 17636, 17820, 18000
+};
+
+/*
+ *  sin of an angle in centidegrees, Q14. Linear interpolation in the
+ *  1 degree table
+ */
+static int16_t fast_sin_cd(int32_t angle_cd)
+{
+    angle_cd %= 36000;
+    if (angle_cd < 0) angle_cd += 36000;
+
+    bool negative = false;
+    if (angle_cd >= 18000) {
+        angle_cd -= 18000;
+        negative = true;
+    }
+    if (angle_cd > 9000) {
+        angle_cd = 18000 - angle_cd;
+    }
+
+    uint8_t i = angle_cd / 100;
+    uint8_t frac = angle_cd % 100;
+    int16_t result = pgm_read_word(&fast_sin_table[i]);
+    if (frac != 0) {
+        int16_t next = pgm_read_word(&fast_sin_table[i+1]);
+        result += ((int32_t)(next - result) * frac + 50) / 100;
+    }
+    return negative ? -result : result;
+}
+
+static int16_t fast_cos_cd(int32_t angle_cd)
+{
+    return fast_sin_cd(angle_cd + 9000);
+}
+
+/*
+ *  atan2(y, x) in centidegrees, -18000 to 18000
+ */
+static int32_t fast_atan2_cd(int32_t y, int32_t x)
+{
+    uint32_t ax = labs(x);
+    uint32_t ay = labs(y);
+    if (ax == 0 && ay == 0) {
+        return 0;
+    }
+
+    // keep the ratio calculation in 32 bits
+    while (ax > 0xFFFF || ay > 0xFFFF) {
+        ax >>= 1;
+        ay >>= 1;
+    }
+
+    // reduce to the first octant, where the ratio is 0 to 1
+    bool swap = ay > ax;
+    uint32_t ratio = swap ? (ax << 16) / ay : (ay << 16) / ax;     // Q16
+
+    int32_t angle;
+    uint8_t i = ratio >> 10;
+    if (i >= 64) {
+        angle = 4500;
+    } else {
+        uint16_t frac = ratio & 0x3FF;
+        int32_t a0 = pgm_read_word(&fast_atan_table[i]);
+        int32_t a1 = pgm_read_word(&fast_atan_table[i+1]);
+        angle = (a0 * 1024 + (a1 - a0) * frac + 2048) >> 12;
+    }
+
+    if (swap) angle = 9000 - angle;
+    if (x < 0) angle = 18000 - angle;
+    if (y < 0) angle = -angle;
+    return angle;
+}
+
+/*
+ *  integer square root, rounded down
+ */
+static uint16_t fast_sqrt(uint32_t v)
+{
+    uint32_t result = 0;
+    uint32_t bit = 1UL << 30;
+
+    while (bit > v) {
+        bit >>= 2;
+    }
+    while (bit != 0) {
+        if (v >= result + bit) {
+            v -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+/*
+ *  length of the vector (x, y). Large vectors are shifted down until
+ *  their squares fit in 32 bits, which costs up to 2 parts in 10^4
+ */
+static uint32_t fast_hypot(int32_t x, int32_t y)
+{
+    uint32_t ax = labs(x);
+    uint32_t ay = labs(y);
+    uint8_t shift = 0;
+
+    while (ax > 0x7FFF || ay > 0x7FFF) {
+        ax >>= 1;
+        ay >>= 1;
+        shift++;
+    }
+    return (uint32_t)fast_sqrt(ax * ax + ay * ay) << shift;
+}
+
+/*
+ *  e^x, for |x| below 80. Reduced to 2^n * e^r, with |r| at most ln(2)/2,
+ *  and e^r taken from its series to the r^5 term
+ */
+static float fast_exp(float x)
+{
+    int16_t n = x * 1.44269504f + (x < 0 ? -0.5f : 0.5f);
+    float r = x - n * 0.69314718f;
+    float e = 1 + r * (1 + r * (0.5f + r * (1/6.0f + r * (1/24.0f + r * (1/120.0f)))));
+    return ldexp(e, n);
+}
+
+/*
+ *  v * k, with k in Q14. v is split so that this doesn't overflow for
+ *  |v| below 2^30
+ */
+static int32_t fast_mul_q14(int32_t v, int16_t k)
+{
+    return (v >> 14) * k + (((v & 0x3FFF) * k) >> 14);
+}
+
+/*
+ *  longitude difference scaled by cos(latitude), so it is in the same
+ *  units as a latitude difference
+ */
+static int32_t fast_longitude_scale(int32_t dlng, int32_t lat)
+{
+    return fast_mul_q14(dlng, fast_cos_cd(lat / 100000));     // 1e-7 degrees to centidegrees
+}
+
+/*
+ *  get_distance() and get_bearing_cd() from AP_Math, without libm. The
+ *  navigation update uses its per leg frame instead, see navigation.ino
+ */
+static int32_t fast_get_distance(const struct Location *loc1, const struct Location *loc2)
+{
+    int32_t dlat = loc2->lat - loc1->lat;
+    int32_t dlng = fast_longitude_scale(loc2->lng - loc1->lng, loc2->lat);
+    return fast_hypot(dlat, dlng) * 0.01113195f;       // meters per 1e-7 degrees
+}
+
+static int32_t fast_get_bearing_cd(const struct Location *loc1, const struct Location *loc2)
+{
+    int32_t dlat = loc2->lat - loc1->lat;
+    int32_t dlng = fast_longitude_scale(loc2->lng - loc1->lng, loc2->lat);
+    int32_t bearing = fast_atan2_cd(dlng, dlat);
+    if (bearing < 0) bearing += 36000;
+    return bearing;
+}
@@ -6,25 +6,69 @@
 
 #if GEOFENCE_ENABLED == ENABLED
 
+/*
+ *  After the return point, the fence points are one or more closed
+ *  polygons, each ending with a repeat of its own first point. A
+ *  position is inside the fence if it is inside an odd number of them,
+ *  so the first polygon can be the survey area, with further polygons
+ *  inside it as no-fly zones, or separate areas that may be flown in.
+ *
+ *  The fence is held in a local frame centred on the return point,
+ *  with x north in 1e-7 degrees of latitude and y east scaled by
+ *  cos(latitude) to the same units, so distances come out right.
+ *
+ *  The bounding box of the fence is divided into a
+ *  GEOFENCE_GRID x GEOFENCE_GRID grid. Each row of the grid is a slab
+ *  of y, with a bitmask of the edges that pass through it, so a ray
+ *  cast only has to look at the edges near the point. Grid cells that
+ *  no edge passes through are marked as wholly inside or wholly
+ *  outside the fence, so for a point well inside the fence the check
+ *  is a box test and a table lookup.
+ */
+#define GEOFENCE_GRID 8
+
+enum geofence_cell {
+    GEOFENCE_CELL_EDGE    = 0,  // an edge passes through, or not classified yet
+    GEOFENCE_CELL_INSIDE  = 1,
+    GEOFENCE_CELL_OUTSIDE = 2
+};
+
+struct geofence_edge {
+    // end points in the local frame, with y0 <= y1
+    int32_t x0, y0;
+    int32_t x1, y1;
+    float dxdy;
+};
+
 /*
  *  The state of geo-fencing. This structure is dynamically allocated
  *  the first time it is used. This means we only pay for the pointer
  *  and not the structure on systems where geo-fencing is not being
- *  used.
- *
- *  We store a copy of the boundary in memory as we need to access it
- *  very quickly at runtime
+ *  used. The edges are allocated separately, sized for the number of
+ *  fence points.
  */
 static struct geofence_state {
-    uint8_t num_points;
+    uint8_t num_edges;
+    uint8_t max_edges;          // size of the edges allocation
     bool boundary_uptodate;
     bool fence_triggered;
     uint16_t breach_count;
     uint8_t breach_type;
     uint32_t breach_time;
     byte old_switch_position;
-    /* point 0 is the return point */
-    Vector2l boundary[MAX_FENCEPOINTS];
+    // the return point, which is also the origin of the local frame
+    Vector2l return_point;
+    // distance to the nearest edge, meters, positive inside the fence
+    float boundary_distance;
+    bool distance_valid;
+    float lng_scale;
+    // bounding box of the fence in the local frame
+    int32_t min_x, min_y, max_x, max_y;
+    int32_t cell_x, cell_y;     // size of a grid cell
+    uint8_t rows_classified;    // rows of cells[] filled in
+    uint16_t cells[GEOFENCE_GRID];  // 2 bits per cell, enum geofence_cell
+    uint8_t slab_edges[GEOFENCE_GRID][(MAX_FENCEPOINTS+7)/8];
+    struct geofence_edge *edges;
 } *geofence_state;
 
 
@@ -67,7 +111,182 @@ static void set_fence_point_with_index(Vector2l &point, unsigned i)
 
     if (geofence_state != NULL) {
         geofence_state->boundary_uptodate = false;
+        if (i == (unsigned)g.fence_total-1) {
+            // that was the last point of an upload, load the new
+            // boundary before the next geofence_check() needs it
+            idle_work_request(IDLE_WORK_GEOFENCE_LOAD);
+        }
+    }
+}
+
+/*
+ *  convert a position to the local frame of the fence
+ */
+static Vector2l geofence_to_local(int32_t lat, int32_t lng)
+{
+    Vector2l ret;
+    ret.x = lat - geofence_state->return_point.x;
+    ret.y = (lng - geofence_state->return_point.y) * geofence_state->lng_scale;
+    return ret;
+}
+
+// grid cell column or slab row holding a local coordinate
+static uint8_t geofence_cell_index(int32_t v, int32_t min_v, int32_t cell_size)
+{
+    return (v - min_v) / cell_size;
+}
+
+/*
+ *  ray cast towards +x from a point inside the bounding box, looking
+ *  only at the edges that pass through its slab
+ */
+static bool geofence_slab_outside(int32_t px, int32_t py)
+{
+    uint8_t row = geofence_cell_index(py, geofence_state->min_y, geofence_state->cell_y);
+    const uint8_t *mask = geofence_state->slab_edges[row];
+    bool outside = true;
+
+    for (uint8_t b=0; b<sizeof(geofence_state->slab_edges[0]); b++) {
+        if (mask[b] == 0) {
+            continue;
+        }
+        for (uint8_t bit=0; bit<8; bit++) {
+            if (!(mask[b] & (1<<bit))) {
+                continue;
+            }
+            const struct geofence_edge *e = &geofence_state->edges[b*8 + bit];
+            if (py < e->y0 || py >= e->y1) {
+                continue;
+            }
+            if (px < e->x0 + (py - e->y0) * e->dxdy) {
+                outside = !outside;
+            }
+        }
+    }
+    return outside;
+}
+
+/*
+ *  return true if a point (in the local frame) is outside the fence
+ */
+static bool geofence_outside(const Vector2l &p)
+{
+    if (p.x < geofence_state->min_x || p.x > geofence_state->max_x ||
+        p.y < geofence_state->min_y || p.y > geofence_state->max_y) {
+        return true;
+    }
+    uint8_t col = geofence_cell_index(p.x, geofence_state->min_x, geofence_state->cell_x);
+    uint8_t row = geofence_cell_index(p.y, geofence_state->min_y, geofence_state->cell_y);
+    switch ((geofence_state->cells[row] >> (2*col)) & 3) {
+    case GEOFENCE_CELL_INSIDE:
+        return false;
+    case GEOFENCE_CELL_OUTSIDE:
+        return true;
+    }
+    return geofence_slab_outside(p.x, p.y);
+}
+
+/*
+ *  distance from a point to the nearest edge, in local frame units. The
+ *  edges of the point's slab are tried first, and any edge whose
+ *  bounding box is further away than the closest edge so far is
+ *  skipped, so usually only a few edges need a full distance
+ *  calculation
+ */
+static float geofence_nearest_edge(const Vector2l &p)
+{
+    int32_t py = constrain(p.y, geofence_state->min_y, geofence_state->max_y);
+    const uint8_t *mask = geofence_state->slab_edges[geofence_cell_index(py, geofence_state->min_y, geofence_state->cell_y)];
+    float best_sq = -1;
+
+    for (uint8_t pass=0; pass<2; pass++) {
+        for (uint8_t i=0; i<geofence_state->num_edges; i++) {
+            bool in_slab = (mask[i>>3] & (1<<(i&7))) != 0;
+            if (in_slab != (pass == 0)) {
+                continue;
+            }
+            const struct geofence_edge *e = &geofence_state->edges[i];
+
+            // lower bound from the bounding box of the edge
+            int32_t xmin = min(e->x0, e->x1);
+            int32_t xmax = max(e->x0, e->x1);
+            int32_t dx = 0, dy = 0;
+            if (p.x < xmin) {
+                dx = xmin - p.x;
+            } else if (p.x > xmax) {
+                dx = p.x - xmax;
+            }
+            if (p.y < e->y0) {
+                dy = e->y0 - p.y;
+            } else if (p.y > e->y1) {
+                dy = p.y - e->y1;
+            }
+            float bound = max(dx, dy);
+            if (best_sq >= 0 && bound*bound >= best_sq) {
+                continue;
+            }
+
+            // nearest point on the edge
+            float ex = e->x1 - e->x0;
+            float ey = e->y1 - e->y0;
+            float qx = p.x - e->x0;
+            float qy = p.y - e->y0;
+            float len_sq = ex*ex + ey*ey;
+            if (len_sq > 0) {
+                float t = constrain((qx*ex + qy*ey) / len_sq, 0, 1);
+                qx -= t*ex;
+                qy -= t*ey;
+            }
+            float d_sq = qx*qx + qy*qy;
+            if (best_sq < 0 || d_sq < best_sq) {
+                best_sq = d_sq;
+            }
+        }
+    }
+    return sqrt(best_sq);
+}
+
+/*
+ *  classify the next row of grid cells. A cell that no edge's bounding
+ *  box reaches is wholly on one side of the fence, and which side is
+ *  given by the number of edges crossing the slab to its right, so no
+ *  ray cast is needed. Returns true if there are more rows to do
+ */
+static bool geofence_classify_row(void)
+{
+    uint8_t row = geofence_state->rows_classified;
+    if (row >= GEOFENCE_GRID) {
+        return false;
+    }
+    const uint8_t *mask = geofence_state->slab_edges[row];
+    int32_t yc = geofence_state->min_y + row*geofence_state->cell_y + geofence_state->cell_y/2;
+    uint16_t cells = 0;
+
+    for (uint8_t col=0; col<GEOFENCE_GRID; col++) {
+        int32_t cx0 = geofence_state->min_x + col*geofence_state->cell_x;
+        int32_t cx1 = cx0 + geofence_state->cell_x;
+        bool crossed = false;
+        bool outside = true;
+        for (uint8_t i=0; i<geofence_state->num_edges && !crossed; i++) {
+            if (!(mask[i>>3] & (1<<(i&7)))) {
+                continue;
+            }
+            const struct geofence_edge *e = &geofence_state->edges[i];
+            int32_t xmin = min(e->x0, e->x1);
+            int32_t xmax = max(e->x0, e->x1);
+            if (xmin < cx1 && xmax >= cx0) {
+                crossed = true;
+            } else if (xmin >= cx1 && yc >= e->y0 && yc < e->y1) {
+                outside = !outside;
+            }
+        }
+        if (!crossed) {
+            cells |= (outside?GEOFENCE_CELL_OUTSIDE:GEOFENCE_CELL_INSIDE) << (2*col);
+        }
     }
+    geofence_state->cells[row] = cells;
+    geofence_state->rows_classified++;
+    return geofence_state->rows_classified < GEOFENCE_GRID;
 }
 
 /*
@@ -76,6 +295,9 @@ static void set_fence_point_with_index(Vector2l &point, unsigned i)
 static void geofence_load(void)
 {
     uint8_t i;
+    uint8_t num_edges;
+    uint8_t poly_edges;
+    Vector2l first, prev;
 
     if (geofence_state == NULL) {
         if (memcheck_available_memory() < 512 + sizeof(struct geofence_state)) {
@@ -93,17 +315,105 @@ static void geofence_load(void)
         g.fence_total.set(0);
         return;
     }
+    if (g.fence_total > MAX_FENCEPOINTS || g.fence_total < 5) {
+        goto failed;
+    }
 
-    for (i=0; i<g.fence_total; i++) {
-        geofence_state->boundary[i] = get_fence_point_with_index(i);
+    // point 0 is the return point, the rest are polygons. There is
+    // one less edge than points in each polygon, so this is enough
+    // for even a single polygon
+    num_edges = g.fence_total - 2;
+    if (geofence_state->max_edges < num_edges) {
+        free(geofence_state->edges);
+        geofence_state->edges = NULL;
+        geofence_state->max_edges = 0;
+        if (memcheck_available_memory() < 512 + num_edges*sizeof(struct geofence_edge)) {
+            goto failed;
+        }
+        geofence_state->edges = (struct geofence_edge *)calloc(num_edges, sizeof(struct geofence_edge));
+        if (geofence_state->edges == NULL) {
+            goto failed;
+        }
+        geofence_state->max_edges = num_edges;
     }
-    geofence_state->num_points = i;
 
-    if (!Polygon_complete(&geofence_state->boundary[1], geofence_state->num_points-1)) {
-        // first point and last point must be the same
+    geofence_state->return_point = get_fence_point_with_index(0);
+    geofence_state->lng_scale = cos(radians(geofence_state->return_point.x * 1.0e-7));
+
+    first = get_fence_point_with_index(1);
+    prev = geofence_to_local(first.x, first.y);
+    geofence_state->min_x = geofence_state->max_x = prev.x;
+    geofence_state->min_y = geofence_state->max_y = prev.y;
+
+    num_edges = 0;
+    poly_edges = 0;
+    for (i=2; i<g.fence_total; i++) {
+        Vector2l pt = get_fence_point_with_index(i);
+        Vector2l p = geofence_to_local(pt.x, pt.y);
+        if (poly_edges == 0 && i != 2) {
+            // start of the next polygon
+            first = pt;
+            prev = p;
+            continue;
+        }
+        struct geofence_edge *e = &geofence_state->edges[num_edges++];
+        if (prev.y <= p.y) {
+            e->x0 = prev.x; e->y0 = prev.y;
+            e->x1 = p.x;    e->y1 = p.y;
+        } else {
+            e->x0 = p.x;    e->y0 = p.y;
+            e->x1 = prev.x; e->y1 = prev.y;
+        }
+        if (e->y1 != e->y0) {
+            e->dxdy = (float)(e->x1 - e->x0) / (float)(e->y1 - e->y0);
+        } else {
+            // never crosses a ray, so never used
+            e->dxdy = 0;
+        }
+        geofence_state->min_x = min(geofence_state->min_x, p.x);
+        geofence_state->max_x = max(geofence_state->max_x, p.x);
+        geofence_state->min_y = min(geofence_state->min_y, p.y);
+        geofence_state->max_y = max(geofence_state->max_y, p.y);
+        prev = p;
+        poly_edges++;
+        if (pt == first) {
+            if (poly_edges < 3) {
+                // not a polygon
+                goto failed;
+            }
+            poly_edges = 0;
+        }
+    }
+    if (poly_edges != 0) {
+        // last point must close the last polygon
         goto failed;
     }
-    if (Polygon_outside(geofence_state->boundary[0], &geofence_state->boundary[1], geofence_state->num_points-1)) {
+    geofence_state->num_edges = num_edges;
+
+    // size the cells so the whole box, edges included, fits in the grid
+    geofence_state->cell_x = (geofence_state->max_x - geofence_state->min_x) / GEOFENCE_GRID + 1;
+    geofence_state->cell_y = (geofence_state->max_y - geofence_state->min_y) / GEOFENCE_GRID + 1;
+
+    // an edge is in every slab that its y range overlaps. Edges along
+    // x never cross a ray, but are needed to classify the cells
+    memset(geofence_state->slab_edges, 0, sizeof(geofence_state->slab_edges));
+    for (i=0; i<num_edges; i++) {
+        const struct geofence_edge *e = &geofence_state->edges[i];
+        uint8_t row0 = geofence_cell_index(e->y0, geofence_state->min_y, geofence_state->cell_y);
+        uint8_t row1 = geofence_cell_index(e->y1, geofence_state->min_y, geofence_state->cell_y);
+        for (uint8_t row=row0; row<=row1; row++) {
+            geofence_state->slab_edges[row][i>>3] |= (1<<(i&7));
+        }
+    }
+
+    // cells are classified in idle time, until then every cell is
+    // checked with a ray cast
+    memset(geofence_state->cells, 0, sizeof(geofence_state->cells));
+    geofence_state->rows_classified = 0;
+    geofence_state->distance_valid = false;
+    idle_work_request(IDLE_WORK_GEOFENCE_LOAD);
+
+    if (geofence_outside(Vector2l(0,0))) {
         // return point needs to be inside the fence
         goto failed;
     }
@@ -120,6 +430,22 @@ failed:
     gcs_send_text_P(SEVERITY_HIGH,PSTR("geo-fence setup error"));
 }
 
+/*
+ *  load a changed boundary, or classify the grid of a loaded one, in
+ *  idle time. Returns true if there is more work to do
+ */
+static bool geofence_preload(void)
+{
+    if (geofence_state == NULL || !geofence_enabled()) {
+        return false;
+    }
+    if (!geofence_state->boundary_uptodate) {
+        geofence_load();
+        return false;
+    }
+    return geofence_classify_row();
+}
+
 /*
  *  return true if geo-fencing is enabled
  */
@@ -186,8 +512,8 @@ static void geofence_check(bool altitude_check_only)
             g.fence_total >= 5 &&
             geofence_state->boundary_uptodate &&
             geofence_state->old_switch_position == oldSwitchPosition &&
-            guided_WP.lat == geofence_state->boundary[0].x &&
-            guided_WP.lng == geofence_state->boundary[0].y) {
+            guided_WP.lat == geofence_state->return_point.x &&
+            guided_WP.lng == geofence_state->return_point.y) {
             geofence_state->old_switch_position = 0;
             reset_control_switch();
         }
@@ -214,10 +540,15 @@ static void geofence_check(bool altitude_check_only)
         outside = true;
         breach_type = FENCE_BREACH_MAXALT;
     } else if (!altitude_check_only && ahrs.get_position(&loc)) {
-        Vector2l location;
-        location.x = loc.lat;
-        location.y = loc.lng;
-        outside = Polygon_outside(location, &geofence_state->boundary[1], geofence_state->num_points-1);
+        Vector2l location = geofence_to_local(loc.lat, loc.lng);
+        outside = geofence_outside(location);
+        float distance = geofence_nearest_edge(location) * 0.01113195;
+        geofence_state->boundary_distance = outside ? -distance : distance;
+        geofence_state->distance_valid = true;
+        if (geofence_state->boundary_distance < g.fence_margin) {
+            // close enough to the boundary to turn back now
+            outside = true;
+        }
         if (outside) {
             breach_type = FENCE_BREACH_BOUNDARY;
         }
@@ -275,8 +606,8 @@ static void geofence_check(bool altitude_check_only)
         guided_WP.id = 0;
         guided_WP.p1  = 0;
         guided_WP.options = 0;
-        guided_WP.lat = geofence_state->boundary[0].x;
-        guided_WP.lng = geofence_state->boundary[0].y;
+        guided_WP.lat = geofence_state->return_point.x;
+        guided_WP.lng = geofence_state->return_point.y;
 
         geofence_state->old_switch_position = oldSwitchPosition;
 
@@ -320,9 +651,25 @@ static void geofence_send_status(mavlink_channel_t chan)
                                       geofence_state->breach_count,
                                       geofence_state->breach_type,
                                       geofence_state->breach_time);
+        if (geofence_state->distance_valid) {
+            mavlink_msg_named_value_float_send(chan, millis(), "FENCE_DIST",
+                                               geofence_state->boundary_distance);
+        }
     }
 }
 
+/*
+ *  heap the geofence takes when it has the most points, for features
+ *  allocated before it that should leave room
+ */
+static size_t geofence_memory_needed(void)
+{
+    if (geofence_state != NULL) {
+        return 0;
+    }
+    return sizeof(struct geofence_state) + (MAX_FENCEPOINTS - 2) * sizeof(struct geofence_edge);
+}
+
 // public function for use in failsafe modules
 bool geofence_breached(void)
 {
@@ -340,5 +687,11 @@ static bool geofence_stickmixing(void) {
 static bool geofence_enabled(void) {
     return false;
 }
+static bool geofence_preload(void) {
+    return false;
+}
+static size_t geofence_memory_needed(void) {
+    return 0;
+}
 
 #endif // GEOFENCE_ENABLED
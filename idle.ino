@@ -0,0 +1,123 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  idle work queue
+ *
+ *  Work that doesn't need to happen inside the control tick is posted
+ *  here with idle_work_request(), and done by the main loop while it
+ *  waits for the next IMU sample. Each item has a worst case cost, and
+ *  is only started if it will finish before the next sample is due.
+ *  Items are served round robin so a busy item can't starve the rest.
+ */
+
+typedef bool (*idle_work_fn_t)(void);
+
+// work waiting to be done, one bit per enum idle_work
+static uint8_t idle_work_pending = (1<<IDLE_WORK_COMPASS);
+// the item to look at first on the next call to idle_run()
+static uint8_t idle_next_work;
+// when the time given to idle_run() is up, while it is running
+static uint32_t idle_deadline_us;
+static bool idle_running;
+
+/*
+ *  the work items. Each returns true if it has more to do
+ */
+static bool idle_mavlink_retry(void)
+{
+    // try to send any deferred messages now the serial port may have
+    // some space available
+    gcs_send_message(MSG_RETRY_DEFERRED);
+    return mavlink_have_deferred();
+}
+
+static bool idle_param_send(void)
+{
+    gcs_send_message(MSG_NEXT_PARAM);
+    return false;
+}
+
+static bool idle_waypoint_send(void)
+{
+    gcs_send_message(MSG_NEXT_WAYPOINT);
+    return false;
+}
+
+static bool idle_compass_accumulate(void)
+{
+    // the compass is often very noisy but is not interrupt driven, so
+    // it can't accumulate readings by itself
+    if (g.compass_enabled) {
+        compass.accumulate();
+    }
+    return true;
+}
+
+static const struct idle_work_item {
+    idle_work_fn_t function;
+    uint16_t cost_micros;
+} idle_work_items[IDLE_NUM_WORK] PROGMEM = {
+    { idle_mavlink_retry,       1000 }, // IDLE_WORK_MAVLINK_RETRY
+    { idle_param_send,          2500 }, // IDLE_WORK_PARAM_SEND
+    { idle_waypoint_send,        600 }, // IDLE_WORK_WAYPOINT_SEND
+    { geofence_preload,         5000 }, // IDLE_WORK_GEOFENCE_LOAD
+    { idle_compass_accumulate,   800 }, // IDLE_WORK_COMPASS
+    { mission_cache_flush_step,  200 }, // IDLE_WORK_MISSION_FLUSH
+    { param_journal_flush_step, 1500 }, // IDLE_WORK_PARAM_SAVE, see journal.ino
+    { Log_Flush_Step,           1500 }  // IDLE_WORK_LOG_FLUSH
+};
+
+static void idle_work_request(uint8_t work)
+{
+    idle_work_pending |= (1<<work);
+}
+
+/*
+ *  do as much pending work as fits in the given time
+ */
+static void idle_run(uint16_t time_available_us)
+{
+    uint32_t tstart = micros();
+
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_IDLE;
+    idle_deadline_us = tstart + time_available_us;
+    idle_running = true;
+    for (uint8_t n=0; n<IDLE_NUM_WORK && idle_work_pending != 0; n++) {
+        uint8_t i = idle_next_work;
+        if (++idle_next_work == IDLE_NUM_WORK) {
+            idle_next_work = 0;
+        }
+
+        uint8_t mask = (1<<i);
+        if (!(idle_work_pending & mask)) {
+            continue;
+        }
+        uint16_t cost = pgm_read_word(&idle_work_items[i].cost_micros);
+        if (micros() - tstart + cost > time_available_us) {
+            // doesn't fit, something cheaper might
+            continue;
+        }
+
+        idle_work_pending &= ~mask;
+        idle_work_fn_t fn = (idle_work_fn_t)pgm_read_pointer(&idle_work_items[i].function);
+        if (fn()) {
+            idle_work_pending |= mask;
+        }
+    }
+    idle_running = false;
+    loop_stage = saved_stage;
+}
+
+/*
+ *  the time a work item has left to run in. Work items called from
+ *  outside idle_run(), for example to flush everything before a
+ *  reboot, have as long as they need
+ */
+static uint32_t idle_time_left(void)
+{
+    if (!idle_running) {
+        return 0xFFFFFFFF;
+    }
+    int32_t left = idle_deadline_us - micros();
+    return left > 0 ? left : 0;
+}
@@ -0,0 +1,139 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  write-behind parameter journal
+ *
+ *  Saving a parameter means several EEPROM byte writes of 3.4ms each,
+ *  which is too long to do in the middle of a control tick. Instead the
+ *  new value is set in RAM and the parameter is queued here, then saved
+ *  from the idle loop. Saving the same parameter again before it has
+ *  reached EEPROM moves it to the end of the queue rather than adding a
+ *  second entry, so parameters always reach EEPROM in the order of
+ *  their most recent change. An entry also waits for any mission
+ *  changes made before it, so for example a jump counter is stored
+ *  before the command index that depends on it.
+ *
+ *  AP_Param::save() finds the parameter in EEPROM and then writes each
+ *  changed byte, waiting for the one before it to finish, so a float
+ *  can hold the CPU for over 10ms. A save is only started when the
+ *  idle loop has that long left in the tick. If the ticks are so busy
+ *  that it doesn't fit for PARAM_JOURNAL_MAX_WAIT_MS, it is done anyway.
+ */
+
+#define PARAM_JOURNAL_SIZE 8
+#define PARAM_JOURNAL_MAX_WAIT_MS 5000
+#define PARAM_SAVE_SCAN_MICROS 1500     // finding the parameter in EEPROM
+#define EEPROM_WRITE_MICROS 3400        // each byte write after the first
+
+static struct param_journal_entry {
+    AP_Param *vp;
+    uint8_t size;           // bytes in the value
+    bool after_mission;     // wait for the mission cache to be written back
+} param_journal[PARAM_JOURNAL_SIZE];
+static uint8_t param_journal_head;
+static uint8_t param_journal_count;
+static uint32_t param_journal_wait_ms;  // when the head entry was first put off
+
+/*
+ *  save the entry at the head of the journal, if EEPROM is free.
+ *  Returns true while there is more to save
+ */
+static bool param_journal_flush_step(void)
+{
+    if (param_journal_count == 0) {
+        return false;
+    }
+    struct param_journal_entry *e = &param_journal[param_journal_head];
+    if (e->after_mission && mission_cache_dirty()) {
+        mission_cache_flush_step();
+        return true;
+    }
+    if (!eeprom_is_ready()) {
+        return true;
+    }
+    uint32_t needed = PARAM_SAVE_SCAN_MICROS + (e->size - 1) * (uint32_t)EEPROM_WRITE_MICROS;
+    if (idle_time_left() < needed) {
+        if (param_journal_wait_ms == 0) {
+            param_journal_wait_ms = millis() | 1;
+        }
+        if (millis() - param_journal_wait_ms < PARAM_JOURNAL_MAX_WAIT_MS) {
+            return true;
+        }
+    }
+    param_journal_wait_ms = 0;
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_EEPROM_WRITE;
+    e->vp->save();
+    loop_stage = saved_stage;
+    if (++param_journal_head == PARAM_JOURNAL_SIZE) {
+        param_journal_head = 0;
+    }
+    param_journal_count--;
+    return param_journal_count != 0;
+}
+
+/*
+ *  save everything in the journal now, for when we are about to reboot
+ *  or enter the CLI
+ */
+static void param_journal_flush_all(void)
+{
+    while (param_journal_flush_step()) ;
+}
+
+/*
+ *  queue a parameter that has just been set to be saved
+ */
+static void param_save_deferred(AP_Param *vp, enum ap_var_type type)
+{
+#if CONTROL_FIXED == ENABLED
+    if (type == AP_PARAM_FLOAT) {
+        // the gains are all floats, pick up the change straight away
+        control_fixed_load();
+    }
+#endif
+
+    // remove any older entry for this parameter, closing up the gap
+    uint8_t n = 0;
+    for (uint8_t i=0; i<param_journal_count; i++) {
+        uint8_t from = (param_journal_head + i) % PARAM_JOURNAL_SIZE;
+        if (param_journal[from].vp == vp) {
+            continue;
+        }
+        param_journal[(param_journal_head + n) % PARAM_JOURNAL_SIZE] = param_journal[from];
+        n++;
+    }
+    param_journal_count = n;
+
+    if (param_journal_count == PARAM_JOURNAL_SIZE) {
+        // full, make room the slow way
+        struct param_journal_entry *e = &param_journal[param_journal_head];
+        if (e->after_mission) {
+            mission_cache_flush_all();
+        }
+        uint8_t saved_stage = loop_stage;
+        loop_stage = STAGE_EEPROM_WRITE;
+        e->vp->save();
+        loop_stage = saved_stage;
+        if (++param_journal_head == PARAM_JOURNAL_SIZE) {
+            param_journal_head = 0;
+        }
+        param_journal_count--;
+    }
+
+    struct param_journal_entry *e = &param_journal[(param_journal_head + param_journal_count) % PARAM_JOURNAL_SIZE];
+    e->vp = vp;
+    switch (type) {
+    case AP_PARAM_INT8:
+        e->size = 1;
+        break;
+    case AP_PARAM_INT16:
+        e->size = 2;
+        break;
+    default:
+        e->size = 4;
+        break;
+    }
+    e->after_mission = mission_cache_dirty();
+    param_journal_count++;
+    idle_work_request(IDLE_WORK_PARAM_SAVE);
+}
@@ -1,5 +1,18 @@
 // -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
 
+// meters per 1e-7 degrees of latitude
+#define NAV_LEG_METERS 0.01113195f
+
+// The current leg, as a flat earth frame centred on next_WP. It is set
+// up once per leg by reset_crosstrack(), so that each navigation
+// update is a handful of integer multiplies and table lookups
+static struct {
+    int32_t lat, lng;           // frame origin
+    int16_t lng_scale;          // cos(latitude), Q14
+    int16_t dir_north;          // leg unit vector, Q14
+    int16_t dir_east;
+} nav_leg;
+
 //****************************************************************
 // Function that will calculate the desired direction to fly and distance
 //****************************************************************
@@ -15,19 +28,16 @@ static void navigate()
         return;
     }
 
-    // waypoint distance from plane
+    // waypoint distance from plane, and target_bearing, which is
+    // where we should be heading
     // ----------------------------
-    wp_distance = get_distance(&current_loc, &next_WP);
+    update_leg_position();
 
     if (wp_distance < 0) {
         gcs_send_text_P(SEVERITY_HIGH,PSTR("WP error - distance < 0"));
         return;
     }
 
-    // target_bearing is where we should be heading
-    // --------------------------------------------
-    target_bearing_cd       = get_bearing_cd(&current_loc, &next_WP);
-
     // nav_bearing will includes xtrac correction
     // ------------------------------------------
     nav_bearing_cd = target_bearing_cd;
@@ -90,7 +100,12 @@ static void calc_airspeed_errors()
         target_airspeed_cm = (g.flybywire_airspeed_max * 100);
 
     airspeed_error_cm = target_airspeed_cm - aspeed_cm;
+#if CONTROL_FIXED == ENABLED
+    int32_t aspeed_cm_int = aspeed_cm;
+    airspeed_energy_error = ((target_airspeed_cm * target_airspeed_cm) - (aspeed_cm_int * aspeed_cm_int)) / 20000;
+#else
     airspeed_energy_error = ((target_airspeed_cm * target_airspeed_cm) - (aspeed_cm*aspeed_cm))*0.00005;
+#endif
 }
 
 static void calc_gndspeed_undershoot()
@@ -179,9 +194,10 @@ static void update_crosstrack(void)
         Vector2f wind2d = Vector2f(wind.x, wind.y);
         float speed;
         if (ahrs.airspeed_estimate(&speed)) {
-            Vector2f nav_vector = Vector2f(cos(radians(nav_bearing_cd*0.01)), sin(radians(nav_bearing_cd*0.01))) * speed;
+            Vector2f nav_vector = Vector2f(fast_cos_cd(nav_bearing_cd), fast_sin_cd(nav_bearing_cd)) * (speed / FAST_TRIG_ONE);
             Vector2f nav_adjusted = nav_vector - wind2d;
-            nav_bearing_cd = degrees(atan2(nav_adjusted.y, nav_adjusted.x)) * 100;
+            // in cm/s, as fast_atan2_cd() takes integers
+            nav_bearing_cd = fast_atan2_cd(nav_adjusted.y * 100, nav_adjusted.x * 100);
         }
     }
 
@@ -190,16 +206,64 @@ static void update_crosstrack(void)
     // If we are too far off or too close we don't do track following
     if (wp_totalDistance >= g.crosstrack_min_distance && 
         abs(wrap_180_cd(target_bearing_cd - crosstrack_bearing_cd)) < 4500) {
-        // Meters we are off track line
-        crosstrack_error = sin(radians((target_bearing_cd - crosstrack_bearing_cd) * 0.01)) * wp_distance;               
+        // Meters we are off track line. This is the cross product of the
+        // leg direction and the vector to next_WP
+        int32_t north, east;
+        nav_leg_offset(&north, &east);
+        crosstrack_error = (fast_mul_q14(east, nav_leg.dir_north) - fast_mul_q14(north, nav_leg.dir_east)) * NAV_LEG_METERS;
         nav_bearing_cd += constrain(crosstrack_error * g.crosstrack_gain, -g.crosstrack_entry_angle.get(), g.crosstrack_entry_angle.get());
         nav_bearing_cd = wrap_360_cd(nav_bearing_cd);
     }
 
 }
 
+/*
+ *  set up the frame for a new leg from prev_WP to next_WP, and a new
+ *  crosstrack bearing
+ */
 static void reset_crosstrack()
 {
-    crosstrack_bearing_cd   = get_bearing_cd(&prev_WP, &next_WP);       // Used for track following
+    nav_leg_centre();
+
+    int32_t north = next_WP.lat - prev_WP.lat;
+    int32_t east = fast_mul_q14(next_WP.lng - prev_WP.lng, nav_leg.lng_scale);
+    crosstrack_bearing_cd   = wrap_360_cd(fast_atan2_cd(east, north));   // Used for track following
+    nav_leg.dir_north = fast_cos_cd(crosstrack_bearing_cd);
+    nav_leg.dir_east = fast_sin_cd(crosstrack_bearing_cd);
+}
+
+// put the leg frame origin on next_WP
+static void nav_leg_centre(void)
+{
+    nav_leg.lat = next_WP.lat;
+    nav_leg.lng = next_WP.lng;
+    nav_leg.lng_scale = fast_cos_cd(next_WP.lat / 100000);     // 1e-7 degrees to centidegrees
+}
+
+/*
+ *  the vector from the current location to next_WP in the leg frame,
+ *  in 1e-7 degrees of latitude
+ */
+static void nav_leg_offset(int32_t *north, int32_t *east)
+{
+    if (next_WP.lat != nav_leg.lat || next_WP.lng != nav_leg.lng) {
+        // next_WP has been moved without setting up a new leg, as
+        // loiter and RTL do. Keep the old leg direction, as the
+        // crosstrack bearing always has been
+        nav_leg_centre();
+    }
+    *north = next_WP.lat - current_loc.lat;
+    *east = fast_mul_q14(next_WP.lng - current_loc.lng, nav_leg.lng_scale);
+}
+
+/*
+ *  set wp_distance and target_bearing_cd from the current location
+ */
+static void update_leg_position(void)
+{
+    int32_t north, east;
+    nav_leg_offset(&north, &east);
+    wp_distance = fast_hypot(north, east) * NAV_LEG_METERS;
+    target_bearing_cd = wrap_360_cd(fast_atan2_cd(east, north));
 }
 
@@ -0,0 +1,115 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  per-task loop profiler
+ *
+ *  Each stage of the main loop is timed with micros() and accrued into
+ *  a small fixed size table of min/max/mean and a log2 histogram, from
+ *  which the 99th percentile is estimated. The table is reset with the
+ *  rest of the performance monitoring data every 20 seconds, after it
+ *  has been written to the DataFlash log.
+ */
+
+#if LOOP_PROFILER == ENABLED
+
+/*
+ *  account the time since start_us to a task. Returns the current
+ *  time so consecutive stages can be chained
+ */
+static uint32_t perf_record(uint8_t task, uint32_t start_us)
+{
+    uint32_t now = micros();
+    uint32_t dt = now - start_us;
+    uint16_t t = dt > 0xFFFF ? 0xFFFF : dt;
+    struct perf_stats *s = &perf_stats[task];
+
+    if (s->count == 0 || t < s->min_us) {
+        s->min_us = t;
+    }
+    if (t > s->max_us) {
+        s->max_us = t;
+    }
+    s->total_us += t;
+    s->count++;
+
+    uint8_t bin = 0;
+    uint16_t v = t >> PERF_HIST_SHIFT;
+    while (v != 0 && bin < PERF_HIST_BINS-1) {
+        v >>= 1;
+        bin++;
+    }
+    if (s->hist[bin] == 0xFF) {
+        // halve the histogram rather than overflow, this keeps its shape
+        for (uint8_t i=0; i<PERF_HIST_BINS; i++) {
+            s->hist[i] >>= 1;
+        }
+    }
+    s->hist[bin]++;
+
+    return now;
+}
+
+static uint16_t perf_mean_us(uint8_t task)
+{
+    const struct perf_stats *s = &perf_stats[task];
+    if (s->count == 0) {
+        return 0;
+    }
+    return s->total_us / s->count;
+}
+
+/*
+ *  estimate the 99th percentile execution time from the histogram. We
+ *  report the upper edge of the bin holding the percentile, limited to
+ *  the largest time actually seen
+ */
+static uint16_t perf_p99_us(uint8_t task)
+{
+    const struct perf_stats *s = &perf_stats[task];
+    uint16_t total = 0;
+    int8_t i;
+
+    for (i=0; i<PERF_HIST_BINS; i++) {
+        total += s->hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint16_t above = total / 100;
+    uint16_t sum = 0;
+    for (i=PERF_HIST_BINS-1; i>0; i--) {
+        sum += s->hist[i];
+        if (sum > above) {
+            break;
+        }
+    }
+    if (i == PERF_HIST_BINS-1) {
+        return s->max_us;
+    }
+    uint16_t edge = (1U << (i + PERF_HIST_SHIFT)) - 1;
+    return edge < s->max_us ? edge : s->max_us;
+}
+
+// name of a task, as a pointer to program memory
+static const char *perf_task_name(uint8_t task)
+{
+    if (task < PERF_TASK_SCHED_0) {
+        return perf_task_names[task];
+    }
+    return scheduler_tasks[task - PERF_TASK_SCHED_0].name;
+}
+
+static void perf_reset(void)
+{
+    memset(perf_stats, 0, sizeof(perf_stats));
+}
+
+#else // LOOP_PROFILER
+
+static uint32_t perf_record(uint8_t task, uint32_t start_us) {
+    return 0;
+}
+static void perf_reset(void) {
+}
+
+#endif // LOOP_PROFILER
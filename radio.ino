@@ -73,6 +73,9 @@ static void init_rc_out()
 
 static void read_radio()
 {
+#if REPLAY == ENABLED
+    replay_rc();
+#endif
     ch1_temp = APM_RC.InputCh(CH_ROLL);
     ch2_temp = APM_RC.InputCh(CH_PITCH);
 
@@ -91,6 +94,20 @@ static void read_radio()
     g.rc_7.set_pwm(APM_RC.InputCh(CH_7));
     g.rc_8.set_pwm(APM_RC.InputCh(CH_8));
 
+    if (g.log_bitmask & MASK_LOG_REPLAY) {
+        int16_t pwm[8] = {
+            (int16_t)ch1_temp,
+            (int16_t)ch2_temp,
+            g.channel_throttle.radio_in,
+            g.channel_rudder.radio_in,
+            g.rc_5.radio_in,
+            g.rc_6.radio_in,
+            g.rc_7.radio_in,
+            g.rc_8.radio_in
+        };
+        Log_Write_Replay_RC(pwm);
+    }
+
     control_failsafe(g.channel_throttle.radio_in);
 
     g.channel_throttle.servo_out = g.channel_throttle.control_in;
@@ -0,0 +1,378 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  replay of recorded flight inputs
+ *
+ *  With REPLAY set in LOG_BITMASK, every input the control stack takes
+ *  in is logged: the RC inputs, the IMU sample each tick flew on, GPS
+ *  fixes, barometer, airspeed and compass readings, and every MAVLink
+ *  message received. So is the millis() and micros() each tick started
+ *  at, and which scheduler tasks it ran.
+ *
+ *  A desktop HIL_MODE_SENSORS build with REPLAY enabled reads a log
+ *  like that from REPLAY_FILE, or from the file named by the
+ *  REPLAY_FILE environment variable. The file can be a 'dump <n> raw'
+ *  capture or a log downloaded over MAVLink. Each tick is flown again
+ *  with the clock reading what it read in flight, and with each input
+ *  handed over at the point it was taken in. The replay then writes
+ *  its own log, which can be compared with the flight's. Idle work runs
+ *  at the end of each tick, so the replay's log is written out and the
+ *  fence is loaded as in flight. When the log runs out, the replay
+ *  prints how many recorded inputs went unused, which is a sign that
+ *  it has gone a different way from the flight.
+ *
+ *  Each tick record carries a sequence number and a count of the
+ *  tick's inputs that didn't fit in the flight's log ring, so the
+ *  replay reports where the log lost records it needed.
+ *
+ *  The replay needs the parameters and mission from the flight's
+ *  EEPROM. Its own startup takes a different time to the flight's, so
+ *  the clock is moved on by a fixed offset. That keeps every interval
+ *  the controllers see the same. The AHRS takes its integration step
+ *  from the IMU stub driver rather than from the log, and battery and
+ *  RSSI readings are not recorded.
+ */
+
+#if REPLAY == ENABLED
+
+#if LOGGING_ENABLED == DISABLED
+ # error REPLAY needs LOGGING_ENABLED
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define REPLAY_MAX_RECORDS 64       // inputs in one tick
+
+static uint8_t *replay_log;         // the whole log file
+static uint32_t replay_log_size;
+static uint32_t replay_pos;         // where the next tick's records start
+
+// the records of the tick being flown. The first replay_tick.pre of
+// them came in before the tick started
+static struct replay_record {
+    const uint8_t *pkt;
+    bool used;
+} replay_records[REPLAY_MAX_RECORDS];
+static uint8_t replay_num_records;
+static struct log_Replay_Tick replay_tick;
+static bool replay_in_tick;
+
+// what millis() and micros() read, once the first tick has started
+static bool replay_running;
+static uint32_t replay_ms;
+static uint32_t replay_us;
+static uint32_t replay_offset_ms;
+
+static int16_t replay_rc_pwm[8];
+static bool replay_have_rc;
+
+static uint32_t replay_tick_count;
+static uint32_t replay_unused_count;
+static uint32_t replay_lost_count;      // ticks and inputs the flight log lost
+
+static void replay_open(void)
+{
+    const char *name = getenv("REPLAY_FILE");
+    if (name == NULL) {
+        name = REPLAY_FILE;
+    }
+    FILE *f = fopen(name, "rb");
+    if (f == NULL) {
+        cliSerial->printf_P(PSTR("Replay: can't open %s\n"), name);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    replay_log_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    replay_log = (uint8_t *)malloc(replay_log_size + 1);
+    if (replay_log == NULL ||
+        fread(replay_log, 1, replay_log_size, f) != replay_log_size) {
+        cliSerial->printf_P(PSTR("Replay: can't read %s\n"), name);
+        exit(1);
+    }
+    fclose(f);
+    replay_log[replay_log_size] = 0;
+
+    // skip the text in front of a console dump
+    const char *start = strstr((const char *)replay_log, "BINARY LOG START\n");
+    if (start != NULL) {
+        replay_pos = (start - (const char *)replay_log) + 17;
+    }
+
+    // the replay's own log shouldn't record a replay
+    g.log_bitmask.set(g.log_bitmask & ~MASK_LOG_REPLAY);
+
+    cliSerial->printf_P(PSTR("Replay: %s, %lu bytes\n"), name, (unsigned long)replay_log_size);
+}
+
+// the length of a record type, or 0 if it is unknown
+static uint8_t replay_record_length(uint8_t msg_type)
+{
+    for (uint8_t i=0; i<LOG_NUM_STRUCTURES; i++) {
+        if (pgm_read_byte(&log_structure[i].msg_type) == msg_type) {
+            return pgm_read_byte(&log_structure[i].msg_len);
+        }
+    }
+    return 0;
+}
+
+/*
+ *  gather the input records of the next tick, up to its tick record.
+ *  Returns false at the end of the log
+ */
+static bool replay_read_tick(void)
+{
+    replay_num_records = 0;
+    while (replay_pos + 3 <= replay_log_size) {
+        const uint8_t *p = &replay_log[replay_pos];
+        uint8_t len = 0;
+        if (p[0] == HEAD_BYTE1 && p[1] == HEAD_BYTE2) {
+            len = replay_record_length(p[2]);
+        }
+        if (len == 0 || replay_pos + len > replay_log_size || p[len-1] != END_BYTE) {
+            // not a record, look for the next one
+            replay_pos++;
+            continue;
+        }
+        replay_pos += len;
+
+        if (p[2] == LOG_REPLAY_TICK_MSG) {
+            memcpy(&replay_tick, p, sizeof(replay_tick));
+            return true;
+        }
+        if (p[2] < LOG_REPLAY_RC_MSG || p[2] > LOG_REPLAY_GND_MSG) {
+            continue;
+        }
+        if (replay_num_records == REPLAY_MAX_RECORDS) {
+            replay_unused_count++;
+            continue;
+        }
+        replay_records[replay_num_records].pkt = p;
+        replay_records[replay_num_records].used = false;
+        replay_num_records++;
+    }
+    return false;
+}
+
+/*
+ *  take the next unused record of a type, from those that came in
+ *  before the tick or those that came in during it
+ */
+static const uint8_t *replay_take(uint8_t msg_type, bool pre)
+{
+    uint8_t from = pre ? 0 : min(replay_tick.pre, replay_num_records);
+    uint8_t to = pre ? min(replay_tick.pre, replay_num_records) : replay_num_records;
+    for (uint8_t i=from; i<to; i++) {
+        struct replay_record *r = &replay_records[i];
+        if (!r->used && r->pkt[2] == msg_type) {
+            r->used = true;
+            return r->pkt;
+        }
+    }
+    return NULL;
+}
+
+static void replay_set_clock(uint32_t ms, uint32_t us)
+{
+    replay_ms = ms + replay_offset_ms;
+    replay_us = us + replay_offset_ms * 1000;
+}
+
+static void replay_finish(void)
+{
+    Log_Flush();
+    cliSerial->printf_P(PSTR("Replay: done, %lu ticks, %lu inputs not used, %lu lost from the log\n"),
+                        (unsigned long)replay_tick_count,
+                        (unsigned long)replay_unused_count,
+                        (unsigned long)replay_lost_count);
+    exit(replay_unused_count == 0 && replay_lost_count == 0 ? 0 : 2);
+}
+
+// restore the barometer ground calibration the flight made at startup
+static void replay_ground(const struct log_Replay_Ground *pkt)
+{
+    enum ap_var_type var_type;
+    AP_Param *vp = AP_Param::find("GND_ABS_PRESS", &var_type);
+    if (vp != NULL && var_type == AP_PARAM_FLOAT) {
+        ((AP_Float *)vp)->set(pkt->ground_pressure);
+    }
+    vp = AP_Param::find("GND_TEMP", &var_type);
+    if (vp != NULL && var_type == AP_PARAM_FLOAT) {
+        ((AP_Float *)vp)->set(pkt->ground_temperature);
+    }
+}
+
+/*
+ *  set up the next tick, returning true when it is ready to run. Called
+ *  from the main loop in place of waiting for the IMU
+ */
+static bool replay_tick_due(void)
+{
+    if (replay_log == NULL) {
+        replay_open();
+    }
+    for (uint8_t i=0; i<replay_num_records; i++) {
+        if (!replay_records[i].used) {
+            replay_unused_count++;
+        }
+    }
+    uint16_t last_seq = replay_tick.seq;
+    if (!replay_read_tick()) {
+        replay_finish();
+    }
+
+    // the flight's log ring was full at times. A lost tick record
+    // merges two ticks, and lost inputs leave a tick short, so the
+    // replay can go a different way from here
+    if (replay_tick_count != 0 && replay_tick.seq != (uint16_t)(last_seq + 1)) {
+        uint16_t lost = replay_tick.seq - last_seq - 1;
+        cliSerial->printf_P(PSTR("Replay: %u tick records lost before tick %lu\n"),
+                            (unsigned)lost, (unsigned long)replay_tick_count);
+        replay_lost_count += lost;
+    }
+    if (replay_tick.dropped != 0) {
+        cliSerial->printf_P(PSTR("Replay: %u inputs lost in tick %lu\n"),
+                            (unsigned)replay_tick.dropped, (unsigned long)replay_tick_count);
+        replay_lost_count += replay_tick.dropped;
+    }
+
+    if (!replay_running) {
+        // never let the clock go back from where our own startup left it
+        uint32_t now = millis();
+        replay_offset_ms = now > replay_tick.time_ms ? now - replay_tick.time_ms : 0;
+        replay_running = true;
+    }
+
+    // what came in while the flight was waiting for this tick
+    replay_in_tick = false;
+    const uint8_t *pkt;
+    while ((pkt = replay_take(LOG_REPLAY_GND_MSG, true)) != NULL) {
+        replay_ground((const struct log_Replay_Ground *)pkt);
+    }
+    for (uint8_t i=0; i<replay_num_records && i<replay_tick.pre; i++) {
+        const struct log_Replay_Mavlink *m = (const struct log_Replay_Mavlink *)replay_records[i].pkt;
+        if (!replay_records[i].used && m->msgid == LOG_REPLAY_MAV_MSG) {
+            // messages handled in the same call came in at the same time
+            replay_set_clock(m->time_ms, m->time_ms * 1000);
+            gcs_update();
+        }
+    }
+
+    replay_set_clock(replay_tick.time_ms, replay_tick.time_us);
+    ins.set_gyro(Vector3f(replay_tick.gyro_x, replay_tick.gyro_y, replay_tick.gyro_z));
+    ins.set_accel(Vector3f(replay_tick.accel_x, replay_tick.accel_y, replay_tick.accel_z));
+    replay_in_tick = true;
+    replay_tick_count++;
+    return true;
+}
+
+// did the scheduler run this task in the flight's tick?
+static bool replay_task_ran(uint8_t task)
+{
+    return (replay_tick.sched_ran & (1UL<<task)) != 0;
+}
+
+/*
+ *  the next recorded MAVLink message for a channel, put back together
+ *  from its chunks
+ */
+static bool replay_mavlink(uint8_t chan, mavlink_message_t *msg)
+{
+    const struct log_Replay_Mavlink *m;
+    for (uint8_t i=0; i<replay_num_records; i++) {
+        bool pre = i < replay_tick.pre;
+        m = (const struct log_Replay_Mavlink *)replay_records[i].pkt;
+        if (replay_records[i].used || pre == replay_in_tick ||
+            m->msgid != LOG_REPLAY_MAV_MSG || m->chan != chan || m->ofs != 0) {
+            continue;
+        }
+        if (pre && m->time_ms + replay_offset_ms != replay_ms) {
+            // came in on a later call
+            return false;
+        }
+        memset(msg, 0, sizeof(*msg));
+        msg->msgid = m->mav_msgid;
+        msg->sysid = m->sysid;
+        msg->compid = m->compid;
+        msg->len = m->len;
+        uint8_t *payload = (uint8_t *)_MAV_PAYLOAD_NON_CONST(msg);
+        uint16_t ofs = 0;
+        for (uint8_t j=i; j<replay_num_records && ofs < m->len; j++) {
+            const struct log_Replay_Mavlink *c = (const struct log_Replay_Mavlink *)replay_records[j].pkt;
+            if (replay_records[j].used && j != i) {
+                continue;
+            }
+            if (c->msgid == LOG_REPLAY_MAV_MSG && c->chan == chan && c->ofs == ofs) {
+                memcpy(&payload[ofs], c->data, min(m->len - ofs, LOG_REPLAY_MAV_CHUNK));
+                replay_records[j].used = true;
+                ofs += LOG_REPLAY_MAV_CHUNK;
+            }
+        }
+        replay_records[i].used = true;
+        return true;
+    }
+    return false;
+}
+
+// hand over the RC inputs, which are only logged when they change
+static void replay_rc(void)
+{
+    const struct log_Replay_RC *pkt = (const struct log_Replay_RC *)replay_take(LOG_REPLAY_RC_MSG, false);
+    if (pkt != NULL) {
+        memcpy(replay_rc_pwm, pkt->pwm, sizeof(replay_rc_pwm));
+        replay_have_rc = true;
+    }
+    if (replay_have_rc) {
+        // set them every tick, in case a replayed RC override has
+        // changed them
+        APM_RC.setHIL(replay_rc_pwm);
+    }
+}
+
+static void replay_gps(void)
+{
+    const struct log_Replay_GPS *pkt = (const struct log_Replay_GPS *)replay_take(LOG_REPLAY_GPS_MSG, false);
+    if (pkt == NULL) {
+        return;
+    }
+    // setHIL() marks the fix as new, then the fields are set exactly
+    g_gps->setHIL(pkt->gps_time,
+                  pkt->latitude*1.0e-7, pkt->longitude*1.0e-7, pkt->altitude*0.01,
+                  pkt->ground_speed*0.01, pkt->ground_course*0.01, 0, pkt->num_sats);
+    g_gps->time = pkt->gps_time;
+    g_gps->latitude = pkt->latitude;
+    g_gps->longitude = pkt->longitude;
+    g_gps->altitude = pkt->altitude;
+    g_gps->ground_speed = pkt->ground_speed;
+    g_gps->ground_course = pkt->ground_course;
+    g_gps->num_sats = pkt->num_sats;
+    g_gps->fix = pkt->fix;
+}
+
+static void replay_baro(void)
+{
+    const struct log_Replay_Baro *pkt = (const struct log_Replay_Baro *)replay_take(LOG_REPLAY_BARO_MSG, false);
+    if (pkt != NULL) {
+        barometer.setHIL(pkt->temperature, pkt->pressure);
+    }
+}
+
+static void replay_airspeed(void)
+{
+    const struct log_Replay_Airspeed *pkt = (const struct log_Replay_Airspeed *)replay_take(LOG_REPLAY_ASPD_MSG, false);
+    if (pkt != NULL) {
+        airspeed.set_HIL(pkt->airspeed);
+    }
+}
+
+static void replay_compass(void)
+{
+    const struct log_Replay_Mag *pkt = (const struct log_Replay_Mag *)replay_take(LOG_REPLAY_MAG_MSG, false);
+    if (pkt != NULL) {
+        compass.mag_x = pkt->mag_x;
+        compass.mag_y = pkt->mag_y;
+        compass.mag_z = pkt->mag_z;
+    }
+}
+
+#endif // REPLAY
@@ -0,0 +1,72 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  main loop task scheduler
+ *
+ *  After fast_loop() has run, each task in scheduler_tasks[] that is
+ *  due is run in priority order, as long as its expected run time fits
+ *  in what is left of the 20ms tick. Tasks that don't fit are pushed
+ *  back to the next tick, unless they are already a full interval
+ *  late, in which case they run regardless so that low priority tasks
+ *  can't be starved forever.
+ */
+
+typedef void (*sched_task_fn_t)(void);
+
+static void sched_init(void)
+{
+    // spread tasks of the same rate over different ticks, so they
+    // don't all fall due together. The n'th task of a rate first
+    // runs n ticks in, so they keep the order they are listed in
+    for (uint8_t i=0; i<NUM_SCHED_TASKS; i++) {
+        uint16_t interval = pgm_read_word(&scheduler_tasks[i].interval_ticks);
+        uint8_t n = 0;
+        for (uint8_t j=0; j<i; j++) {
+            if (pgm_read_word(&scheduler_tasks[j].interval_ticks) == interval) {
+                n++;
+            }
+        }
+        sched_last_run[i] = sched_tick_counter + 1 + (n % interval) - interval;
+    }
+}
+
+static void sched_run(void)
+{
+    sched_tick_counter++;
+    sched_ran = 0;
+
+    for (uint8_t i=0; i<NUM_SCHED_TASKS; i++) {
+        uint16_t interval = pgm_read_word(&scheduler_tasks[i].interval_ticks);
+        uint16_t since = sched_tick_counter - sched_last_run[i];
+        if (since < interval) {
+            continue;
+        }
+
+        uint16_t max_time = pgm_read_word(&scheduler_tasks[i].max_time_micros);
+        uint32_t tstart = micros();
+#if REPLAY == ENABLED
+        // the clock stands still in a replay, so run just the tasks
+        // that ran in flight
+        if (!replay_task_ran(i)) {
+#else
+        if (tstart - fast_loopTimer_us + max_time > SCHED_LOOP_MICROS &&
+            since < 2*interval) {
+#endif
+            // not enough time left in this tick
+            if (sched_skip_count < 0xFF) {
+                sched_skip_count++;
+            }
+            continue;
+        }
+
+        sched_task_fn_t fn = (sched_task_fn_t)pgm_read_pointer(&scheduler_tasks[i].function);
+        loop_stage = PERF_TASK_SCHED_0 + i;
+        fn();
+        sched_last_run[i] = sched_tick_counter;
+        sched_ran |= (1UL<<i);
+
+        if (micros() - tstart > max_time && sched_overrun_count < 0xFF) {
+            sched_overrun_count++;
+        }
+        perf_record(PERF_TASK_SCHED_0 + i, tstart);
+    }
+}
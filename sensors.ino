@@ -7,7 +7,10 @@ static LowPassFilterInt32 altitude_filter;
 static void init_barometer(void)
 {
     gcs_send_text_P(SEVERITY_LOW, PSTR("Calibrating barometer"));    
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_BARO_CALIBRATE;
     barometer.calibrate(mavlink_delay);
+    loop_stage = saved_stage;
 
     // filter at 100ms sampling, with 0.7Hz cutoff frequency
     altitude_filter.set_cutoff_frequency(0.1, 0.7);
@@ -20,20 +23,52 @@ static void init_barometer(void)
 // above the calibration altitude
 static int32_t read_barometer(void)
 {
+#if REPLAY == ENABLED
+    replay_baro();
+#endif
     barometer.read();
+    if (g.log_bitmask & MASK_LOG_REPLAY) {
+        Log_Write_Replay_Baro();
+    }
     return altitude_filter.apply(barometer.get_altitude() * 100.0);
 }
 
+#if HIL_MODE != HIL_MODE_DISABLED
+// approximate a barometer reading for an altitude in millimeters
+static void hil_set_barometer(int32_t alt_mm)
+{
+    float y;
+    const float Temp = 312;
+
+    y = (alt_mm - 584000.0) / 29271.267;
+    y /= (Temp / 10.0) + 273.15;
+    y = fast_exp(-y);
+    y *= 95446.0;
+
+    barometer.setHIL(Temp, y);
+}
+#endif
+
 // in M/S * 100
 static void read_airspeed(void)
 {
+#if REPLAY == ENABLED
+    replay_airspeed();
+#else
     airspeed.read();
+#endif
+    if (g.log_bitmask & MASK_LOG_REPLAY) {
+        Log_Write_Replay_Airspeed();
+    }
     calc_airspeed_errors();
 }
 
 static void zero_airspeed(void)
 {
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_AIRSPEED_CALIBRATE;
     airspeed.calibrate(mavlink_delay);
+    loop_stage = saved_stage;
     gcs_send_text_P(SEVERITY_LOW,PSTR("zero airspeed calibrated"));
 }
 
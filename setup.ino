@@ -628,6 +628,8 @@ static void zero_eeprom(void)
     for (intptr_t i = 0; i < EEPROM_MAX_ADDR; i++) {
         eeprom_write_byte((uint8_t *) i, b);
     }
+    // drop any unsaved mission changes along with the old mission
+    mission_cache_load();
     cliSerial->printf_P(PSTR("done\n"));
 }
 
@@ -0,0 +1,215 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  built in flight model for desktop simulation
+ *
+ *  With SIM_FDM enabled in a desktop HIL build, a rigid body model of a
+ *  small trainer is flown against the outputs of set_servos(), and its
+ *  state is fed straight into the HIL sensor drivers. There is no
+ *  external simulator and no serial or UDP round trip, so a flight
+ *  depends only on the sketch. With SITL_FAST as well, each tick moves
+ *  the clock on by exactly 20ms, and a flight is repeatable from run to
+ *  run as well as fast.
+ *
+ *  The aerodynamics are linear coefficient models, with the lift slope
+ *  capped at the stall. They are good enough for checking that the
+ *  attitude, pitch and throttle loops close and settle, not for tuning
+ *  a real airframe. There is no wind and no sensor noise.
+ *
+ *  The model steps at SIM_FDM_STEP_MICROS, catching up with the sketch
+ *  clock at the start of each fast_loop(), so it sees the servo outputs
+ *  from the end of the tick before.
+ */
+
+#if SIM_FDM == ENABLED
+
+#define SIM_FDM_STEP_MICROS     2500        // 400Hz
+#define SIM_FDM_GPS_MILLIS      100         // 10Hz fixes
+
+// airframe
+#define SIM_MASS        2.0f        // kg
+#define SIM_WING_AREA   0.45f       // m^2
+#define SIM_SPAN        1.8f        // m
+#define SIM_CHORD       0.25f       // m
+#define SIM_IXX         0.10f       // kg m^2
+#define SIM_IYY         0.15f
+#define SIM_IZZ         0.22f
+#define SIM_THRUST_MAX  20.0f       // N, static
+#define SIM_PROP_SPEED  35.0f       // m/s, where thrust falls to zero
+#define SIM_AIR_DENSITY 1.225f      // kg/m^3
+
+// aerodynamic coefficients, per radian. Controls are -1 to 1, with
+// positive giving roll right, pitch up and yaw right
+#define SIM_CL0         0.25f
+#define SIM_CL_ALPHA    5.0f
+#define SIM_ALPHA_STALL 0.26f
+#define SIM_CD0         0.03f
+#define SIM_CD_K        0.06f       // induced drag, times CL^2
+#define SIM_CY_BETA     -0.5f
+#define SIM_CL_BETA     -0.08f      // dihedral effect
+#define SIM_CL_P        -0.5f
+#define SIM_CL_AIL      0.15f
+#define SIM_CM0         0.02f
+#define SIM_CM_ALPHA    -0.8f
+#define SIM_CM_Q        -12.0f
+#define SIM_CM_ELEV     0.5f
+#define SIM_CN_BETA     0.08f
+#define SIM_CN_R        -0.15f
+#define SIM_CN_RUDDER   0.06f
+
+static bool sim_started;
+static uint32_t sim_time_us;        // sketch clock the model has reached
+static uint32_t sim_gps_ms;         // when the last fix was given
+static Vector3f sim_position;       // meters north, east and down from the start point on the ground
+static Vector3f sim_velocity;       // earth frame, m/s
+static Vector3f sim_gyro;           // body rates, rad/s
+static Vector3f sim_accel;          // body frame specific force, m/s/s
+static Matrix3f sim_dcm;            // body to earth rotation
+
+static void sim_fdm_start(void)
+{
+    sim_position = Vector3f(0, 0, -SIM_FDM_START_HEIGHT);
+    sim_velocity = Vector3f(SIM_FDM_START_SPEED, 0, 0);
+    sim_gyro = Vector3f(0, 0, 0);
+    sim_accel = Vector3f(0, 0, -gravity);
+    sim_dcm.from_euler(0, 0, 0);
+    sim_time_us = micros();
+    sim_gps_ms = 0;
+    sim_started = true;
+}
+
+// keep the rotation matrix orthonormal, as AP_AHRS_DCM does
+static void sim_fdm_normalize(void)
+{
+    float error = sim_dcm.a * sim_dcm.b;
+    Vector3f a = sim_dcm.a - sim_dcm.b * (0.5f * error);
+    Vector3f b = sim_dcm.b - sim_dcm.a * (0.5f * error);
+    sim_dcm.a = a.normalized();
+    sim_dcm.b = b.normalized();
+    sim_dcm.c = sim_dcm.a % sim_dcm.b;
+}
+
+/*
+ *  advance the model by one step of dt seconds
+ */
+static void sim_fdm_step(float dt)
+{
+    float aileron  = constrain(g.channel_roll.norm_output(), -1, 1);
+    float elevator = constrain(g.channel_pitch.norm_output(), -1, 1);
+    float rudder   = constrain(g.channel_rudder.norm_output(), -1, 1);
+    // norm_output() is -1..1 about the mid PWM, make it 0..1
+    float throttle = constrain((g.channel_throttle.norm_output() + 1) * 0.5f, 0, 1);
+
+    Vector3f vel_body = sim_dcm.transposed() * sim_velocity;
+    float airspeed = vel_body.length();
+
+    Vector3f force(0, 0, 0);
+    Vector3f moment(0, 0, 0);
+    if (airspeed > 1) {
+        float alpha = atan2(vel_body.z, vel_body.x);
+        float beta = asin(constrain(vel_body.y / airspeed, -1, 1));
+        float qbar = 0.5f * SIM_AIR_DENSITY * airspeed * airspeed;
+        float b_2v = SIM_SPAN / (2 * airspeed);
+        float c_2v = SIM_CHORD / (2 * airspeed);
+
+        float cl = SIM_CL0 + SIM_CL_ALPHA * constrain(alpha, -SIM_ALPHA_STALL, SIM_ALPHA_STALL);
+        float lift = qbar * SIM_WING_AREA * cl;
+        float drag = qbar * SIM_WING_AREA * (SIM_CD0 + SIM_CD_K * cl * cl);
+        force.x = lift * sin(alpha) - drag * cos(alpha);
+        force.y = qbar * SIM_WING_AREA * SIM_CY_BETA * beta;
+        force.z = -lift * cos(alpha) - drag * sin(alpha);
+
+        moment.x = qbar * SIM_WING_AREA * SIM_SPAN *
+                   (SIM_CL_BETA * beta + SIM_CL_P * sim_gyro.x * b_2v + SIM_CL_AIL * aileron);
+        moment.y = qbar * SIM_WING_AREA * SIM_CHORD *
+                   (SIM_CM0 + SIM_CM_ALPHA * alpha + SIM_CM_Q * sim_gyro.y * c_2v + SIM_CM_ELEV * elevator);
+        moment.z = qbar * SIM_WING_AREA * SIM_SPAN *
+                   (SIM_CN_BETA * beta + SIM_CN_R * sim_gyro.z * b_2v + SIM_CN_RUDDER * rudder);
+    }
+    force.x += SIM_THRUST_MAX * throttle * max(1 - vel_body.x / SIM_PROP_SPEED, 0);
+
+    // rotation, with a diagonal inertia matrix
+    Vector3f gyro_dot;
+    gyro_dot.x = (moment.x - (SIM_IZZ - SIM_IYY) * sim_gyro.y * sim_gyro.z) / SIM_IXX;
+    gyro_dot.y = (moment.y - (SIM_IXX - SIM_IZZ) * sim_gyro.x * sim_gyro.z) / SIM_IYY;
+    gyro_dot.z = (moment.z - (SIM_IYY - SIM_IXX) * sim_gyro.x * sim_gyro.y) / SIM_IZZ;
+    sim_gyro += gyro_dot * dt;
+    sim_dcm.rotate(sim_gyro * dt);
+    sim_fdm_normalize();
+
+    // translation
+    Vector3f accel_earth = sim_dcm * (force / SIM_MASS);
+    accel_earth.z += gravity;
+    Vector3f old_velocity = sim_velocity;
+    sim_velocity += accel_earth * dt;
+    sim_position += sim_velocity * dt;
+
+    if (sim_position.z >= 0) {
+        // on the ground. Sit level on the wheels, with some rolling
+        // resistance
+        float roll, pitch, yaw;
+        sim_dcm.to_euler(&roll, &pitch, &yaw);
+        sim_dcm.from_euler(0, 0, yaw);
+        sim_gyro = Vector3f(0, 0, sim_gyro.z);
+        sim_position.z = 0;
+        sim_velocity.z = min(sim_velocity.z, 0);
+        sim_velocity.x *= 1 - 0.5f * dt;
+        sim_velocity.y *= 1 - 0.5f * dt;
+    }
+
+    // what the accelerometers feel is everything but gravity
+    accel_earth = (sim_velocity - old_velocity) / dt;
+    accel_earth.z -= gravity;
+    sim_accel = sim_dcm.transposed() * accel_earth;
+}
+
+/*
+ *  feed the model state to the HIL sensor drivers
+ */
+static void sim_fdm_sensors(void)
+{
+    ins.set_gyro(sim_gyro);
+    ins.set_accel(sim_accel);
+
+    float alt = SIM_FDM_START_ALT - sim_position.z;
+    hil_set_barometer(alt * 1000);
+
+    uint32_t tnow = millis();
+    if (tnow - sim_gps_ms >= SIM_FDM_GPS_MILLIS) {
+        sim_gps_ms = tnow;
+        // 1e-7 degrees of latitude is 0.01113195 meters
+        float lat = (SIM_FDM_START_LAT + sim_position.x / 0.01113195) * 1.0e-7;
+        float lng = (SIM_FDM_START_LNG + sim_position.y / (0.01113195 * cos(ToRad(SIM_FDM_START_LAT * 1.0e-7)))) * 1.0e-7;
+        float speed = sqrt(sq(sim_velocity.x) + sq(sim_velocity.y));
+        float cog = wrap_360_cd(ToDeg(atan2(sim_velocity.y, sim_velocity.x)) * 100) * 0.01;
+        g_gps->setHIL(tnow, lat, lng, alt, speed, cog, 0, 10);
+    }
+
+    Vector3f vel_body = sim_dcm.transposed() * sim_velocity;
+    airspeed.set_HIL(vel_body.x > 0 ? vel_body.x : 0);
+    calc_airspeed_errors();
+
+ #if HIL_MODE == HIL_MODE_ATTITUDE
+    float roll, pitch, yaw;
+    sim_dcm.to_euler(&roll, &pitch, &yaw);
+    ahrs.setHil(roll, pitch, yaw, sim_gyro.x, sim_gyro.y, sim_gyro.z);
+ #endif
+}
+
+/*
+ *  bring the model up to the sketch clock and update the sensors.
+ *  Called at the start of every fast_loop()
+ */
+static void sim_fdm_update(void)
+{
+    if (!sim_started) {
+        sim_fdm_start();
+    }
+    uint32_t tnow = micros();
+    while (tnow - sim_time_us >= SIM_FDM_STEP_MICROS) {
+        sim_fdm_step(SIM_FDM_STEP_MICROS * 1.0e-6f);
+        sim_time_us += SIM_FDM_STEP_MICROS;
+    }
+    sim_fdm_sensors();
+}
+
+#endif // SIM_FDM
@@ -54,6 +54,10 @@ static void run_cli(FastSerial *port)
     // disable the failsafe code in the CLI
     timer_scheduler.set_failsafe(NULL);
 
+    // the CLI reads and writes EEPROM directly
+    param_journal_flush_all();
+    mission_cache_flush_all();
+
     cliSerial = port;
     Menu::set_port(port);
     port->set_blocking_writes(true);
@@ -67,6 +71,8 @@ static void run_cli(FastSerial *port)
 
 static void init_ardupilot()
 {
+    loop_stall_init();
+
 #if USB_MUX_PIN > 0
     // on the APM2 board we have a mux thet switches UART0 between
     // USB and the board header. If the right ArduPPM firmware is
@@ -130,6 +136,9 @@ static void init_ardupilot()
     // Check the EEPROM format version before loading any parameters from EEPROM.
     //
     load_parameters();
+#if LOG_DOWNLOAD == ENABLED
+    param_snapshot_init();
+#endif
 
     // keep a record of how many resets have happened. This can be
     // used to detect in-flight resets
@@ -163,6 +172,7 @@ static void init_ardupilot()
     }
     if (g.log_bitmask != 0) {
         DataFlash.start_new_log();
+        Log_Write_Formats();
     }
 #endif
 
@@ -274,11 +284,24 @@ static void init_ardupilot()
             Log_Write_Startup(TYPE_GROUNDSTART_MSG);
     }
 
+    // after the mission cache, which needs the memory more
+    param_index_build();
+
     set_mode(MANUAL);
 
     // set the correct flight mode
     // ---------------------------
     reset_control_switch();
+
+    sched_init();
+
+#if CONTROL_FIXED == ENABLED
+    control_fixed_load();
+#endif
+
+    if (g.log_bitmask & MASK_LOG_REPLAY) {
+        Log_Write_Replay_Ground();
+    }
 }
 
 //********************************************************************************
@@ -315,6 +338,7 @@ static void startup_ground(void)
 
     // initialize commands
     // -------------------
+    mission_cache_load();
     init_commands();
 
     // Makes the servos wiggle - 3 times signals ready to fly
@@ -436,6 +460,8 @@ static void startup_INS_ground(bool force_accel_level)
     gcs_send_text_P(SEVERITY_MEDIUM, PSTR("Beginning INS calibration; do not move plane"));
     mavlink_delay(1000);
 
+    uint8_t saved_stage = loop_stage;
+    loop_stage = STAGE_INS_CALIBRATE;
     ins.init(AP_InertialSensor::COLD_START, 
              ins_sample_rate,
              mavlink_delay, flash_leds, &timer_scheduler);
@@ -447,6 +473,7 @@ static void startup_INS_ground(bool force_accel_level)
         ins.init_accel(mavlink_delay, flash_leds);
     }
 #endif
+    loop_stage = saved_stage;
     ahrs.set_fly_forward(true);
     ahrs.reset();
 
@@ -505,6 +532,12 @@ static void resetPerfData(void) {
     ahrs.renorm_blowup_count = 0;
     gps_fix_count                   = 0;
     pmTest1                                 = 0;
+    sched_overrun_count             = 0;
+    sched_skip_count                = 0;
+    log_dropped_count               = 0;
+    isr_loop_gap_max_us             = 0;
+    isr_rc_gap_max_us               = 0;
+    perf_reset();
     perf_mon_timer                  = millis();
 }
 
@@ -575,6 +608,8 @@ uint16_t board_voltage(void)
 static void reboot_apm(void)
 {
     cliSerial->printf_P(PSTR("REBOOTING\n"));
+    param_journal_flush_all();
+    mission_cache_flush_all();
     delay(100); // let serial flush
     // see http://www.arduino.cc/cgi-bin/yabb2/YaBB.pl?num=1250663814/
     // for the method
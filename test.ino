@@ -24,6 +24,16 @@ static int8_t   test_eedump(uint8_t argc,               const Menu::arg *argv);
 static int8_t   test_rawgps(uint8_t argc,                       const Menu::arg *argv);
 static int8_t   test_modeswitch(uint8_t argc,           const Menu::arg *argv);
 static int8_t   test_logging(uint8_t argc,              const Menu::arg *argv);
+#if CONTROL_FIXED == ENABLED
+static int8_t   test_fixedpid(uint8_t argc,             const Menu::arg *argv);
+#endif
+static int8_t   test_fastmath(uint8_t argc,             const Menu::arg *argv);
+#if PARAM_INDEX == ENABLED
+static int8_t   test_params(uint8_t argc,               const Menu::arg *argv);
+#endif
+#if LOG_DOWNLOAD == ENABLED
+static int8_t   test_paramsnap(uint8_t argc,            const Menu::arg *argv);
+#endif
 
 // Creates a constant array of structs representing menu options
 // and stores them in Flash memory, not RAM.
@@ -60,6 +70,16 @@ static const struct Menu::command test_menu_commands[] PROGMEM = {
 #elif HIL_MODE == HIL_MODE_ATTITUDE
 #endif
     {"logging",             test_logging},
+#if CONTROL_FIXED == ENABLED
+    {"fixedpid",            test_fixedpid},
+#endif
+    {"fastmath",            test_fastmath},
+#if PARAM_INDEX == ENABLED
+    {"params",              test_params},
+#endif
+#if LOG_DOWNLOAD == ENABLED
+    {"paramsnap",           test_paramsnap},
+#endif
 
 };
 
@@ -406,6 +426,282 @@ test_logging(uint8_t argc, const Menu::arg *argv)
     return 0;
 }
 
+#if CONTROL_FIXED == ENABLED
+/*
+ *  run the PID library and the fixed point PID of control_fixed.ino side
+ *  by side on the same error ramp, and count the outputs that differ
+ */
+static int8_t
+test_fixedpid(uint8_t argc, const Menu::arg *argv)
+{
+    static const float gains[][4] = {
+        // P     I     D      IMAX
+        { 0.4,  0.0,  0.0,   500 },
+        { 0.65, 0.1,  0.02,  500 },
+        { 1.2,  0.5,  0.05,  4500 },
+        { 0.02, 0.3,  0.0,   20 }
+    };
+    static const int32_t scalers[] = { 32768, 65536, 89784, 131072 };  // Q16
+    int16_t worst = 0;
+
+    for (uint8_t i = 0; i < sizeof(gains) / sizeof(gains[0]); i++) {
+        for (uint8_t s = 0; s < sizeof(scalers) / sizeof(scalers[0]); s++) {
+            PID pid(gains[i][0], gains[i][1], gains[i][2], gains[i][3]);
+            struct fixed_pid fixed;
+            memset(&fixed, 0, sizeof(fixed));
+            fixed_pid_load(&fixed, pid);
+
+            uint8_t differ = 0;
+            int16_t max_diff = 0;
+            for (uint8_t n = 0; n < 50; n++) {
+                // a triangle wave of +-3000, 150 per step
+                int32_t error = 3000 - labs(((n * 150L) % 12000) - 6000);
+                delay(20);
+                int32_t out = pid.get_pid(error, scalers[s] / 65536.0f);
+                int32_t out_fixed = fixed_pid_get(&fixed, error, scalers[s]);
+                int16_t diff = labs(out - out_fixed);
+                if (diff != 0) differ++;
+                max_diff = max(max_diff, diff);
+            }
+            worst = max(worst, max_diff);
+            cliSerial->printf_P(PSTR("P %4.2f I %4.2f D %4.2f IMAX %4.0f scaler %4.2f: %u/50 differ, max %d\n"),
+                                gains[i][0], gains[i][1], gains[i][2], gains[i][3],
+                                scalers[s] / 65536.0f, (unsigned)differ, (int)max_diff);
+        }
+    }
+    // the gains are rounded to Q16, so one unit either way is expected
+    cliSerial->printf_P(PSTR("%S\n"), worst <= 1 ? PSTR("PASS") : PSTR("FAIL"));
+    return (0);
+}
+#endif // CONTROL_FIXED
+
+/*
+ *  check the fast_math.ino kernels against libm, and time them
+ */
+static int8_t
+test_fastmath(uint8_t argc, const Menu::arg *argv)
+{
+    float sin_err = 0, atan2_err = 0, hypot_err = 0, exp_err = 0;
+    bool sqrt_ok = true;
+
+    for (int32_t a = -36000; a <= 36000; a += 7) {
+        sin_err = max(sin_err, fabs(fast_sin_cd(a) / (float)FAST_TRIG_ONE - sin(radians(a * 0.01))));
+        sin_err = max(sin_err, fabs(fast_cos_cd(a) / (float)FAST_TRIG_ONE - cos(radians(a * 0.01))));
+    }
+    for (int32_t a = -17999; a < 18000; a += 13) {
+        // vectors at all angles, at a range of lengths
+        float length = 10 + (a & 0xFF) * 1000.0;
+        int32_t x = length * cos(radians(a * 0.01));
+        int32_t y = length * sin(radians(a * 0.01));
+        float err = fabs(fast_atan2_cd(y, x) - degrees(atan2(y, x)) * 100);
+        atan2_err = max(atan2_err, min(err, 36000 - err));
+        float h = sqrt((float)x * x + (float)y * y);
+        hypot_err = max(hypot_err, fabs(fast_hypot(x, y) - h) - h * 2.0e-4);
+    }
+    for (uint32_t v = 1; v < 0x7FFFFFFF && sqrt_ok; v += v / 3 + 1) {
+        uint32_t r = fast_sqrt(v);
+        sqrt_ok = r * r <= v && (r + 1) * (r + 1) > v;
+    }
+    for (float x = -10; x < 10; x += 0.01) {
+        exp_err = max(exp_err, fabs(fast_exp(x) / exp(x) - 1));
+    }
+
+    // legs of up to about 4km in all directions, at a range of latitudes
+    float dist_err = 0, bearing_err = 0;
+    for (int32_t a = -17999; a < 18000; a += 131) {
+        struct Location loc1 = {}, loc2 = {};
+        loc1.lat = (a % 80) * 10000000L;
+        loc1.lng = a * 10000L;
+        float length = 1000 + (a & 0xFF) * 1400.0;      // 1e-7 degrees
+        loc2.lat = loc1.lat + (int32_t)(length * cos(radians(a * 0.01)));
+        loc2.lng = loc1.lng + (int32_t)(length * sin(radians(a * 0.01)));
+        float d = get_distance(&loc1, &loc2);
+        dist_err = max(dist_err, fabs(fast_get_distance(&loc1, &loc2) - d) - d * 1.0e-3);
+        float err = fabs(fast_get_bearing_cd(&loc1, &loc2) - get_bearing_cd(&loc1, &loc2));
+        bearing_err = max(bearing_err, min(err, 36000 - err));
+    }
+
+    cliSerial->printf_P(PSTR("sin/cos max error %.6f\n"), sin_err);
+    cliSerial->printf_P(PSTR("atan2 max error %.2f cd\n"), atan2_err);
+    cliSerial->printf_P(PSTR("hypot max error beyond 2e-4 %.2f\n"), hypot_err);
+    cliSerial->printf_P(PSTR("sqrt %S\n"), sqrt_ok ? PSTR("exact") : PSTR("WRONG"));
+    cliSerial->printf_P(PSTR("exp max relative error %.7f\n"), exp_err);
+    cliSerial->printf_P(PSTR("distance max error beyond 1e-3 %.2f m\n"), dist_err);
+    cliSerial->printf_P(PSTR("bearing max error %.2f cd\n"), bearing_err);
+
+    // time 100 calls of each, with volatile inputs so nothing is folded away
+    volatile int32_t vi = 4321, vj = -1234;
+    volatile float vf = 0.4321;
+    volatile float result;
+    uint32_t t0 = micros();
+    for (uint8_t n = 0; n < 100; n++) result = fast_sin_cd(vi);
+    uint32_t t1 = micros();
+    for (uint8_t n = 0; n < 100; n++) result = sin(vf);
+    uint32_t t2 = micros();
+    for (uint8_t n = 0; n < 100; n++) result = fast_atan2_cd(vi, vj);
+    uint32_t t3 = micros();
+    for (uint8_t n = 0; n < 100; n++) result = atan2(vf, -vf);
+    uint32_t t4 = micros();
+    for (uint8_t n = 0; n < 100; n++) result = fast_exp(vf);
+    uint32_t t5 = micros();
+    for (uint8_t n = 0; n < 100; n++) result = exp(vf);
+    uint32_t t6 = micros();
+    cliSerial->printf_P(PSTR("us per 100 calls: sin %lu/%lu atan2 %lu/%lu exp %lu/%lu (fast/libm)\n"),
+                        (unsigned long)(t1 - t0), (unsigned long)(t2 - t1),
+                        (unsigned long)(t3 - t2), (unsigned long)(t4 - t3),
+                        (unsigned long)(t5 - t4), (unsigned long)(t6 - t5));
+
+    bool pass = sin_err <= 1.0e-4 && atan2_err <= 1 && hypot_err <= 1 && sqrt_ok && exp_err <= 5.0e-6 &&
+                dist_err <= 1 && bearing_err <= 5;
+    cliSerial->printf_P(PSTR("%S\n"), pass ? PSTR("PASS") : PSTR("FAIL"));
+    return (0);
+}
+
+#if PARAM_INDEX == ENABLED
+/*
+ *  check the parameter index in Parameters.ino against AP_Param, and
+ *  time the lookups
+ */
+static int8_t
+test_params(uint8_t argc, const Menu::arg *argv)
+{
+    AP_Param::ParamToken token;
+    enum ap_var_type type, itype;
+    char name[AP_MAX_NAME_SIZE+1];
+    uint16_t count = 0, bad = 0;
+    uint32_t index_us = 0, find_us = 0;
+
+    name[AP_MAX_NAME_SIZE] = 0;
+    for (AP_Param *vp = AP_Param::first(&token, &type);
+         vp != NULL;
+         vp = AP_Param::next_scalar(&token, &type)) {
+        vp->copy_name(name, AP_MAX_NAME_SIZE, true);
+        int16_t index;
+        uint32_t t0 = micros();
+        AP_Param *ivp = param_find(name, &itype, &index);
+        uint32_t t1 = micros();
+        AP_Param::find(name, &itype);
+        uint32_t t2 = micros();
+        index_us += t1 - t0;
+        find_us += t2 - t1;
+        if (ivp != vp || itype != type || index != count ||
+            param_find_by_index(count, &itype) != vp || itype != type) {
+            cliSerial->printf_P(PSTR("mismatch at %u %s\n"), (unsigned)count, name);
+            bad++;
+        }
+        count++;
+    }
+    if (param_find_by_index(count, &itype) != NULL) {
+        cliSerial->printf_P(PSTR("index %u past the end found\n"), (unsigned)count);
+        bad++;
+    }
+
+    cliSerial->printf_P(PSTR("%u parameters, %u indexed, %u bytes free\n"),
+                        (unsigned)count, (unsigned)param_index_count,
+                        (unsigned)memcheck_available_memory());
+    if (count != 0) {
+        cliSerial->printf_P(PSTR("us per lookup by name: %lu/%lu (index/AP_Param)\n"),
+                            (unsigned long)(index_us / count), (unsigned long)(find_us / count));
+    }
+    bool pass = bad == 0 && param_index_count == count;
+    cliSerial->printf_P(PSTR("%S\n"), pass ? PSTR("PASS") : PSTR("FAIL"));
+    return (0);
+}
+#endif // PARAM_INDEX
+
+#if LOG_DOWNLOAD == ENABLED
+// CRC-32 (zlib) a nibble at a time, separately from the one in
+// Parameters.ino so each checks the other
+static uint32_t test_crc32(uint32_t crc, const uint8_t *data, uint16_t len)
+{
+    static const uint32_t nibble[16] PROGMEM = {
+        0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+        0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+        0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+        0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+    };
+    for (uint16_t i=0; i<len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ pgm_read_dword(&nibble[crc & 0x0F]);
+        crc = (crc >> 4) ^ pgm_read_dword(&nibble[crc & 0x0F]);
+    }
+    return crc;
+}
+
+/*
+ *  read the parameter snapshot the way a GCS would, and check each
+ *  entry against AP_Param and the header CRC against the entries
+ */
+static int8_t
+test_paramsnap(uint8_t argc, const Menu::arg *argv)
+{
+    uint32_t t0 = micros();
+    param_snapshot_start(0);
+    while (!param_snapshot_summed()) ;
+    uint32_t t1 = micros();
+
+    uint8_t header[12];
+    param_snapshot_read(0, header, sizeof(header));
+    uint16_t magic, count;
+    uint32_t length, crc;
+    memcpy(&magic, &header[0], 2);
+    memcpy(&count, &header[2], 2);
+    memcpy(&length, &header[4], 4);
+    memcpy(&crc, &header[8], 4);
+
+    // walk the entries in 90 byte blocks, as LOG_DATA carries them
+    AP_Param::ParamToken token;
+    enum ap_var_type type;
+    AP_Param *vp = AP_Param::first(&token, &type);
+    uint8_t expect[PARAM_SNAPSHOT_ENTRY_MAX];
+    uint8_t expect_len = vp ? param_snapshot_entry(vp, type, expect) : 0;
+    uint8_t expect_pos = 0;
+    uint16_t entries = 0, bad = 0;
+    uint32_t ofs = sizeof(header);
+    uint32_t read_crc = 0xFFFFFFFF;
+    while (ofs < length) {
+        // a window past the header mustn't start the CRC again
+        param_snapshot_start(ofs);
+        uint8_t data[MAVLINK_MSG_LOG_DATA_FIELD_DATA_LEN];
+        uint16_t n = param_snapshot_read(ofs, data, sizeof(data));
+        if (n == 0) {
+            break;
+        }
+        read_crc = test_crc32(read_crc, data, n);
+        for (uint16_t i=0; i<n && vp != NULL; i++) {
+            if (data[i] != expect[expect_pos]) {
+                bad++;
+            }
+            if (++expect_pos == expect_len) {
+                entries++;
+                expect_pos = 0;
+                vp = AP_Param::next_scalar(&token, &type);
+                expect_len = vp ? param_snapshot_entry(vp, type, expect) : 0;
+            }
+        }
+        ofs += n;
+    }
+    uint32_t t2 = micros();
+    read_crc ^= 0xFFFFFFFF;
+
+    // the header still holds the CRC from the request that included it
+    uint32_t later_crc;
+    param_snapshot_read(0, header, sizeof(header));
+    memcpy(&later_crc, &header[8], 4);
+
+    cliSerial->printf_P(PSTR("%u parameters, %lu bytes, %u bytes wrong\n"),
+                        (unsigned)entries, (unsigned long)length, (unsigned)bad);
+    cliSerial->printf_P(PSTR("CRC %08lx, read %08lx, later %08lx\n"),
+                        (unsigned long)crc, (unsigned long)read_crc, (unsigned long)later_crc);
+    cliSerial->printf_P(PSTR("CRC %lu us, read %lu us\n"),
+                        (unsigned long)(t1 - t0), (unsigned long)(t2 - t1));
+    bool pass = magic == PARAM_SNAPSHOT_MAGIC && count == entries && length == ofs &&
+                vp == NULL && bad == 0 && crc == read_crc && later_crc == crc;
+    cliSerial->printf_P(PSTR("%S\n"), pass ? PSTR("PASS") : PSTR("FAIL"));
+    return (0);
+}
+#endif // LOG_DOWNLOAD
+
 //-------------------------------------------------------------------------------------------
 // tests in this section are for real sensors or sensors that have been simulated
 
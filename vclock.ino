@@ -0,0 +1,156 @@
+// -*- tab-width: 4; Mode: C++; c-basic-offset: 4; indent-tabs-mode: nil -*-
+/*
+ *  virtual clock for faster than real time simulation
+ *
+ *  With SITL_FAST enabled in a desktop HIL build, millis() and micros()
+ *  in the sketch read a clock that the simulator drives. The simulator
+ *  steps its model each time it gets our servo outputs, which we send
+ *  at the end of every tick, and replies with a HIL_STATE whose
+ *  time_usec moves the clock on. The main loop runs a tick whenever
+ *  the clock reaches the next 20ms boundary rather than waiting for
+ *  the IMU, so a flight runs as fast as the two sides can swap packets.
+ *
+ *  The servo outputs go straight to the port, not through the
+ *  telemetry queue, whose byte budget runs on the virtual clock and so
+ *  would never refill while the clock waits on the simulator. A
+ *  simulator may step by less than a tick: if its HIL_STATE leaves the
+ *  clock short of the next tick, the outputs are sent again so that it
+ *  takes another step.
+ *
+ *  Until the first HIL_STATE arrives, and whenever the simulator has
+ *  been quiet for VCLOCK_FREERUN_MICROS of wall time, the clock runs at
+ *  wall clock speed so that startup delays and timeouts still expire.
+ *
+ *  With SIM_FDM the simulator is built in, and the clock moves on by
+ *  one tick as each tick finishes, after the idle work has had what
+ *  is left of the tick.
+ *
+ *  With REPLAY the clock reads what it read in flight, see replay.ino.
+ *
+ *  Only the sketch uses the virtual clock. Timeouts inside the
+ *  libraries, and the 1kHz timer interrupt, still run on wall time.
+ */
+
+#if SITL_FAST == ENABLED
+
+#define VCLOCK_FREERUN_MICROS 100000
+
+static uint64_t vclock_base_us;         // virtual time at the last update
+static uint32_t vclock_wall_us;         // wall time at the last update
+static uint64_t vclock_sim_us;          // simulator time at the last update
+static bool vclock_locked;              // have heard from the simulator
+
+static uint64_t vclock_now(void)
+{
+    // (micros) is the wall clock, not our macro
+    uint32_t since = (micros)() - vclock_wall_us;
+    if (!vclock_locked) {
+        return vclock_base_us + since;
+    }
+    if (since > VCLOCK_FREERUN_MICROS) {
+        return vclock_base_us + (since - VCLOCK_FREERUN_MICROS);
+    }
+    return vclock_base_us;
+}
+
+static uint32_t vclock_micros(void)
+{
+#if REPLAY == ENABLED
+    if (replay_running) {
+        return replay_us;
+    }
+#endif
+    return (uint32_t)vclock_now();
+}
+
+static uint32_t vclock_millis(void)
+{
+#if REPLAY == ENABLED
+    if (replay_running) {
+        return replay_ms;
+    }
+#endif
+    return (uint32_t)(vclock_now() / 1000);
+}
+
+/*
+ *  move the clock on to a new simulator time. The clock never goes
+ *  backwards, so time spent free running is not given back
+ */
+static void vclock_set(uint64_t sim_us)
+{
+    uint64_t now = vclock_now();
+    if (vclock_locked && sim_us > vclock_sim_us) {
+        uint64_t t = vclock_base_us + (sim_us - vclock_sim_us);
+        if (t > now) {
+            now = t;
+        }
+    }
+    vclock_base_us = now;
+    vclock_wall_us = (micros)();
+    vclock_sim_us = sim_us;
+    vclock_locked = true;
+}
+
+// is the next main loop tick due?
+static bool vclock_tick_due(void)
+{
+#if REPLAY == ENABLED
+    return replay_tick_due();
+#else
+    return micros() - fast_loopTimer_us >= SCHED_LOOP_MICROS;
+#endif
+}
+
+/*
+ *  send the servo outputs to the simulator, ahead of anything queued
+ *  for the GCS
+ */
+static void vclock_send_servos(void)
+{
+    if (comm_get_txspace(MAVLINK_COMM_0) >= MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_RC_CHANNELS_SCALED_LEN) {
+        send_servo_out(MAVLINK_COMM_0);
+    }
+    if (gcs3.initialised &&
+        comm_get_txspace(MAVLINK_COMM_1) >= MAVLINK_NUM_NON_PAYLOAD_BYTES + MAVLINK_MSG_ID_RC_CHANNELS_SCALED_LEN) {
+        send_servo_out(MAVLINK_COMM_1);
+    }
+}
+
+// called after each tick, to let the simulator take its next step
+static void vclock_tick_done(void)
+{
+#if REPLAY == ENABLED || SIM_FDM == ENABLED
+    // the flight model is built in, or the next tick is read from the
+    // log, so the next tick is due straight away and loop() never gets
+    // to its idle branch. Give the idle work the rest of this tick
+    uint32_t used = micros() - fast_loopTimer_us;
+    if (used < SCHED_LOOP_MICROS - IDLE_GUARD_MICROS) {
+        idle_run(SCHED_LOOP_MICROS - IDLE_GUARD_MICROS - used);
+    }
+#endif
+#if REPLAY == ENABLED
+    // the next tick is read from the log
+#elif SIM_FDM == ENABLED
+    // the flight model steps at the start of the next tick
+    vclock_set(vclock_sim_us + SCHED_LOOP_MICROS);
+#else
+    vclock_send_servos();
+#endif
+}
+
+// called while waiting for the next tick
+static void vclock_wait(void)
+{
+    // look for the HIL_STATE that moves the clock on
+    uint64_t sim_us = vclock_sim_us;
+    gcs_update();
+#if REPLAY == DISABLED && SIM_FDM == DISABLED
+    if (vclock_sim_us != sim_us && !vclock_tick_due()) {
+        // the simulator took a step shorter than a tick, ask for another
+        vclock_send_servos();
+    }
+#endif
+}
+
+#endif // SITL_FAST